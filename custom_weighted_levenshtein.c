@@ -3,98 +3,430 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
 
-typedef enum { false, true } bool;
+/*
 
-double custom_weighted_levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight)
+  A cost model groups characters into up to 256 classes and prices edits by
+  class: an insert and a delete cost per class and a classes x classes
+  substitution matrix.
+
+  Characters are assigned to classes explicitly, anything left unassigned
+  falls back to the class of its category (digit, other alphanumeric, space
+  or anything else).  Code points below 256 are classified through a direct
+  table, explicit assignments above that through a small open addressing
+  hash keyed by the code point plus one.
+
+  Once built, a model is never written to by the distance kernel, so it can
+  be shared between threads.  Like a weight table, it remembers its
+  smallest insert and delete cost and whether any cost is negative for the
+  cost bounded distance.
+
+*/
+
+#define COST_MODEL_LATIN 256
+#define COST_MODEL_MIN_SLOTS 16
+#define COST_STACK_COLS 64
+
+struct cost_model {
+    int classes;
+    unsigned char category_class[COST_MODEL_CATEGORIES];
+    unsigned char latin_class[COST_MODEL_LATIN];
+    unsigned char latin_explicit[COST_MODEL_LATIN];
+
+    size_t slots;
+    size_t used;
+    uint32_t *keys;
+    unsigned char *values;
+
+    /* classes insert and delete costs, classes * classes substitutions */
+    double *insert_costs;
+    double *delete_costs;
+    double *substitute_costs;
+    double min_insert;
+    double min_delete;
+    int negative;
+};
+
+#define D COST_MODEL_DIGIT
+#define A COST_MODEL_ALPHA
+#define S COST_MODEL_SPACE
+#define O COST_MODEL_OTHER
+
+/* the category of every code point below 256, as category() finds it */
+static const unsigned char latin_category[COST_MODEL_LATIN] = {
+    O, O, O, O, O, O, O, O, O, S, S, S, S, S, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, S, S, S, S,
+    S, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    D, D, D, D, D, D, D, D, D, D, O, O, O, O, O, O,
+    O, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, O, O, O, O, O,
+    O, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, O, O, O, O, O,
+    O, O, O, O, O, S, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    S, O, O, O, O, O, O, O, O, O, A, O, O, O, O, O,
+    O, O, D, D, O, A, O, O, O, D, A, O, A, A, A, O,
+    A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, O, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, O, A, A, A, A, A, A, A, A,
+};
+
+#undef D
+#undef A
+#undef S
+#undef O
+
+static int category(JFISH_UNICODE c)
+{
+    if ((uint32_t)c < COST_MODEL_LATIN) {
+        return latin_category[c];
+    }
+    if (Py_UNICODE_ISDIGIT(c)) {
+        return COST_MODEL_DIGIT;
+    }
+    if (Py_UNICODE_ISALNUM(c)) {
+        return COST_MODEL_ALPHA;
+    }
+    if (Py_UNICODE_ISSPACE(c)) {
+        return COST_MODEL_SPACE;
+    }
+    return COST_MODEL_OTHER;
+}
+
+static size_t class_hash_slot(uint32_t key, size_t slots)
+{
+    return (key * 2654435761u) & (slots - 1);
+}
+
+static int class_hash_grow(struct cost_model *model)
+{
+    size_t i, j;
+    size_t slots = model->slots ? model->slots * 2 : COST_MODEL_MIN_SLOTS;
+    uint32_t *keys = calloc(slots, sizeof(uint32_t));
+    unsigned char *values = malloc(slots);
+
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return 0;
+    }
+
+    for (i = 0; i < model->slots; i++) {
+        if (!model->keys[i]) {
+            continue;
+        }
+        for (j = class_hash_slot(model->keys[i], slots); keys[j]; j = (j + 1) & (slots - 1));
+        keys[j] = model->keys[i];
+        values[j] = model->values[i];
+    }
+
+    free(model->keys);
+    free(model->values);
+    model->keys = keys;
+    model->values = values;
+    model->slots = slots;
+    return 1;
+}
+
+static int classify(const struct cost_model *model, JFISH_UNICODE c)
+{
+    size_t i;
+    uint32_t key;
+
+    if ((uint32_t)c < COST_MODEL_LATIN) {
+        return model->latin_class[c];
+    }
+    if (model->used) {
+        key = (uint32_t)c + 1;
+        for (i = class_hash_slot(key, model->slots); model->keys[i]; i = (i + 1) & (model->slots - 1)) {
+            if (model->keys[i] == key) {
+                return model->values[i];
+            }
+        }
+    }
+    return model->category_class[category(c)];
+}
+
+struct cost_model* cost_model_create(int classes)
+{
+    int i;
+    size_t costs;
+    struct cost_model *model;
+
+    if (classes < 1 || classes > COST_MODEL_MAX_CLASSES) {
+        return NULL;
+    }
+
+    /* the costs live in the same block, right after the struct */
+    costs = (size_t)classes * (classes + 2);
+    model = calloc(1, sizeof(struct cost_model) + costs * sizeof(double));
+    if (!model) {
+        return NULL;
+    }
+
+    model->classes = classes;
+    model->insert_costs = (double*)(model + 1);
+    model->delete_costs = model->insert_costs + classes;
+    model->substitute_costs = model->delete_costs + classes;
+    for (i = 0; i < (int)costs; i++) {
+        model->insert_costs[i] = 1.0;
+    }
+    model->min_insert = 1.0;
+    model->min_delete = 1.0;
+    return model;
+}
+
+void cost_model_free(struct cost_model *model)
+{
+    if (!model) {
+        return;
+    }
+    free(model->keys);
+    free(model->values);
+    free(model);
+}
+
+int cost_model_set_class(struct cost_model *model, JFISH_UNICODE c, int cls)
+{
+    size_t i;
+    uint32_t key;
+
+    if ((uint32_t)c < COST_MODEL_LATIN) {
+        model->latin_class[c] = cls;
+        model->latin_explicit[c] = 1;
+        return 1;
+    }
+
+    /* keep the hash at most half full */
+    if (2 * (model->used + 1) > model->slots && !class_hash_grow(model)) {
+        return 0;
+    }
+
+    key = (uint32_t)c + 1;
+    for (i = class_hash_slot(key, model->slots); model->keys[i]; i = (i + 1) & (model->slots - 1)) {
+        if (model->keys[i] == key) {
+            model->values[i] = cls;
+            return 1;
+        }
+    }
+    model->keys[i] = key;
+    model->values[i] = cls;
+    model->used++;
+    return 1;
+}
+
+void cost_model_set_category(struct cost_model *model, enum cost_model_category cat, int cls)
+{
+    int c;
+
+    model->category_class[cat] = cls;
+    for (c = 0; c < COST_MODEL_LATIN; c++) {
+        if (!model->latin_explicit[c]) {
+            model->latin_class[c] = model->category_class[latin_category[c]];
+        }
+    }
+}
+
+void cost_model_set_insert(struct cost_model *model, int cls, double cost)
+{
+    model->insert_costs[cls] = cost;
+    model->min_insert = MIN(model->min_insert, cost);
+    model->negative |= cost < 0;
+}
+
+void cost_model_set_delete(struct cost_model *model, int cls, double cost)
+{
+    model->delete_costs[cls] = cost;
+    model->min_delete = MIN(model->min_delete, cost);
+    model->negative |= cost < 0;
+}
+
+void cost_model_set_substitute(struct cost_model *model, int cls1, int cls2, double cost)
+{
+    model->substitute_costs[cls1 * model->classes + cls2] = cost;
+    model->negative |= cost < 0;
+}
+
+double custom_weighted_levenshtein_distance_model_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct cost_model *model, double max_cost)
 {
     size_t rows = s1_len + 1;
     size_t cols = s2_len + 1;
     size_t i, j;
-   
+    size_t lo, hi, next_lo, next_hi;
+    int cls;
+
     double result;
+    double bound;
     double delete_cost, insert_cost, substitute_cost;
-    double insert_weight, delete_weight, substitute_weight;
-    double *dist = malloc(rows * cols * sizeof(double));
-    bool *isValid1 = calloc(s1_len, sizeof(bool));
-    bool *isDigit1 = calloc(s1_len, sizeof(bool));
+    double row_delete_cost, diag, up;
+    const double *row_substitute;
+    double stack_buf[2 * COST_STACK_COLS];
+    unsigned char stack_classes[COST_STACK_COLS];
+    double *buf = stack_buf;
+    unsigned char *classes2 = stack_classes;
+    double *row, *column_insert_costs;
 
-    if (!dist || !isValid1 || !isDigit1) {
-        return -1;
-    }
+    /* see weighted_levenshtein_distance_table_max for the pruning */
+    bound = max_cost < 0 || model->negative ? HUGE_VAL : max_cost;
 
-    // Determine isValid and isDigit for each character of s1 in advance, rather than multiple times each in the inner loop
-    for (i = 0; i < s1_len; i++) {
-        if(s1[i] == ' ' || Py_UNICODE_ISALNUM(s1[i]) == true) {
-            isValid1[i] = true;
-        }
-        if(Py_UNICODE_ISDIGIT(s1[i])){
-            isDigit1[i] = true;
-        }
+    if (s1_len > s2_len && (s1_len - s2_len) * model->min_delete > bound) {
+        return HUGE_VAL;
+    }
+    if (s2_len > s1_len && (s2_len - s1_len) * model->min_insert > bound) {
+        return HUGE_VAL;
     }
 
-    for (i = 0; i < rows; i++) {
-        dist[i * cols] = i;
+    if (cols > COST_STACK_COLS) {
+        buf = malloc(2 * cols * sizeof(double) + cols);
+        if (!buf) {
+            return -1;
+        }
+        classes2 = (unsigned char*)(buf + 2 * cols);
     }
+    row = buf;
+    column_insert_costs = buf + cols;
 
+    /* s2 is classified once up front, each character of s1 as its row
+       starts */
     for (j = 0; j < cols; j++) {
-        dist[j] = j;
+        row[j] = j;
     }
-
     for (j = 1; j < cols; j++) {
-        bool isDigit2 = (Py_UNICODE_ISDIGIT(s2[j-1]) == true)?true:false;
-        bool isValid2 = (s2[j-1] == ' ' || Py_UNICODE_ISALNUM(s2[j-1]) == true)?true:false;
+        classes2[j] = classify(model, s2[j - 1]);
+        column_insert_costs[j] = model->insert_costs[classes2[j]];
+    }
 
-        for (i = 1; i < rows; i++) {
+    lo = 1;
+    hi = cols - 1;
+
+    for (i = 1; i < rows; i++) {
+        cls = classify(model, s1[i - 1]);
+        row_delete_cost = model->delete_costs[cls];
+        row_substitute = model->substitute_costs + cls * model->classes;
+        diag = row[lo - 1];
+        if (lo == 1) {
+            row[0] = i;
+        }
+        next_lo = row[0] <= bound ? 1 : 0;
+        next_hi = 0;
+        for (j = lo; j < cols; j++) {
+            up = row[j];
             if (s1[i - 1] == s2[j - 1]) {
-                dist[(i * cols) + j] = dist[((i - 1) * cols) + (j - 1)];
+                row[j] = diag;
             } else {
+                delete_cost = up + row_delete_cost;
+                insert_cost = row[j - 1] + column_insert_costs[j];
+                substitute_cost = diag + row_substitute[classes2[j]];
 
-                if(isValid2 == true) {
-                    if(isDigit2 == true) {
-                        insert_weight = insert_numeric_weight;
-                    } else {
-                        insert_weight = insert_alpha_weight;
-                    }
-                } else {
-                    insert_weight = 0.0;
-                }
+                row[j] = MIN(delete_cost, MIN(insert_cost, substitute_cost));
+            }
+            diag = up;
 
-                if(isValid1[i-1] == true) {
-                    if(isDigit1[i-1] == true) {
-                        delete_weight = delete_numeric_weight;
-                    } else {
-                        delete_weight = delete_alpha_weight;
-                    }
-                } else {
-                    delete_weight = 0.0;
+            if (row[j] <= bound) {
+                if (!next_lo) {
+                    next_lo = j;
                 }
+                next_hi = j;
+            } else if (j > hi) {
+                break;
+            }
+        }
 
-                if(isValid1[i-1] == true && isValid2 == true) {
-                    if(isDigit1[i-1] == true || isDigit2 == true) {
-                        substitute_weight = substitute_numeric_weight;
-                    } else {
-                        substitute_weight = substitute_alpha_weight;
-                    }
-                } else {
-                    substitute_weight = 0.0;
-                }
+        if (!next_lo) {
+            result = HUGE_VAL;
+            goto done;
+        }
+        lo = next_lo;
+        hi = next_hi;
+    }
+
+    result = row[cols - 1];
+    if (max_cost >= 0 && result > max_cost) {
+        result = HUGE_VAL;
+    }
+
+ done:
+    if (buf != stack_buf) {
+        free(buf);
+    }
+
+    return result;
+}
+
+double custom_weighted_levenshtein_distance_model(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct cost_model *model)
+{
+    return custom_weighted_levenshtein_distance_model_max(s1, s1_len, s2, s2_len, model, -1);
+}
+
+/* the fixed numeric/alpha weights are a model with a class per category:
+   digits, other alphanumerics plus ' ', and spaces and everything else,
+   which are free.  It needs no hash, so it is filled in directly. */
+#define LEGACY_CLASSES COST_MODEL_CATEGORIES
+#define LEGACY_COSTS (LEGACY_CLASSES * (LEGACY_CLASSES + 2))
 
-                delete_cost = dist[((i - 1) * cols) + j] + delete_weight; 
-                insert_cost = dist[(i * cols) + (j - 1)] + insert_weight;
-                substitute_cost = dist[((i - 1) * cols) + (j - 1)] + substitute_weight;
+static void legacy_model_fill(struct cost_model *model, double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight)
+{
+    int a, b;
+    double cost;
 
-                dist[(i * cols) + j] = MIN(delete_cost, MIN(insert_cost, substitute_cost));
+    for (a = 0; a < LEGACY_CLASSES; a++) {
+        model->category_class[a] = a;
+    }
+    memcpy(model->latin_class, latin_category, COST_MODEL_LATIN);
+    model->latin_class[' '] = COST_MODEL_ALPHA;
 
+    model->min_insert = model->min_delete = 0.0;
+    model->negative = 0;
+    for (a = 0; a < LEGACY_CLASSES; a++) {
+        model->insert_costs[a] = a == COST_MODEL_DIGIT ? insert_numeric_weight : a == COST_MODEL_ALPHA ? insert_alpha_weight : 0.0;
+        model->delete_costs[a] = a == COST_MODEL_DIGIT ? delete_numeric_weight : a == COST_MODEL_ALPHA ? delete_alpha_weight : 0.0;
+        model->min_insert = MIN(model->min_insert, model->insert_costs[a]);
+        model->min_delete = MIN(model->min_delete, model->delete_costs[a]);
+        for (b = 0; b < LEGACY_CLASSES; b++) {
+            if (a > COST_MODEL_ALPHA || b > COST_MODEL_ALPHA) {
+                cost = 0.0;
+            } else if (a == COST_MODEL_DIGIT || b == COST_MODEL_DIGIT) {
+                cost = substitute_numeric_weight;
+            } else {
+                cost = substitute_alpha_weight;
             }
+            model->substitute_costs[a * LEGACY_CLASSES + b] = cost;
+            model->negative |= cost < 0;
         }
     }
+    model->negative |= model->min_insert < 0 || model->min_delete < 0;
+}
 
-    result = dist[(cols * rows) - 1];
+struct cost_model* cost_model_from_weights(double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight)
+{
+    struct cost_model *model = cost_model_create(LEGACY_CLASSES);
 
-    free(dist);
-    free(isValid1);
-    free(isDigit1);
+    if (model) {
+        legacy_model_fill(model, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight);
+    }
+    return model;
+}
 
-    return result;
+double custom_weighted_levenshtein_distance_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight, double max_cost)
+{
+    /* the only allocation is the kernel's, for long strings */
+    struct cost_model model;
+    double costs[LEGACY_COSTS];
+
+    model.classes = LEGACY_CLASSES;
+    model.used = 0;
+    model.insert_costs = costs;
+    model.delete_costs = costs + LEGACY_CLASSES;
+    model.substitute_costs = costs + 2 * LEGACY_CLASSES;
+    legacy_model_fill(&model, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight);
+
+    return custom_weighted_levenshtein_distance_model_max(s1, s1_len, s2, s2_len, &model, max_cost);
+}
+
+double custom_weighted_levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight)
+{
+    return custom_weighted_levenshtein_distance_max(s1, s1_len, s2, s2_len, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight, -1);
 }
@@ -1,164 +1,84 @@
 #include "jellyfish.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <wchar.h>
 
 /*
 
-  Trie is a nested search tree, where each node's key is broken down into parts
-  and looking up a certain key means a sequence of lookups in small associative
-  arrays. They are usually used for strings, where a word "foo" would be
-  basically looked up as trie["f"]["o"]["o"].
+  The transposition term needs, for every character of s2, the last row of
+  s1 holding that character.  Rather than looking code points up in a
+  dictionary inside the DP, every distinct character of s1 is given a small
+  index up front (1, 2, ...) and both strings are rewritten as index arrays.
+  Characters of s2 missing from s1 get index 0, whose last row is always 0,
+  so the last row table becomes a flat int array.
 
-  In this case, the tries split the incoming integer into segments, omitting
-  upper zero ones, and they are looked up as follows:
+  Code points below 256 are remapped through a direct table, anything else
+  through a small open addressing hash keyed by the code point plus one.
 
-  I.e. for segments of 1 byte,
+  The DP matrix, the index arrays, the last row table and the hash are all
+  carved out of one buffer, which lives on the stack for short strings.
 
-  - for key = 0x11, the result is d->values[0x11]
-  - for key = 0x1122  -  d->child_nodes[0x11]->values[0x22]
-  - for key = 0x112233  -  d->child_nodes[0x11]->child_nodes[0x22]->values[0x33]
-
-  And so on.
-
-  Child nodes are created on demand, when a value should be stored in them.
-
-  If no value is stored in the trie for a certain key, the lookup returns 0.
+  With a max_distance, only the band of cells with |i - j| <= max can lead
+  to a distance of at most max, so each row keeps just those 2 * max + 1
+  cells, capped at max + 1.  A transposition reaching outside the band
+  costs more than max anyway.  Capped cells fit in 16 bits for all but
+  huge inputs, which halves the memory traffic.
 
 */
 
+#define DAMERAU_STACK_INTS 2048
+#define DAMERAU_MIN_SLOTS 16
 
-#define TRIE_VALUES_PER_LEVEL 256
-/* Each level takes one byte from dictionary key, hence max levels is: */
-#define TRIE_MAX_LEVELS sizeof(size_t)
-
-struct trie {
-    size_t* values;
-    struct trie** child_nodes;
+struct remap {
+    int latin[256];
+    size_t slots;
+    uint32_t *keys;
+    int *values;
+    int size;
 };
 
-
-struct trie* trie_create(void)
-{
-    return calloc(1, sizeof(struct trie));
-}
-
-
-void trie_destroy(struct trie* d)
+static int remap_index(struct remap *r, JFISH_UNICODE c, int insert)
 {
     size_t i;
-    if (!d) {
-        return;
-    }
-    free(d->values);
-    if (d->child_nodes) {
-        for (i = 0; i < TRIE_VALUES_PER_LEVEL; ++i) {
-            trie_destroy(d->child_nodes[i]);
-        }
-    }
-    free(d->child_nodes);
-    free(d);
-}
-
+    uint32_t key;
 
-size_t trie_get(struct trie* d, size_t key)
-{
-    size_t level_keys[TRIE_MAX_LEVELS];
-    size_t level_pos = 0;
-
-    size_t cur_remainder = key;
-    size_t cur_key;
-    while (1) {
-        level_keys[level_pos] = cur_remainder % TRIE_VALUES_PER_LEVEL;
-        cur_remainder /= TRIE_VALUES_PER_LEVEL;
-        if (!cur_remainder) {
-            break;
+    if ((uint32_t)c < 256) {
+        if (!r->latin[c] && insert) {
+            r->latin[c] = ++r->size;
         }
-        ++level_pos;
+        return r->latin[c];
     }
 
-    while (level_pos) {
-        cur_key = level_keys[level_pos];
-        if (!d->child_nodes || !d->child_nodes[cur_key]) {
-            return 0;
-        }
-        d = d->child_nodes[cur_key];
-        --level_pos;
-    }
-    if (!d->values) {
+    if (!r->slots) {
         return 0;
     }
-    return d->values[level_keys[0]];
-}
-
-
-int trie_set(struct trie* d, size_t key, size_t val)
-{
-    size_t level_keys[TRIE_MAX_LEVELS];
-    size_t level_pos = 0;
-
-    size_t cur_remainder = key;
-    size_t cur_key;
-    while (1) {
-        level_keys[level_pos] = cur_remainder % TRIE_VALUES_PER_LEVEL;
-        cur_remainder /= TRIE_VALUES_PER_LEVEL;
-        if (!cur_remainder) {
-            break;
-        }
-        ++level_pos;
-    }
-
-    while (level_pos) {
-        cur_key = level_keys[level_pos];
-        if (!d->child_nodes) {
-            d->child_nodes = calloc(TRIE_VALUES_PER_LEVEL, sizeof(struct trie*));
-            if (!d->child_nodes) {
-                return 0;
-            }
-        }
-        if (!d->child_nodes[cur_key]) {
-            d->child_nodes[cur_key] = trie_create();
-            if (!d->child_nodes[cur_key]){
-                return 0;
-            }
+    key = (uint32_t)c + 1;
+    for (i = (key * 2654435761u) & (r->slots - 1); r->keys[i]; i = (i + 1) & (r->slots - 1)) {
+        if (r->keys[i] == key) {
+            return r->values[i];
         }
-        d = d->child_nodes[cur_key];
-        --level_pos;
     }
-
-    if (!d->values) {
-        d->values = calloc(TRIE_VALUES_PER_LEVEL, sizeof(size_t));
-        if (!d->values) {
-            return 0;
-        }
+    if (!insert) {
+        return 0;
     }
-    d->values[level_keys[0]] = val;
-    return 1;
+    r->keys[i] = key;
+    r->values[i] = ++r->size;
+    return r->values[i];
 }
 
-
-int damerau_levenshtein_distance(const JFISH_UNICODE *s1, const JFISH_UNICODE *s2, size_t len1, size_t len2)
+/* Full matrix DP, exactly as in Lowrance and Wagner. */
+static int damerau_full(const JFISH_UNICODE *s1, size_t len1, const JFISH_UNICODE *s2, size_t len2,
+        const int *codes1, const int *codes2, int *da, int *dist)
 {
-    size_t infinite = len1 + len2;
+    int infinite = len1 + len2;
     size_t cols = len2 + 2;
 
     size_t i, j, i1, j1;
     size_t db;
-    size_t d1, d2, d3, d4, result;
+    int d1, d2, d3, d4, left;
     unsigned short cost;
-
-    size_t *dist = NULL;
-
-    struct trie* da = trie_create();
-    if (!da) {
-        return -1;
-    }
-
-    dist = malloc((len1 + 2) * cols * sizeof(size_t));
-    if (!dist) {
-        result = -1;
-        goto cleanup_da;
-    }
+    int *prev, *row;
 
     dist[0] = infinite;
 
@@ -174,8 +94,11 @@ int damerau_levenshtein_distance(const JFISH_UNICODE *s1, const JFISH_UNICODE *s
 
     for (i = 1; i <= len1; i++) {
         db = 0;
+        prev = dist + i * cols;
+        row = prev + cols;
+        left = row[1];    /* carried in a register, not reloaded */
         for (j = 1; j <= len2; j++) {
-            i1 = trie_get(da, s2[j-1]);
+            i1 = da[codes2[j-1]];
             j1 = db;
 
             if (s1[i - 1] == s2[j - 1]) {
@@ -185,28 +108,199 @@ int damerau_levenshtein_distance(const JFISH_UNICODE *s1, const JFISH_UNICODE *s
                 cost = 1;
             }
 
-            d1 = dist[(i * cols) + j] + cost;
-            d2 = dist[((i + 1) * cols) + j] + 1;
-            d3 = dist[(i * cols) + j + 1] + 1;
-            d4 = dist[(i1 * cols) + j1] + (i - i1 - 1) + 1 + (j - j1 - 1);
+            d1 = prev[j] + cost;
+            d2 = left + 1;
+            d3 = prev[j + 1] + 1;
+            d1 = MIN(MIN(d1, d2), d3);
+            /* row 0 and column 0 hold infinite, so the transposition can
+               only win once both characters were seen before */
+            if (i1 && j1) {
+                d4 = dist[(i1 * cols) + j1] + (int)((i - i1 - 1) + 1 + (j - j1 - 1));
+                d1 = MIN(d1, d4);
+            }
+
+            row[j + 1] = left = d1;
+        }
+
+        da[codes1[i-1]] = i;
+    }
+
+    return dist[((len1+1) * cols) + len2 + 1];
+}
+
+/* Banded DP over rows of 2 * max + 1 cells, cell (i, j) of the DP matrix
+   living at band[i * width + j - i + max].  Returns max + 1 as soon as a
+   whole row is above max: a row's minimum never decreases.  Generated for
+   16- and 32-bit cells. */
+#define DAMERAU_BANDED(name, cell_t)                                           \
+static int name(const JFISH_UNICODE *s1, size_t len1, const JFISH_UNICODE *s2, size_t len2, \
+        int max, const int *codes1, const int *codes2, int *da, cell_t *band)  \
+{                                                                              \
+    long width = 2 * (long)max + 1;                                            \
+    int cap = max + 1;                                                         \
+    long i, j, lo, hi, i1, j1, db;                                             \
+    int up, diag, left, d, cost, row_min;                                      \
+    cell_t *prev, *row;                                                        \
+                                                                               \
+    for (j = 0; j < width; j++) {                                              \
+        band[j] = j - max >= 0 && j - max <= (long)len2 ? j - max : cap;       \
+    }                                                                          \
+                                                                               \
+    for (i = 1; i <= (long)len1; i++) {                                        \
+        prev = band + (i - 1) * width;                                         \
+        row = prev + width;                                                    \
+        for (j = 0; j < width; j++) {                                          \
+            row[j] = cap;                                                      \
+        }                                                                      \
+        lo = i - max > 1 ? i - max : 1;                                        \
+        hi = i + max < (long)len2 ? i + max : (long)len2;                      \
+        row_min = cap;                                                         \
+        left = cap;                                                            \
+        if (i <= max) {                                                        \
+            row[max - i] = left = row_min = i;                                 \
+        }                                                                      \
+                                                                               \
+        /* a match left of the band is too far back to pay off */             \
+        db = 0;                                                                \
+        for (j = lo; j <= hi; j++) {                                           \
+            /* prev holds row i - 1, so column j sits one cell further */      \
+            up = j - (i - 1) <= max ? (int)prev[j - i + 1 + max] : cap;        \
+            diag = (int)prev[j - i + max];                                     \
+            cost = s1[i - 1] != s2[j - 1];                                     \
+                                                                               \
+            d = MIN(MIN(up, left) + 1, diag + cost);                           \
+            i1 = da[codes2[j - 1]];                                            \
+            j1 = db;                                                           \
+            if (i1 && j1 && labs(i1 - j1) <= max) {                            \
+                d = MIN(d, (int)band[(i1 - 1) * width + j1 - i1 + max]         \
+                        + (int)((i - i1 - 1) + 1 + (j - j1 - 1)));             \
+            }                                                                  \
+            if (!cost) {                                                       \
+                db = j;                                                        \
+            }                                                                  \
+                                                                               \
+            left = MIN(d, cap);                                                \
+            row[j - i + max] = left;                                           \
+            row_min = MIN(row_min, left);                                      \
+        }                                                                      \
+                                                                               \
+        if (row_min > max) {                                                   \
+            return cap;                                                        \
+        }                                                                      \
+        da[codes1[i - 1]] = i;                                                 \
+    }                                                                          \
+                                                                               \
+    return band[len1 * width + len2 - len1 + max];                             \
+}
+
+DAMERAU_BANDED(damerau_banded16, uint16_t)
+DAMERAU_BANDED(damerau_banded32, uint32_t)
+
+int damerau_levenshtein_distance_max(const JFISH_UNICODE *s1, const JFISH_UNICODE *s2, size_t len1, size_t len2, int max_distance)
+{
+    const JFISH_UNICODE *tmp;
+    size_t n, i, j;
+    size_t wide = 0;
+    size_t ints, cells, cell_size;
+    int max, banded, result;
+
+    int stack_buf[DAMERAU_STACK_INTS];
+    int *buf = stack_buf;
+    int *codes1, *codes2, *da;
+    void *matrix;
+    struct remap r;
+
+    /* common affixes never contribute to the distance */
+    while (len1 && len2 && *s1 == *s2) {
+        s1++; s2++;
+        len1--; len2--;
+    }
+    while (len1 && len2 && s1[len1 - 1] == s2[len2 - 1]) {
+        len1--; len2--;
+    }
+
+    /* the distance is symmetric, the shorter string gives the rows */
+    if (len1 > len2) {
+        tmp = s1; s1 = s2; s2 = tmp;
+        n = len1; len1 = len2; len2 = n;
+    }
 
-            dist[((i+1)*cols) + j + 1] = MIN(MIN(d1, d2), MIN(d3, d4));
+    /* the distance is never more than the longer length */
+    max = max_distance < 0 || (size_t)max_distance > len2 ? (int)len2 : max_distance;
+    if (len2 - len1 > (size_t)max) {
+        return max + 1;
+    }
+    if (!len1) {
+        return len2;
+    }
+
+    for (i = 0; i < len1; i++) {
+        if ((uint32_t)s1[i] >= 256) {
+            wide++;
         }
+    }
 
-        if (!trie_set(da, s1[i-1], i)) {
-            result = -1;
-            goto cleanup;
-        };
+    memset(r.latin, 0, sizeof(r.latin));
+    r.size = 0;
+    r.slots = 0;
+    if (wide) {
+        /* keep the hash at most half full */
+        for (r.slots = DAMERAU_MIN_SLOTS; r.slots < 2 * wide; r.slots *= 2);
     }
 
-    result = dist[((len1+1) * cols) + len2 + 1];
+    /* the band only pays off while it is narrower than a full row */
+    banded = 2 * (size_t)max + 1 < len2 + 2;
+    if (banded) {
+        cells = (len1 + 1) * (2 * (size_t)max + 1);
+        cell_size = max < UINT16_MAX ? sizeof(uint16_t) : sizeof(uint32_t);
+    } else {
+        cells = (len1 + 2) * (len2 + 2);
+        cell_size = sizeof(int);
+    }
 
+    /* both index arrays, the last row table, the hash, then the matrix */
+    ints = len1 + len2 + (len1 + 1) + 2 * r.slots;
+    if (ints + (cells * cell_size + sizeof(int) - 1) / sizeof(int) > DAMERAU_STACK_INTS) {
+        buf = malloc(ints * sizeof(int) + cells * cell_size);
+        if (!buf) {
+            return -1;
+        }
+    }
+    codes1 = buf;
+    codes2 = codes1 + len1;
+    da = codes2 + len2;
+    r.keys = (uint32_t*)(da + len1 + 1);
+    r.values = da + len1 + 1 + r.slots;
+    matrix = buf + ints;
+
+    memset(da, 0, (len1 + 1) * sizeof(int));
+    if (r.slots) {
+        memset(r.keys, 0, r.slots * sizeof(uint32_t));
+    }
+    for (i = 0; i < len1; i++) {
+        codes1[i] = remap_index(&r, s1[i], 1);
+    }
+    for (j = 0; j < len2; j++) {
+        codes2[j] = remap_index(&r, s2[j], 0);
+    }
 
- cleanup:
-    free(dist);
+    if (!banded) {
+        result = damerau_full(s1, len1, s2, len2, codes1, codes2, da, matrix);
+        result = MIN(result, max + 1);
+    } else if (cell_size == sizeof(uint16_t)) {
+        result = damerau_banded16(s1, len1, s2, len2, max, codes1, codes2, da, matrix);
+    } else {
+        result = damerau_banded32(s1, len1, s2, len2, max, codes1, codes2, da, matrix);
+    }
 
- cleanup_da:
-    trie_destroy(da);
+    if (buf != stack_buf) {
+        free(buf);
+    }
 
     return result;
 }
+
+int damerau_levenshtein_distance(const JFISH_UNICODE *s1, const JFISH_UNICODE *s2, size_t len1, size_t len2)
+{
+    return damerau_levenshtein_distance_max(s1, s2, len1, len2, -1);
+}
@@ -1,25 +1,466 @@
 #include "jellyfish.h"
+#include "pattern_match.h"
+#include "parallel.h"
 #include <ctype.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+
+  Code points are compared a vector at a time: equal lanes come out of the
+  compare as all ones, so the byte mask of the result holds
+  sizeof(JFISH_UNICODE) bits per equal code point, whatever the width of
+  wchar_t.  Two vectors are compared per iteration and their masks counted
+  with a single popcount.
+
+*/
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#define HAMMING_SIMD 1
+
+#include <immintrin.h>
+
+#if defined(__AVX2__)
+#define HAMMING_VECTOR_BYTES 32
+typedef __m256i hamming_vector;
+#define HAMMING_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define HAMMING_CMPEQ32(a, b) _mm256_cmpeq_epi32((a), (b))
+#define HAMMING_CMPEQ16(a, b) _mm256_cmpeq_epi16((a), (b))
+#define HAMMING_MOVEMASK(v) (uint32_t)_mm256_movemask_epi8(v)
+#define HAMMING_CMPEQ8(a, b) _mm256_cmpeq_epi8((a), (b))
+#define HAMMING_SUB8(a, b) _mm256_sub_epi8((a), (b))
+#define HAMMING_SET1_8(x) _mm256_set1_epi8(x)
+#define HAMMING_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), (v))
+#else
+#define HAMMING_VECTOR_BYTES 16
+typedef __m128i hamming_vector;
+#define HAMMING_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define HAMMING_CMPEQ32(a, b) _mm_cmpeq_epi32((a), (b))
+#define HAMMING_CMPEQ16(a, b) _mm_cmpeq_epi16((a), (b))
+#define HAMMING_MOVEMASK(v) (uint32_t)_mm_movemask_epi8(v)
+#define HAMMING_CMPEQ8(a, b) _mm_cmpeq_epi8((a), (b))
+#define HAMMING_SUB8(a, b) _mm_sub_epi8((a), (b))
+#define HAMMING_SET1_8(x) _mm_set1_epi8(x)
+#define HAMMING_STORE(p, v) _mm_storeu_si128((__m128i*)(p), (v))
+#endif
+
+#define HAMMING_LANES (HAMMING_VECTOR_BYTES / sizeof(JFISH_UNICODE))
+
+/* one bit per byte of every equal code point */
+static INLINE uint32_t equal_bytes(const JFISH_UNICODE *s1, const JFISH_UNICODE *s2)
+{
+    hamming_vector a = HAMMING_LOAD(s1);
+    hamming_vector b = HAMMING_LOAD(s2);
+
+    if (sizeof(JFISH_UNICODE) == 4) {
+        return HAMMING_MOVEMASK(HAMMING_CMPEQ32(a, b));
+    }
+    return HAMMING_MOVEMASK(HAMMING_CMPEQ16(a, b));
+}
+
+#endif
 
 size_t hamming_distance(const Py_UNICODE *s1, int len1,
                         const Py_UNICODE *s2, int len2) {
-    unsigned distance = 0;
-    int i1 = 0;
-    int i2 = 0;
+    size_t common = MIN(len1, len2);
+    size_t same = 0;
+    size_t i = 0;
+
+#ifdef HAMMING_SIMD
+    size_t same_bytes = 0;
+
+    for (; i + 2 * HAMMING_LANES <= common; i += 2 * HAMMING_LANES) {
+        same_bytes += bit_popcount64(equal_bytes(s1 + i, s2 + i) |
+            (uint64_t)equal_bytes(s1 + i + HAMMING_LANES, s2 + i + HAMMING_LANES) << HAMMING_VECTOR_BYTES);
+    }
+    same = same_bytes / sizeof(JFISH_UNICODE);
+#endif
+
+    for (; i < common; i++) {
+        same += s1[i] == s2[i];
+    }
+
+    /* every code point past the end of the shorter string differs */
+    return common - same + (len1 > len2 ? len1 - len2 : len2 - len1);
+}
+
+size_t hamming_distance_bits(const void *b1, size_t len1, const void *b2, size_t len2)
+{
+    const unsigned char *p1 = b1;
+    const unsigned char *p2 = b2;
+    size_t common = MIN(len1, len2);
+    size_t distance = 0;
+    size_t i = 0;
+    uint64_t w1, w2;
+
+    for (; i + sizeof(uint64_t) <= common; i += sizeof(uint64_t)) {
+        memcpy(&w1, p1 + i, sizeof(uint64_t));
+        memcpy(&w2, p2 + i, sizeof(uint64_t));
+        distance += bit_popcount64(w1 ^ w2);
+    }
+
+    for (; i < common; i++) {
+        distance += bit_popcount64(p1[i] ^ p2[i]);
+    }
+
+    /* as with code points, every bit past the end of the shorter buffer
+       differs */
+    return distance + 8 * (len1 > len2 ? len1 - len2 : len2 - len1);
+}
+
+/*
+
+  A table of fixed width codes, searched for every code within a Hamming
+  distance of a query.
+
+  Every distinct code point of the codes is numbered from 1, so a code
+  becomes `width` small cells: bytes while there are at most 255 distinct
+  code points, 16-bit cells up to 65535.  A query code point no code
+  holds becomes 0 and matches nothing.
+
+  The codes are stored column-major in blocks of HAMMING_TABLE_BLOCK: a
+  block holds the first cell of each of its codes, then the second, and
+  so on.  A block is scanned a column at a time, adding one to the match
+  count of every code whose cell equals the query's, a vector of codes at
+  a time for byte cells.  Once no code of a block can still be within the
+  distance, the rest of its columns are skipped.  Large tables are split
+  into runs of blocks scanned on several threads.
+
+*/
+
+#define HAMMING_TABLE_BLOCK 64
+#define HAMMING_TABLE_MIN_SLOTS 16
+/* columns scanned between checks whether a block is still worth it */
+#define HAMMING_TABLE_CHECK_EVERY 4
+/* blocks a thread should have to itself before another one pays off */
+#define HAMMING_TABLE_THREAD_BLOCKS 256
+#define HAMMING_TABLE_MAX_THREADS 64
+
+struct hamming_table {
+    int width;
+    size_t count;
+    size_t blocks;
+    int wide;
+
+    int alphabet;
+    uint16_t latin[256];
+    size_t slots;
+    uint32_t *keys;
+    uint16_t *values;
+
+    /* blocks * width * HAMMING_TABLE_BLOCK cells */
+    void *cells;
+};
+
+static size_t table_hash_slot(uint32_t key, size_t slots)
+{
+    return (key * 2654435761u) & (slots - 1);
+}
+
+static int table_hash_grow(struct hamming_table *table)
+{
+    size_t i, j;
+    size_t slots = table->slots ? table->slots * 2 : HAMMING_TABLE_MIN_SLOTS;
+    uint32_t *keys = calloc(slots, sizeof(uint32_t));
+    uint16_t *values = malloc(slots * sizeof(uint16_t));
+
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return 0;
+    }
+
+    for (i = 0; i < table->slots; i++) {
+        if (!table->keys[i]) {
+            continue;
+        }
+        for (j = table_hash_slot(table->keys[i], slots); keys[j]; j = (j + 1) & (slots - 1));
+        keys[j] = table->keys[i];
+        values[j] = table->values[i];
+    }
+
+    free(table->keys);
+    free(table->values);
+    table->keys = keys;
+    table->values = values;
+    table->slots = slots;
+    return 1;
+}
+
+/* The cell of code point c, 0 if no code holds it. */
+static unsigned table_cell(const struct hamming_table *table, JFISH_UNICODE c)
+{
+    size_t i;
+    uint32_t key;
+
+    if ((uint32_t)c < 256) {
+        return table->latin[c];
+    }
+    if (!table->slots) {
+        return 0;
+    }
+    key = (uint32_t)c + 1;
+    for (i = table_hash_slot(key, table->slots); table->keys[i]; i = (i + 1) & (table->slots - 1)) {
+        if (table->keys[i] == key) {
+            return table->values[i];
+        }
+    }
+    return 0;
+}
+
+/* Numbers c if it is new.  Returns 0 on failed malloc and -1 once there
+   are more than 65535 distinct code points. */
+static int table_number(struct hamming_table *table, JFISH_UNICODE c)
+{
+    size_t i;
+    uint32_t key;
 
-    for (; i1 < len1 && i2 < len2; i1++, i2++, s1++, s2++) {
-        if (*s1 != *s2) {
-            distance++;
+    if (table_cell(table, c)) {
+        return 1;
+    }
+    if (table->alphabet == UINT16_MAX) {
+        return -1;
+    }
+
+    if ((uint32_t)c < 256) {
+        table->latin[c] = ++table->alphabet;
+        return 1;
+    }
+
+    /* keep the hash at most half full; alphabet bounds the wide keys */
+    if (2 * ((size_t)table->alphabet + 1) > table->slots && !table_hash_grow(table)) {
+        return 0;
+    }
+    key = (uint32_t)c + 1;
+    for (i = table_hash_slot(key, table->slots); table->keys[i]; i = (i + 1) & (table->slots - 1));
+    table->keys[i] = key;
+    table->values[i] = ++table->alphabet;
+    return 1;
+}
+
+void hamming_table_free(struct hamming_table *table)
+{
+    if (!table) {
+        return;
+    }
+    free(table->keys);
+    free(table->values);
+    free(table->cells);
+    free(table);
+}
+
+int hamming_table_create(struct hamming_table **out, const JFISH_UNICODE *const *codes, size_t count, int width)
+{
+    struct hamming_table *table;
+    unsigned char *cells8;
+    uint16_t *cells16;
+    size_t i, cell;
+    int c, status;
+
+    *out = NULL;
+    table = calloc(1, sizeof(struct hamming_table));
+    if (!table) {
+        return 0;
+    }
+    table->width = width;
+    table->count = count;
+    table->blocks = (count + HAMMING_TABLE_BLOCK - 1) / HAMMING_TABLE_BLOCK;
+
+    for (i = 0; i < count; i++) {
+        for (c = 0; c < width; c++) {
+            status = table_number(table, codes[i][c]);
+            if (status != 1) {
+                hamming_table_free(table);
+                return status;
+            }
         }
     }
 
-    for ( ; i1 < len1; i1++, s1++) {
-        distance++;
+    table->wide = table->alphabet > UCHAR_MAX;
+    table->cells = calloc(table->blocks * width * HAMMING_TABLE_BLOCK, table->wide ? sizeof(uint16_t) : 1);
+    if (!table->cells && table->blocks && width) {
+        hamming_table_free(table);
+        return 0;
     }
 
-    for ( ; i2 < len2; i2++, s2++) {
-        distance++;
+    cells8 = table->cells;
+    cells16 = table->cells;
+    for (i = 0; i < count; i++) {
+        for (c = 0; c < width; c++) {
+            cell = ((i / HAMMING_TABLE_BLOCK) * width + c) * HAMMING_TABLE_BLOCK + i % HAMMING_TABLE_BLOCK;
+            if (table->wide) {
+                cells16[cell] = table_cell(table, codes[i][c]);
+            } else {
+                cells8[cell] = table_cell(table, codes[i][c]);
+            }
+        }
     }
 
-    return distance;
+    *out = table;
+    return 1;
+}
+
+size_t hamming_table_count(const struct hamming_table *table)
+{
+    return table->count;
+}
+
+int hamming_table_width(const struct hamming_table *table)
+{
+    return table->width;
+}
+
+/* Adds one to matches[i] for every code i of a block whose cell in column
+   equals q. */
+static INLINE void match_column8(unsigned char *matches, const unsigned char *column, uint16_t q)
+{
+    int i = 0;
+
+#ifdef HAMMING_SIMD
+    hamming_vector query = HAMMING_SET1_8((char)q);
+    hamming_vector m;
+
+    /* equal cells compare as -1 */
+    for (; i < HAMMING_TABLE_BLOCK; i += HAMMING_VECTOR_BYTES) {
+        m = HAMMING_SUB8(HAMMING_LOAD(matches + i), HAMMING_CMPEQ8(HAMMING_LOAD(column + i), query));
+        HAMMING_STORE(matches + i, m);
+    }
+#endif
+
+    for (; i < HAMMING_TABLE_BLOCK; i++) {
+        matches[i] += column[i] == q;
+    }
+}
+
+static INLINE void match_column16(unsigned char *matches, const uint16_t *column, uint16_t q)
+{
+    int i;
+
+    for (i = 0; i < HAMMING_TABLE_BLOCK; i++) {
+        matches[i] += column[i] == q;
+    }
+}
+
+/* Scans one block over the first `columns` columns, appending the codes
+   with at least `need` matches to out.  Returns how many there were. */
+#define HAMMING_TABLE_SCAN(name, cell_t, match_column)                         \
+static size_t name(const cell_t *block, int columns, const uint16_t *query,   \
+        int need, size_t base, size_t count, size_t *out)                      \
+{                                                                              \
+    unsigned char matches[HAMMING_TABLE_BLOCK];                                \
+    size_t found = 0;                                                          \
+    int c, i, best;                                                            \
+                                                                               \
+    memset(matches, 0, sizeof(matches));                                       \
+    for (c = 0; c < columns; c++) {                                            \
+        match_column(matches, block + (size_t)c * HAMMING_TABLE_BLOCK, query[c]); \
+        if ((c + 1) % HAMMING_TABLE_CHECK_EVERY == 0 && c + 1 < columns) {     \
+            /* every remaining column matching still falls short */            \
+            for (best = 0, i = 0; i < HAMMING_TABLE_BLOCK; i++) {              \
+                best = matches[i] > best ? matches[i] : best;                  \
+            }                                                                  \
+            if (best + (columns - c - 1) < need) {                             \
+                return 0;                                                      \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    for (i = 0; i < HAMMING_TABLE_BLOCK && base + i < count; i++) {            \
+        if (matches[i] >= need) {                                              \
+            out[found++] = base + i;                                           \
+        }                                                                      \
+    }                                                                          \
+    return found;                                                              \
+}
+
+HAMMING_TABLE_SCAN(scan_block8, unsigned char, match_column8)
+HAMMING_TABLE_SCAN(scan_block16, uint16_t, match_column16)
+
+struct hamming_search {
+    const struct hamming_table *table;
+    const uint16_t *query;
+    int columns;
+    int need;
+    size_t *results;
+    size_t found[HAMMING_TABLE_MAX_THREADS];
+};
+
+/* Scans a run of blocks, the results going where the run's first code
+   would be. */
+static void hamming_search_part(void *arg, int part, int parts)
+{
+    struct hamming_search *search = arg;
+    const struct hamming_table *table = search->table;
+    size_t first = table->blocks * part / parts;
+    size_t last = table->blocks * (part + 1) / parts;
+    size_t *out = search->results + first * HAMMING_TABLE_BLOCK;
+    size_t found = 0;
+    size_t b, offset;
+
+    for (b = first; b < last; b++) {
+        offset = b * table->width * HAMMING_TABLE_BLOCK;
+        if (table->wide) {
+            found += scan_block16((const uint16_t*)table->cells + offset, search->columns,
+                                  search->query, search->need, b * HAMMING_TABLE_BLOCK, table->count, out + found);
+        } else {
+            found += scan_block8((const unsigned char*)table->cells + offset, search->columns,
+                                 search->query, search->need, b * HAMMING_TABLE_BLOCK, table->count, out + found);
+        }
+    }
+    search->found[part] = found;
+}
+
+/* Writes the indices of the codes within max_distance of query to
+   results, which must have room for every code, in table order, and
+   returns how many there are.  threads of 0 means one per CPU.  Like
+   hamming_distance, code points past the end of the shorter of query and
+   code count as different. */
+size_t hamming_table_search(const struct hamming_table *table, const JFISH_UNICODE *query, int query_len,
+        int max_distance, int threads, size_t *results)
+{
+    struct hamming_search search;
+    uint16_t query_cells[HAMMING_TABLE_MAX_WIDTH];
+    size_t found, parts, i;
+    int c, max;
+
+    search.columns = MIN(query_len, table->width);
+    max = max_distance - abs(query_len - table->width);
+    if (max < 0 || !table->count) {
+        return 0;
+    }
+    if (max >= search.columns) {
+        for (i = 0; i < table->count; i++) {
+            results[i] = i;
+        }
+        return table->count;
+    }
+
+    for (c = 0; c < search.columns; c++) {
+        query_cells[c] = table_cell(table, query[c]);
+    }
+    search.table = table;
+    search.query = query_cells;
+    search.need = search.columns - max;
+    search.results = results;
+
+    if (threads <= 0) {
+        threads = parallel_cpu_count();
+    }
+    parts = MIN((size_t)threads, table->blocks / HAMMING_TABLE_THREAD_BLOCKS);
+    parts = MIN(parts, HAMMING_TABLE_MAX_THREADS);
+    if (parts <= 1) {
+        hamming_search_part(&search, 0, 1);
+        return search.found[0];
+    }
+
+    parallel_run(hamming_search_part, &search, (int)parts);
+
+    /* close the gaps between the runs */
+    found = search.found[0];
+    for (i = 1; i < parts; i++) {
+        memmove(results + found, results + (table->blocks * i / parts) * HAMMING_TABLE_BLOCK,
+                search.found[i] * sizeof(size_t));
+        found += search.found[i];
+    }
+    return found;
 }
@@ -3,61 +3,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "jellyfish.h"
+#include "pattern_match.h"
 
 #define NOTNUM(c)   ((c>57) || (c<48))
 
-/* borrowed heavily from strcmp95.c
- *    http://www.census.gov/geo/msb/stand/strcmp.c
- */
-double _jaro_winkler(const JFISH_UNICODE *ying, int ying_length,
+/* flag words kept on the stack by the blocked matcher, enough for two
+   strings of 1024 code points */
+#define JARO_STACK_WORDS 32
+
+/* Counts the common characters and transpositions with a scan of the
+   strings themselves.  Only used when yang's alphabet is too large for
+   match bitmasks.  Returns 0 on failed malloc. */
+static int jaro_scan(const JFISH_UNICODE *ying, int ying_length,
                      const JFISH_UNICODE *yang, int yang_length,
-                     int long_tolerance, int winklerize)
+                     long search_range, long *common, long *trans)
 {
-    /* Arguments:
-
-       ying
-       yang
-         pointers to the 2 strings to be compared.
-
-       long_tolerance
-         Increase the probability of a match when the number of matched
-         characters is large.  This option allows for a little more
-         tolerance when the strings are large.  It is not an appropriate
-         test when comparing fixed length fields such as phone and
-         social security numbers.
-    */
     JFISH_UNICODE *ying_flag=0, *yang_flag=0;
 
-    double weight;
-
-    long min_len;
-    long search_range;
     long lowlim, hilim;
     long trans_count, common_chars;
 
     int i, j, k;
 
-    // ensure that neither string is blank
-    if (!ying_length || !yang_length) return 0;
-
-    search_range = min_len = (ying_length > yang_length) ? ying_length : yang_length;
-
     // Blank out the flags
     ying_flag = calloc((ying_length + 1), sizeof(JFISH_UNICODE));
     if (!ying_flag) {
-        return -100;
+        return 0;
     }
 
     yang_flag = calloc((yang_length + 1), sizeof(JFISH_UNICODE));
     if (!yang_flag) {
         free(ying_flag);
-        return -100;
+        return 0;
     }
 
-    search_range = (search_range/2) - 1;
-    if (search_range < 0) search_range = 0;
-
-
     // Looking only within the search range, count and flag the matched pairs.
     common_chars = 0;
     for (i = 0; i < ying_length; i++) {
@@ -73,16 +52,9 @@ double _jaro_winkler(const JFISH_UNICODE *ying, int ying_length,
         }
     }
 
-    // If no characters in common - return
-    if (!common_chars) {
-        free(ying_flag);
-        free(yang_flag);
-        return 0;
-    }
-
     // Count the number of transpositions
     k = trans_count = 0;
-    for (i = 0; i < ying_length; i++) {
+    for (i = 0; common_chars && i < ying_length; i++) {
         if (ying_flag[i]) {
             for (j = k; j < yang_length; j++) {
                 if (yang_flag[j]) {
@@ -95,6 +67,134 @@ double _jaro_winkler(const JFISH_UNICODE *ying, int ying_length,
             }
         }
     }
+
+    free(ying_flag);
+    free(yang_flag);
+
+    *common = common_chars;
+    *trans = trans_count;
+    return 1;
+}
+
+/* Pairs up ying's characters with the first unflagged equal character of
+   yang within the search range, as the scan does, with yang held as match
+   bitmasks of at most 64 code points.  ying must be at most 64 code points
+   too. */
+static long jaro_match64(const struct pattern_match *pm,
+                         const JFISH_UNICODE *ying, int ying_length, int yang_length,
+                         long search_range, uint64_t *ying_flag, uint64_t *yang_flag)
+{
+    uint64_t window, candidates;
+    long lowlim, hilim;
+    long common_chars = 0;
+    int i;
+
+    *ying_flag = 0;
+    *yang_flag = 0;
+    for (i = 0; i < ying_length; i++) {
+        lowlim = (i >= search_range) ? i - search_range : 0;
+        hilim = (i + search_range <= yang_length-1) ? (i + search_range) : yang_length-1;
+        if (lowlim > hilim) {
+            break;
+        }
+        window = (~(uint64_t)0 >> (63 - (hilim - lowlim))) << lowlim;
+        candidates = *pattern_match_get(pm, ying[i]) & window & ~*yang_flag;
+        if (candidates) {
+            /* lowest bit: the first match, as in the scan */
+            *yang_flag |= candidates & (~candidates + 1);
+            *ying_flag |= (uint64_t)1 << i;
+            common_chars++;
+        }
+    }
+    return common_chars;
+}
+
+/* The same over any number of 64 bit words. */
+static long jaro_match_blocked(const struct pattern_match *pm,
+                               const JFISH_UNICODE *ying, int ying_length, int yang_length,
+                               long search_range, uint64_t *ying_flag, uint64_t *yang_flag)
+{
+    const uint64_t *PM;
+    uint64_t candidates;
+    long lowlim, hilim, w, lw, hw;
+    long common_chars = 0;
+    int i;
+
+    memset(ying_flag, 0, ((ying_length + 63) / 64) * sizeof(uint64_t));
+    memset(yang_flag, 0, pm->words * sizeof(uint64_t));
+    for (i = 0; i < ying_length; i++) {
+        lowlim = (i >= search_range) ? i - search_range : 0;
+        hilim = (i + search_range <= yang_length-1) ? (i + search_range) : yang_length-1;
+        if (lowlim > hilim) {
+            break;
+        }
+        PM = pattern_match_get(pm, ying[i]);
+        lw = lowlim / 64;
+        hw = hilim / 64;
+        for (w = lw; w <= hw; w++) {
+            candidates = PM[w] & ~yang_flag[w];
+            if (w == lw) {
+                candidates &= ~(uint64_t)0 << (lowlim % 64);
+            }
+            if (w == hw) {
+                candidates &= ~(uint64_t)0 >> (63 - hilim % 64);
+            }
+            if (candidates) {
+                yang_flag[w] |= candidates & (~candidates + 1);
+                ying_flag[i / 64] |= (uint64_t)1 << (i % 64);
+                common_chars++;
+                break;
+            }
+        }
+    }
+    return common_chars;
+}
+
+/* Walks the flagged characters of both strings in order and counts the
+   pairs that differ.  The flags are consumed. */
+static long jaro_transpositions(const JFISH_UNICODE *ying, uint64_t *ying_flag, int ying_words,
+                                const JFISH_UNICODE *yang, uint64_t *yang_flag)
+{
+    long trans_count = 0;
+    int w, v = 0;
+    int i, j;
+
+    for (w = 0; w < ying_words; w++) {
+        while (ying_flag[w]) {
+            i = w * 64 + bit_ctz64(ying_flag[w]);
+            ying_flag[w] &= ying_flag[w] - 1;
+            /* there are exactly as many flags in yang as in ying */
+            while (!yang_flag[v]) {
+                v++;
+            }
+            j = v * 64 + bit_ctz64(yang_flag[v]);
+            yang_flag[v] &= yang_flag[v] - 1;
+            if (ying[i] != yang[j]) {
+                trans_count++;
+            }
+        }
+    }
+    return trans_count;
+}
+
+/* The Jaro(-Winkler) weight from the common character and (doubled)
+   transposition counts. */
+static double jaro_weight(const JFISH_UNICODE *ying, int ying_length,
+                          const JFISH_UNICODE *yang, int yang_length,
+                          long common_chars, long trans_count,
+                          int long_tolerance, int winklerize)
+{
+    double weight;
+    long min_len;
+    int i, j;
+
+    min_len = (ying_length > yang_length) ? ying_length : yang_length;
+
+    // If no characters in common - return
+    if (!common_chars) {
+        return 0;
+    }
+
     trans_count /= 2;
 
     // adjust for similarities in nonmatched characters
@@ -126,8 +226,111 @@ double _jaro_winkler(const JFISH_UNICODE *ying, int ying_length,
         }
     }
 
-    free(ying_flag);
-    free(yang_flag);
+    return weight;
+}
+
+/* Counts the common characters and transpositions against yang's match
+   bitmasks.  Returns 0 on failed malloc. */
+static int jaro_match(const struct pattern_match *pm,
+                      const JFISH_UNICODE *ying, int ying_length,
+                      const JFISH_UNICODE *yang, int yang_length,
+                      long search_range, long *common, long *trans)
+{
+    uint64_t stack_flags[2 * JARO_STACK_WORDS];
+    uint64_t *flags = stack_flags;
+    uint64_t ying_flag, yang_flag;
+    int ying_words;
+
+    if (pm->words == 1 && ying_length <= 64) {
+        *common = jaro_match64(pm, ying, ying_length, yang_length, search_range, &ying_flag, &yang_flag);
+        *trans = jaro_transpositions(ying, &ying_flag, 1, yang, &yang_flag);
+        return 1;
+    }
+
+    ying_words = (ying_length + 63) / 64;
+    if (ying_words + pm->words > 2 * JARO_STACK_WORDS) {
+        flags = malloc((ying_words + pm->words) * sizeof(uint64_t));
+        if (!flags) {
+            return 0;
+        }
+    }
+    *common = jaro_match_blocked(pm, ying, ying_length, yang_length, search_range, flags, flags + ying_words);
+    *trans = jaro_transpositions(ying, flags, ying_words, yang, flags + ying_words);
+    if (flags != stack_flags) {
+        free(flags);
+    }
+    return 1;
+}
+
+/* borrowed heavily from strcmp95.c
+ *    http://www.census.gov/geo/msb/stand/strcmp.c
+ */
+double _jaro_winkler_pattern(const JFISH_UNICODE *ying, int ying_length,
+                             const JFISH_UNICODE *yang, int yang_length,
+                             const struct pattern_match *yang_pm,
+                             int long_tolerance, int winklerize)
+{
+    /* Arguments:
+
+       ying
+       yang
+         pointers to the 2 strings to be compared.
+
+       yang_pm
+         yang's match bitmasks, or NULL to scan the strings themselves.
+
+       long_tolerance
+         Increase the probability of a match when the number of matched
+         characters is large.  This option allows for a little more
+         tolerance when the strings are large.  It is not an appropriate
+         test when comparing fixed length fields such as phone and
+         social security numbers.
+    */
+    long search_range;
+    long trans_count, common_chars;
+    int ok;
+
+    // ensure that neither string is blank
+    if (!ying_length || !yang_length) return 0;
+
+    search_range = (ying_length > yang_length) ? ying_length : yang_length;
+
+    search_range = (search_range/2) - 1;
+    if (search_range < 0) search_range = 0;
+
+    // Count and flag the matched pairs, then count the transpositions
+    if (yang_pm) {
+        ok = jaro_match(yang_pm, ying, ying_length, yang, yang_length, search_range, &common_chars, &trans_count);
+    } else {
+        ok = jaro_scan(ying, ying_length, yang, yang_length, search_range, &common_chars, &trans_count);
+    }
+    if (!ok) {
+        return -100;
+    }
+
+    return jaro_weight(ying, ying_length, yang, yang_length, common_chars, trans_count,
+                       long_tolerance, winklerize);
+}
+
+double _jaro_winkler(const JFISH_UNICODE *ying, int ying_length,
+                     const JFISH_UNICODE *yang, int yang_length,
+                     int long_tolerance, int winklerize)
+{
+    struct pattern_match pm;
+    double weight;
+
+    if (!ying_length || !yang_length) return 0;
+
+    switch (pattern_match_init(&pm, yang, yang_length)) {
+    case 0:
+        return -100;
+    case -1:
+        return _jaro_winkler_pattern(ying, ying_length, yang, yang_length, NULL, long_tolerance, winklerize);
+    }
+
+    weight = _jaro_winkler_pattern(ying, ying_length, yang, yang_length, &pm, long_tolerance, winklerize);
+    pattern_match_free(&pm);
+
     return weight;
 }
 
@@ -143,3 +346,193 @@ double jaro_distance(const JFISH_UNICODE *ying, int ying_len, const JFISH_UNICOD
 {
     return _jaro_winkler(ying, ying_len, yang, yang_len, 0, 0);
 }
+
+/* slack on the score bounds, covering rounding in the Winkler boosts */
+#define JARO_BOUND_SLACK 1e-9
+/* query alphabets up to this many characters keep their counts on the stack */
+#define JARO_EXTRACT_STACK_ROWS 128
+
+/* Whether result a ranks below result b: a lower score, or the same score
+   for a later choice. */
+static int extract_worse(const size_t *indices, const double *scores, size_t a, size_t b)
+{
+    return scores[a] < scores[b] || (scores[a] == scores[b] && indices[a] > indices[b]);
+}
+
+static void extract_sift_down(size_t *indices, double *scores, size_t n, size_t i)
+{
+    size_t child, tmp_index;
+    double tmp_score;
+
+    for (; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && extract_worse(indices, scores, child + 1, child)) {
+            child++;
+        }
+        if (!extract_worse(indices, scores, child, i)) {
+            break;
+        }
+        tmp_index = indices[i]; indices[i] = indices[child]; indices[child] = tmp_index;
+        tmp_score = scores[i]; scores[i] = scores[child]; scores[child] = tmp_score;
+    }
+}
+
+static void extract_sift_up(size_t *indices, double *scores, size_t i)
+{
+    size_t parent, tmp_index;
+    double tmp_score;
+
+    for (; i && extract_worse(indices, scores, i, parent = (i - 1) / 2); i = parent) {
+        tmp_index = indices[i]; indices[i] = indices[parent]; indices[parent] = tmp_index;
+        tmp_score = scores[i]; scores[i] = scores[parent]; scores[parent] = tmp_score;
+    }
+}
+
+/*
+
+  The best `limit` choices scoring at least score_cutoff against query.
+
+  The common characters of two strings are at most the size of their
+  character multiset intersection, which is at most the shorter length.
+  Taking that many common characters and no transpositions bounds the
+  score from above, so a choice whose bound cannot reach the cutoff, or
+  beat the worst of the best `limit` found so far, is skipped without
+  running the matcher.  The length bound costs nothing, the intersection
+  one pass over the choice against the query's match rows and how often
+  each occurs (see pattern_match_counts).  Without query_pm only the
+  length bound is used.
+
+  The results are kept in indices and scores, both of room for limit
+  entries, as a heap with the worst at the top, and are finally sorted
+  best first, ties in choice order.  Returns the number of results or -1
+  on failed malloc.
+
+*/
+long jaro_winkler_extract_pattern(const JFISH_UNICODE *query, int query_len,
+        const struct pattern_match *query_pm, const int *query_counts,
+        const JFISH_UNICODE *const *choices, const int *lens, size_t count,
+        size_t limit, double score_cutoff, int long_tolerance,
+        size_t *indices, double *scores)
+{
+    int stack_used[JARO_EXTRACT_STACK_ROWS];
+    int *used = stack_used;
+    size_t found = 0;
+    size_t i, tmp_index;
+    long common;
+    double bound, threshold, score, tmp_score;
+    int j, row, len;
+
+    if (!limit) {
+        return 0;
+    }
+
+    if (query_pm && query_pm->rows > JARO_EXTRACT_STACK_ROWS) {
+        used = malloc(query_pm->rows * sizeof(int));
+        if (!used) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        len = lens[i];
+        threshold = score_cutoff;
+        if (found == limit && scores[0] > threshold) {
+            threshold = scores[0];
+        }
+
+        common = MIN(query_len, len);
+        bound = jaro_weight(query, query_len, choices[i], len, common, 0, long_tolerance, 1);
+        if (bound + JARO_BOUND_SLACK < threshold) {
+            continue;
+        }
+
+        if (query_pm) {
+            memset(used, 0, query_pm->rows * sizeof(int));
+            common = 0;
+            for (j = 0; j < len; j++) {
+                row = pattern_match_row(query_pm, choices[i][j]);
+                if (row && used[row] < query_counts[row]) {
+                    used[row]++;
+                    common++;
+                }
+            }
+            bound = jaro_weight(query, query_len, choices[i], len, common, 0, long_tolerance, 1);
+            if (bound + JARO_BOUND_SLACK < threshold) {
+                continue;
+            }
+        }
+
+        score = _jaro_winkler(query, query_len, choices[i], len, long_tolerance, 1);
+        if (score < -1) {
+            found = (size_t)-1;
+            break;
+        }
+        if (score < score_cutoff) {
+            continue;
+        }
+
+        if (found < limit) {
+            indices[found] = i;
+            scores[found] = score;
+            extract_sift_up(indices, scores, found++);
+        } else if (score > scores[0]) {
+            /* a tie with the worst keeps the earlier choice */
+            indices[0] = i;
+            scores[0] = score;
+            extract_sift_down(indices, scores, found, 0);
+        }
+    }
+
+    if (used != stack_used) {
+        free(used);
+    }
+    if (found == (size_t)-1) {
+        return -1;
+    }
+
+    /* heap sort, the worst moves to the back first */
+    for (i = found; i > 1; i--) {
+        tmp_index = indices[0]; indices[0] = indices[i - 1]; indices[i - 1] = tmp_index;
+        tmp_score = scores[0]; scores[0] = scores[i - 1]; scores[i - 1] = tmp_score;
+        extract_sift_down(indices, scores, i - 1, 0);
+    }
+
+    return (long)found;
+}
+
+long jaro_winkler_extract(const JFISH_UNICODE *query, int query_len,
+        const JFISH_UNICODE *const *choices, const int *lens, size_t count,
+        size_t limit, double score_cutoff, int long_tolerance,
+        size_t *indices, double *scores)
+{
+    struct pattern_match pm;
+    int stack_counts[JARO_EXTRACT_STACK_ROWS];
+    int *counts = stack_counts;
+    long found;
+
+    switch (pattern_match_init(&pm, query, query_len)) {
+    case 0:
+        return -1;
+    case -1:
+        return jaro_winkler_extract_pattern(query, query_len, NULL, NULL, choices, lens, count,
+                                            limit, score_cutoff, long_tolerance, indices, scores);
+    }
+
+    if (pm.rows > JARO_EXTRACT_STACK_ROWS) {
+        counts = malloc(pm.rows * sizeof(int));
+        if (!counts) {
+            pattern_match_free(&pm);
+            return -1;
+        }
+    }
+    pattern_match_counts(&pm, counts);
+
+    found = jaro_winkler_extract_pattern(query, query_len, &pm, counts, choices, lens, count,
+                                         limit, score_cutoff, long_tolerance, indices, scores);
+
+    if (counts != stack_counts) {
+        free(counts);
+    }
+    pattern_match_free(&pm);
+
+    return found;
+}
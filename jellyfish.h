@@ -2,43 +2,189 @@
 #define _JELLYFISH_H_
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #if CJELLYFISH_PYTHON
 #include <Python.h>
 #define JFISH_UNICODE Py_UNICODE
+
+/* critical sections only exist (and only matter) from Python 3.13 on */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
 #endif
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+/* match bitmasks of a string, see pattern_match.h; the _pattern variants
+   take a table built once up front */
+struct pattern_match;
+
 double jaro_winkler(const JFISH_UNICODE *str1, int len1, const JFISH_UNICODE *str2, int len2, int long_tolerance);
 double jaro_distance(const JFISH_UNICODE *str1, int len1, const JFISH_UNICODE *str2, int len2);
+double _jaro_winkler_pattern(const JFISH_UNICODE *str1, int len1, const JFISH_UNICODE *str2, int len2, const struct pattern_match *pm2, int long_tolerance, int winklerize);
+long jaro_winkler_extract(const JFISH_UNICODE *query, int query_len,
+        const JFISH_UNICODE *const *choices, const int *lens, size_t count,
+        size_t limit, double score_cutoff, int long_tolerance,
+        size_t *indices, double *scores);
+long jaro_winkler_extract_pattern(const JFISH_UNICODE *query, int query_len,
+        const struct pattern_match *query_pm, const int *query_counts,
+        const JFISH_UNICODE *const *choices, const int *lens, size_t count,
+        size_t limit, double score_cutoff, int long_tolerance,
+        size_t *indices, double *scores);
 
 size_t hamming_distance(const JFISH_UNICODE *str1, int len1,
         const JFISH_UNICODE *str2, int len2);
+size_t hamming_distance_bits(const void *b1, size_t len1, const void *b2, size_t len2);
+
+/* match counts are kept in bytes */
+#define HAMMING_TABLE_MAX_WIDTH 255
+
+struct hamming_table;
+int hamming_table_create(struct hamming_table **table, const JFISH_UNICODE *const *codes, size_t count, int width);
+void hamming_table_free(struct hamming_table *table);
+size_t hamming_table_count(const struct hamming_table *table);
+int hamming_table_width(const struct hamming_table *table);
+size_t hamming_table_search(const struct hamming_table *table, const JFISH_UNICODE *query, int query_len,
+        int max_distance, int threads, size_t *results);
 
 int levenshtein_distance(const JFISH_UNICODE *str1, int len1, const JFISH_UNICODE *str2, int len2);
+int levenshtein_distance_max(const JFISH_UNICODE *str1, int len1, const JFISH_UNICODE *str2, int len2, int max_distance);
+int levenshtein_distance_many(const JFISH_UNICODE *query, int query_len,
+        const JFISH_UNICODE *const *candidates, const int *lens, size_t count,
+        int max_distance, int *results);
+int levenshtein_distance_pattern(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len, int max_distance);
+int levenshtein_distance_many_pattern(const struct pattern_match *pm,
+        const JFISH_UNICODE *const *candidates, const int *lens, size_t count,
+        int max_distance, int *results);
 
 double weighted_levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, PyObject *insert_weights, PyObject *delete_weights, PyObject *substitute_weights);
 
+struct weight_table;
+struct weight_table* weight_table_create(void);
+void weight_table_free(struct weight_table *table);
+int weight_table_set_insert(struct weight_table *table, JFISH_UNICODE c, double weight);
+int weight_table_set_delete(struct weight_table *table, JFISH_UNICODE c, double weight);
+int weight_table_set_substitute(struct weight_table *table, JFISH_UNICODE a, JFISH_UNICODE b, double weight);
+struct weight_table* weight_table_from_dicts(PyObject *insert_weights, PyObject *delete_weights, PyObject *substitute_weights);
+double weighted_levenshtein_distance_table(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct weight_table *table);
+double weighted_levenshtein_distance_table_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct weight_table *table, double max_cost);
+
+#define COST_MODEL_MAX_CLASSES 256
+
+/* what characters without an explicit class are classified by */
+enum cost_model_category {
+    COST_MODEL_DIGIT,
+    COST_MODEL_ALPHA,
+    COST_MODEL_SPACE,
+    COST_MODEL_OTHER,
+    COST_MODEL_CATEGORIES
+};
+
+struct cost_model;
+struct cost_model* cost_model_create(int classes);
+void cost_model_free(struct cost_model *model);
+int cost_model_set_class(struct cost_model *model, JFISH_UNICODE c, int cls);
+void cost_model_set_category(struct cost_model *model, enum cost_model_category cat, int cls);
+void cost_model_set_insert(struct cost_model *model, int cls, double cost);
+void cost_model_set_delete(struct cost_model *model, int cls, double cost);
+void cost_model_set_substitute(struct cost_model *model, int cls1, int cls2, double cost);
+struct cost_model* cost_model_from_weights(double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight);
+double custom_weighted_levenshtein_distance_model(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct cost_model *model);
+double custom_weighted_levenshtein_distance_model_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct cost_model *model, double max_cost);
+
 double custom_weighted_levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight);
+double custom_weighted_levenshtein_distance_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, double insert_numeric_weight, double insert_alpha_weight, double delete_numeric_weight, double delete_alpha_weight, double substitute_numeric_weight, double substitute_alpha_weight, double max_cost);
 
 int damerau_levenshtein_distance(const JFISH_UNICODE *str1, const JFISH_UNICODE *str2,
         size_t len1, size_t len2);
+int damerau_levenshtein_distance_max(const JFISH_UNICODE *str1, const JFISH_UNICODE *str2,
+        size_t len1, size_t len2, int max_distance);
+
+int optimal_string_alignment_distance(const JFISH_UNICODE *str1, int len1, const JFISH_UNICODE *str2, int len2);
+int optimal_string_alignment_distance_pattern(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len);
+
+/* latin_nfkd covers the code points below this, from U+0080; no
+   decomposition is longer than LATIN_NFKD_MAX bytes */
+#define LATIN_NFKD_END 0x250
+#define LATIN_NFKD_MAX 5
+
+const char* latin_nfkd(uint32_t c);
+
+/* a code and its terminating NUL */
+#define SOUNDEX_SIZE 5
+
+/* Packed codes are 16 bits; the code of the empty string packs to
+   SOUNDEX_EMPTY, and codes whose first byte is not ASCII, which do not
+   fit, to SOUNDEX_UNPACKABLE. */
+#define SOUNDEX_EMPTY 0
+#define SOUNDEX_UNPACKABLE 0xFFFF
 
 char* soundex(const char *str);
+void soundex_into(const char *str, char *code);
+uint16_t soundex_pack(const char *code);
+int soundex_unpack(uint16_t packed, char *code);
 
 char* metaphone(const char *str);
 
+/* The code units nysiis_into may write for a string of len, with its
+   terminator, when codes are cut to max_len (no limit if negative).
+   nysiis_many writes its codes back to back into room for all of them,
+   code i starting at offsets[i] and offsets[count] being the total. */
+#define NYSIIS_SIZE(len, max_len) ((max_len) >= 0 && (max_len) < (len) - 4 ? (max_len) + 5 : (len) + 1)
+
 JFISH_UNICODE *nysiis(const JFISH_UNICODE *str, int len);
+int nysiis_into(const JFISH_UNICODE *str, int len, int max_len, JFISH_UNICODE *code);
+size_t nysiis_many(const JFISH_UNICODE *const *strs, const int *lens, size_t count,
+        int max_len, JFISH_UNICODE *codes, size_t *offsets);
 
 JFISH_UNICODE* match_rating_codex(const JFISH_UNICODE *str, size_t len);
+/* codex has room for 7 code units, the codex and its terminator */
+size_t match_rating_codex_into(const JFISH_UNICODE *str, size_t len, JFISH_UNICODE *codex);
 int match_rating_comparison(const JFISH_UNICODE *str1, size_t len1, const JFISH_UNICODE *str2, size_t len2);
+int match_rating_comparison_codex(const JFISH_UNICODE *codex1, size_t len1, const JFISH_UNICODE *codex2, size_t len2);
+
+/* Codexes packed into 64 bits, for those whose characters are all below
+   U+0100; the others pack to MRA_CODEX_UNPACKABLE, and comparing it to
+   anything gives -2. */
+#define MRA_CODEX_UNPACKABLE UINT64_MAX
+
+uint64_t match_rating_codex_pack(const JFISH_UNICODE *codex, size_t len);
+uint64_t match_rating_codex_packed(const JFISH_UNICODE *str, size_t len);
+void match_rating_codex_many(const JFISH_UNICODE *const *strs, const int *lens, size_t count, uint64_t *codexes);
+int match_rating_comparison_packed(uint64_t codex1, uint64_t codex2);
+void match_rating_comparison_packed_many(uint64_t codex, const uint64_t *codexes, size_t count, signed char *results);
+
+/* the encoders a phonetic_index keys records by */
+enum phonetic_encoder {
+    PHONETIC_SOUNDEX,
+    PHONETIC_METAPHONE,
+    PHONETIC_NYSIIS,
+    PHONETIC_MATCH_RATING_CODEX,
+    PHONETIC_ENCODERS
+};
+
+struct phonetic_index;
+int phonetic_index_create(struct phonetic_index **index, unsigned encoders,
+        const char *const *nfkd, const JFISH_UNICODE *const *strs, const int *lens,
+        size_t count, int threads);
+void phonetic_index_free(struct phonetic_index *index);
+size_t phonetic_index_count(const struct phonetic_index *index);
+size_t phonetic_index_keys(const struct phonetic_index *index);
+size_t phonetic_index_size(const struct phonetic_index *index);
+long phonetic_index_candidates(const struct phonetic_index *index,
+        const char *nfkd, const JFISH_UNICODE *str, int len, uint32_t **results);
 
 struct stemmer;
 extern struct stemmer * create_stemmer(void);
 extern void free_stemmer(struct stemmer * z);
 extern int stem(struct stemmer * z, JFISH_UNICODE * b, int k);
+extern void stem_many(struct stemmer * z, JFISH_UNICODE * b, const int * lens,
+        size_t count, int * stem_lens);
+extern size_t stem_text(struct stemmer * z, const JFISH_UNICODE * text, size_t len,
+        size_t * pos, JFISH_UNICODE * stems, size_t * offsets, size_t * spans, size_t count);
 
 #endif
@@ -1,12 +1,20 @@
 #include <Python.h>
 #include <math.h>
 #include "jellyfish.h"
+#include "pattern_match.h"
+
+struct code_cache;
 
 struct jellyfish_state {
     PyObject *unicodedata_normalize;
+    PyObject *array_type;
+    // NULL until set_cache_size is first called
+    struct code_cache *cache;
 };
 
 #define GETSTATE(m) ((struct jellyfish_state*)PyModule_GetState(m))
+
+static struct PyModuleDef moduledef;
 #define UTF8_BYTES(s) (PyBytes_AS_STRING(s))
 #define NO_BYTES_ERR_STR "str argument expected"
 
@@ -16,6 +24,245 @@ struct jellyfish_state {
 #define INLINE inline
 #endif
 
+/* strings shorter than this are copied onto the stack */
+#define TEXT_INLINE 64
+
+/* The phonetic codes a Prepared caches. */
+enum {
+    PREPARED_SOUNDEX,
+    PREPARED_METAPHONE,
+    PREPARED_NYSIIS,
+    PREPARED_MATCH_RATING_CODEX,
+    PREPARED_CODES
+};
+
+/* A str prepared once for comparing against many others: its code points,
+ * its match bitmasks and how often each character occurs, and its phonetic
+ * codes, computed on first use.  Everything but the codes is fixed by
+ * __init__, so it is read without the GIL.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *string;
+    Py_UNICODE *str;
+    int len;
+    // NULL for the empty str and alphabets too large for match bitmasks
+    struct pattern_match *pm;
+    int *counts;
+    PyObject *codes[PREPARED_CODES];
+} PreparedObject;
+
+static PyTypeObject Prepared_Type;
+
+#define Prepared_Check(op) PyObject_TypeCheck(op, &Prepared_Type)
+
+/* The Py_UNICODE buffer of a str argument.  The code points are copied out
+ * of a str, onto the stack when short, and a Prepared's buffer is borrowed;
+ * either way it stays valid with the GIL released for as long as the
+ * argument is referenced.
+ */
+struct text {
+    const Py_UNICODE *str;
+    int len;
+    Py_UNICODE *owned;
+    // the argument when it was a Prepared, borrowed
+    PreparedObject *prepared;
+    Py_UNICODE inline_buf[TEXT_INLINE];
+};
+
+/* A text's match bitmasks, when it has them. */
+#define TEXT_PM(t) ((t).prepared ? (t).prepared->pm : NULL)
+
+static void text_release(struct text *t) {
+    if (t->owned) {
+        PyMem_Free(t->owned);
+        t->owned = NULL;
+    }
+}
+
+/* Points str and len at a Prepared's buffer, returns 0 with an exception
+ * set if it was never initialized.
+ */
+static int prepared_text(PyObject *obj, const Py_UNICODE **str, int *len) {
+    PreparedObject *prep = (PreparedObject*)obj;
+
+    if (!prep->str) {
+        PyErr_SetString(PyExc_TypeError, "Prepared is not initialized");
+        return 0;
+    }
+    *str = prep->str;
+    *len = prep->len;
+    return 1;
+}
+
+/* The str of a str or Prepared argument, borrowed, or NULL with an
+ * exception set.
+ */
+static PyObject* str_of(PyObject *obj) {
+    if (Prepared_Check(obj)) {
+        if (!((PreparedObject*)obj)->string) {
+            PyErr_SetString(PyExc_TypeError, "Prepared is not initialized");
+            return NULL;
+        }
+        return ((PreparedObject*)obj)->string;
+    }
+    if (!PyUnicode_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+    return obj;
+}
+
+/* "O&" converter filling a struct text from a str or a Prepared.  Must be
+ * paired with text_release once parsing succeeded.
+ */
+static int text_converter(PyObject *obj, void *ptr) {
+    struct text *t = (struct text*)ptr;
+    Py_ssize_t len;
+
+    if (!obj) {
+        // cleanup after a later argument failed to parse
+        text_release(t);
+        return 1;
+    }
+
+    t->owned = NULL;
+    t->prepared = NULL;
+    if (Prepared_Check(obj)) {
+        if (!prepared_text(obj, &t->str, &t->len)) {
+            return 0;
+        }
+        t->prepared = (PreparedObject*)obj;
+        return Py_CLEANUP_SUPPORTED;
+    }
+    if (!PyUnicode_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return 0;
+    }
+
+    // a full buffer may have been cut short, where wchar_t is 16 bits a
+    // str needs up to twice its length
+    len = TEXT_INLINE;
+    if (PyUnicode_GET_LENGTH(obj) < TEXT_INLINE) {
+        len = PyUnicode_AsWideChar(obj, t->inline_buf, TEXT_INLINE);
+        if (len == -1) {
+            return 0;
+        }
+        t->str = t->inline_buf;
+    }
+    if (len == TEXT_INLINE) {
+        t->owned = PyUnicode_AsWideCharString(obj, &len);
+        if (!t->owned) {
+            return 0;
+        }
+        t->str = t->owned;
+    }
+
+    t->len = (int)len;
+    return Py_CLEANUP_SUPPORTED;
+}
+
+/* The Py_UNICODE buffers of every str (or Prepared) in a sequence. */
+struct text_list {
+    Py_ssize_t count;
+    const Py_UNICODE **strs;
+    int *lens;
+    Py_UNICODE *storage;
+};
+
+static void text_list_free(struct text_list *tl) {
+    free((void*)tl->strs);
+    free(tl->lens);
+    PyMem_Free(tl->storage);
+    tl->strs = NULL;
+    tl->lens = NULL;
+    tl->storage = NULL;
+}
+
+static int text_list_fill(struct text_list *tl, PyObject *seq) {
+    PyObject *item;
+    Py_ssize_t i, len;
+    Py_ssize_t total = 0;
+    Py_UNICODE *p;
+
+    tl->count = PySequence_Fast_GET_SIZE(seq);
+    tl->strs = malloc((tl->count ? tl->count : 1) * sizeof(Py_UNICODE*));
+    tl->lens = malloc((tl->count ? tl->count : 1) * sizeof(int));
+    if (!tl->strs || !tl->lens) {
+        PyErr_NoMemory();
+        return 0;
+    }
+
+    for (i = 0; i < tl->count; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (Prepared_Check(item)) {
+            // already a stable buffer, never copied
+            if (!prepared_text(item, &tl->strs[i], &tl->lens[i])) {
+                return 0;
+            }
+            continue;
+        }
+        if (!PyUnicode_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+            return 0;
+        }
+        // the exact wchar_t count including the terminator, which differs
+        // from the length where wchar_t is 16 bits
+        len = PyUnicode_AsWideChar(item, NULL, 0);
+        if (len == -1) {
+            return 0;
+        }
+        tl->lens[i] = (int)(len - 1);
+        total += len;
+    }
+
+    tl->storage = PyMem_Malloc((total ? total : 1) * sizeof(Py_UNICODE));
+    if (!tl->storage) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    for (p = tl->storage, i = 0; i < tl->count; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (Prepared_Check(item)) {
+            continue;
+        }
+        PyUnicode_AsWideChar(item, p, tl->lens[i] + 1);
+        tl->strs[i] = p;
+        p += tl->lens[i] + 1;
+    }
+
+    return 1;
+}
+
+/* Fills tl from a sequence of str or Prepared, returns 0 with an exception
+ * set on failure.  The strs are all copied into a single block, Prepared
+ * buffers are borrowed.
+ */
+static int text_list_init(struct text_list *tl, PyObject *seq_obj) {
+    PyObject *seq;
+    int ok;
+
+    tl->count = 0;
+    tl->strs = NULL;
+    tl->lens = NULL;
+    tl->storage = NULL;
+
+    seq = PySequence_Fast(seq_obj, "a sequence of str is required");
+    if (!seq) {
+        return 0;
+    }
+
+    // keeps other threads from resizing a list under a free-threaded build
+    Py_BEGIN_CRITICAL_SECTION(seq);
+    ok = text_list_fill(tl, seq);
+    Py_END_CRITICAL_SECTION();
+
+    Py_DECREF(seq);
+    if (!ok) {
+        text_list_free(tl);
+    }
+    return ok;
+}
 
 /* Returns a new reference to a PyString (python < 3) or
  * PyBytes (python >= 3.0).
@@ -23,14 +270,14 @@ struct jellyfish_state {
  * If passed a PyUnicode, the returned object will be NFKD UTF-8.
  * If passed a PyString or PyBytes no conversion is done.
  */
-static INLINE PyObject* normalize(PyObject *mod, const Py_UNICODE *pystr) {
+static INLINE PyObject* normalize(PyObject *mod, PyObject *pystr) {
     PyObject *unicodedata_normalize;
     PyObject *normalized;
     PyObject *utf8;
 
     unicodedata_normalize = GETSTATE(mod)->unicodedata_normalize;
     normalized = PyObject_CallFunction(unicodedata_normalize,
-                                       "su", "NFKD", pystr);
+                                       "sO", "NFKD", pystr);
     if (!normalized) {
         return NULL;
     }
@@ -39,336 +286,2785 @@ static INLINE PyObject* normalize(PyObject *mod, const Py_UNICODE *pystr) {
     return utf8;
 }
 
+/* NFKD forms up to this many UTF-8 bytes are folded onto the stack */
+#define NFKD_INLINE 256
+
+/* The NFKD UTF-8 bytes of a str.  ASCII strs are their own NFKD form and
+ * are borrowed as they are, Latin strs are decomposed into buf through
+ * latin_nfkd, and only the rest go through unicodedata.
+ */
+struct nfkd {
+    const char *bytes;
+    PyObject *normalized;
+    char buf[NFKD_INLINE];
+};
+
+static const char* fold_latin(PyObject *str, char *buf) {
+    const void *data;
+    const char *d;
+    char *p = buf;
+    Py_ssize_t i, len;
+    Py_UCS4 c;
+    int kind;
+
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(str) == -1) {
+        // unicodedata reports the error
+        PyErr_Clear();
+        return NULL;
+    }
+#endif
+    if (PyUnicode_IS_ASCII(str)) {
+        return (const char*)PyUnicode_DATA(str);
+    }
+
+    kind = PyUnicode_KIND(str);
+    data = PyUnicode_DATA(str);
+    len = PyUnicode_GET_LENGTH(str);
+    if (kind == PyUnicode_4BYTE_KIND || len >= NFKD_INLINE) {
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        c = PyUnicode_READ(kind, data, i);
+        if (c < 0x80) {
+            d = NULL;
+        } else if (!(d = latin_nfkd(c))) {
+            return NULL;
+        }
+        if (p + (d ? LATIN_NFKD_MAX : 1) >= buf + NFKD_INLINE) {
+            return NULL;
+        }
+        if (!d) {
+            *p++ = (char)c;
+        } else {
+            while (*d) {
+                *p++ = *d++;
+            }
+        }
+    }
+    *p = '\0';
+    return buf;
+}
+
+/* Fills n from a str, returns 0 with an exception set on failure.  Must be
+ * paired with nfkd_release once it succeeded.
+ */
+static int nfkd_init(struct nfkd *n, PyObject *mod, PyObject *str) {
+    n->normalized = NULL;
+    n->bytes = fold_latin(str, n->buf);
+    if (n->bytes) {
+        return 1;
+    }
+
+    n->normalized = normalize(mod, str);
+    if (!n->normalized) {
+        return 0;
+    }
+    n->bytes = UTF8_BYTES(n->normalized);
+    return 1;
+}
+
+static void nfkd_release(struct nfkd *n) {
+    Py_XDECREF(n->normalized);
+    n->normalized = NULL;
+}
+
+/* The NFKD UTF-8 bytes of every str (or Prepared) in a list or tuple, NUL
+ * terminated and back to back in a single block.
+ */
+struct nfkd_list {
+    Py_ssize_t count;
+    const char **bytes;
+    char *storage;
+};
+
+static void nfkd_list_free(struct nfkd_list *nl) {
+    free((void*)nl->bytes);
+    PyMem_Free(nl->storage);
+    nl->bytes = NULL;
+    nl->storage = NULL;
+}
+
+static int nfkd_list_fill(struct nfkd_list *nl, PyObject *mod, PyObject *seq) {
+    struct nfkd normalized;
+    PyObject *item;
+    Py_ssize_t i;
+    size_t used = 0, size = 0, len;
+    size_t *offsets;
+    char *storage;
+
+    nl->count = PySequence_Fast_GET_SIZE(seq);
+    nl->bytes = malloc((nl->count ? nl->count : 1) * sizeof(char*));
+    // the block moves as it grows, so pointers wait for the end
+    offsets = malloc((nl->count ? nl->count : 1) * sizeof(size_t));
+    if (!nl->bytes || !offsets) {
+        free(offsets);
+        PyErr_NoMemory();
+        return 0;
+    }
+
+    for (i = 0; i < nl->count; i++) {
+        item = str_of(PySequence_Fast_GET_ITEM(seq, i));
+        if (!item || !nfkd_init(&normalized, mod, item)) {
+            free(offsets);
+            return 0;
+        }
+        len = strlen(normalized.bytes) + 1;
+        if (used + len > size) {
+            for (size = size ? size : 1024; size < used + len; size *= 2);
+            storage = PyMem_Realloc(nl->storage, size);
+            if (!storage) {
+                nfkd_release(&normalized);
+                free(offsets);
+                PyErr_NoMemory();
+                return 0;
+            }
+            nl->storage = storage;
+        }
+        memcpy(nl->storage + used, normalized.bytes, len);
+        nfkd_release(&normalized);
+        offsets[i] = used;
+        used += len;
+    }
+
+    for (i = 0; i < nl->count; i++) {
+        nl->bytes[i] = nl->storage + offsets[i];
+    }
+    free(offsets);
+    return 1;
+}
+
+/* Fills nl from a list or tuple, returns 0 with an exception set on
+ * failure.
+ */
+static int nfkd_list_init(struct nfkd_list *nl, PyObject *mod, PyObject *seq) {
+    int ok;
+
+    nl->count = 0;
+    nl->bytes = NULL;
+    nl->storage = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(seq);
+    ok = nfkd_list_fill(nl, mod, seq);
+    Py_END_CRITICAL_SECTION();
+
+    if (!ok) {
+        nfkd_list_free(nl);
+    }
+    return ok;
+}
+
+/* Returns a new array.array of the given typecode holding a copy of the
+ * size bytes at data.  Methods find mod through PyState_FindModule.
+ */
+static PyObject* new_array(PyObject *mod, const char *typecode,
+                           const void *data, Py_ssize_t size) {
+    PyObject *bytes;
+    PyObject *array;
+
+    bytes = PyBytes_FromStringAndSize((const char*)data, size);
+    if (!bytes) {
+        return NULL;
+    }
+    array = PyObject_CallFunction(GETSTATE(mod)->array_type, "sO", typecode, bytes);
+    Py_DECREF(bytes);
+    return array;
+}
+
+/* The array typecode of size_t. */
+#define SIZE_T_TYPECODE (sizeof(size_t) == sizeof(unsigned long long) ? "Q" : "I")
+
+/* Converts an optional non-negative bound argument, None meaning unbounded
+ * (-1).  Returns 0 with an exception set on bad input.
+ */
+static int parse_bound(PyObject *obj, const char *name, int *bound) {
+    long value;
+
+    *bound = -1;
+    if (obj == Py_None) {
+        return 1;
+    }
+
+    value = PyLong_AsLong(obj);
+    if (value == -1 && PyErr_Occurred()) {
+        return 0;
+    }
+    if (value < 0) {
+        PyErr_Format(PyExc_ValueError, "%s must be non-negative", name);
+        return 0;
+    }
+    // anything at least as long as the inputs cannot cut anything off
+    *bound = value < INT_MAX ? (int)value : -1;
+    return 1;
+}
+
+static int parse_max_distance(PyObject *obj, int *max_distance) {
+    return parse_bound(obj, "max_distance", max_distance);
+}
+
+/* Converts an optional max_cost argument, None meaning unbounded (-1).
+ * Returns 0 with an exception set on bad input.
+ */
+static int parse_max_cost(PyObject *obj, double *max_cost) {
+    *max_cost = -1;
+    if (obj == Py_None) {
+        return 1;
+    }
+
+    *max_cost = PyFloat_AsDouble(obj);
+    if (*max_cost == -1.0 && PyErr_Occurred()) {
+        return 0;
+    }
+    if (*max_cost < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_cost must be non-negative");
+        return 0;
+    }
+    return 1;
+}
+
+static int Prepared_init(PreparedObject *self, PyObject *args, PyObject *kw)
+{
+    PyObject *string;
+    Py_UNICODE *str;
+    Py_ssize_t len;
+    struct pattern_match *pm = NULL;
+    int *counts = NULL;
+    int raced;
+    static char *keywords[] = {"string", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "U", keywords, &string)) {
+        return -1;
+    }
+
+    // the buffers are read without the GIL, so they are never swapped out
+    if (self->str) {
+        PyErr_SetString(PyExc_RuntimeError, "Prepared is already initialized");
+        return -1;
+    }
+
+    str = PyUnicode_AsWideCharString(string, &len);
+    if (!str) {
+        return -1;
+    }
+
+    if (len) {
+        pm = malloc(sizeof(struct pattern_match));
+        if (!pm) {
+            goto nomem;
+        }
+        switch (pattern_match_init(pm, str, (int)len)) {
+        case 0:
+            free(pm);
+            goto nomem;
+        case -1:
+            // no bitmasks, the metrics use their plain kernels
+            free(pm);
+            pm = NULL;
+            break;
+        default:
+            counts = malloc(pm->rows * sizeof(int));
+            if (!counts) {
+                pattern_match_free(pm);
+                free(pm);
+                goto nomem;
+            }
+            pattern_match_counts(pm, counts);
+        }
+    }
+
+    // a concurrent __init__ may have got there first, only one is kept
+    Py_BEGIN_CRITICAL_SECTION(self);
+    raced = self->str != NULL;
+    if (!raced) {
+        Py_INCREF(string);
+        self->string = string;
+        self->len = (int)len;
+        self->pm = pm;
+        self->counts = counts;
+        self->str = str;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (raced) {
+        if (pm) {
+            pattern_match_free(pm);
+            free(pm);
+        }
+        free(counts);
+        PyMem_Free(str);
+        PyErr_SetString(PyExc_RuntimeError, "Prepared is already initialized");
+        return -1;
+    }
+    return 0;
+
+ nomem:
+    PyMem_Free(str);
+    PyErr_NoMemory();
+    return -1;
+}
+
+static void Prepared_dealloc(PreparedObject *self)
+{
+    int i;
+
+    if (self->pm) {
+        pattern_match_free(self->pm);
+        free(self->pm);
+    }
+    free(self->counts);
+    PyMem_Free(self->str);
+    Py_XDECREF(self->string);
+    for (i = 0; i < PREPARED_CODES; i++) {
+        Py_XDECREF(self->codes[i]);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Prepared_repr(PreparedObject *self)
+{
+    if (!self->string) {
+        return PyUnicode_FromString("Prepared()");
+    }
+    return PyUnicode_FromFormat("Prepared(%R)", self->string);
+}
+
+static PyObject* Prepared_get_string(PreparedObject *self, void *closure)
+{
+    if (!self->string) {
+        Py_RETURN_NONE;
+    }
+    Py_INCREF(self->string);
+    return self->string;
+}
+
+static PyGetSetDef Prepared_getset[] = {
+    {"string", (getter)Prepared_get_string, NULL, "The prepared str.", NULL},
+    {NULL}
+};
+
+static PyTypeObject Prepared_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "jellyfish.cjellyfish.Prepared",
+    .tp_basicsize = sizeof(PreparedObject),
+    .tp_dealloc = (destructor)Prepared_dealloc,
+    .tp_repr = (reprfunc)Prepared_repr,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Prepared(string)\n\n"
+              "A str prepared for comparing against many others.  Every function\n"
+              "taking a str also takes a Prepared, which skips converting the str\n"
+              "each call.  The bit-parallel metrics reuse its match bitmasks, the\n"
+              "Jaro metrics when it is the second string, and the phonetic codes\n"
+              "are computed once, on first use.",
+    .tp_getset = Prepared_getset,
+    .tp_init = (initproc)Prepared_init,
+    .tp_new = PyType_GenericNew,
+};
+
 static PyObject * jellyfish_jaro_winkler(PyObject *self, PyObject *args, PyObject *kw)
 {
-    const Py_UNICODE *s1, *s2;
-    int len1, len2;
+    struct text s1, s2;
     double result;
     int long_tolerance = 0;
     static char *keywords[] = {"s1", "s2", "long_tolerance", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kw, "u#u#|i", keywords, &s1, &len1, &s2, &len2, &long_tolerance)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O&|i", keywords, text_converter, &s1, text_converter, &s2, &long_tolerance)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (TEXT_PM(s2)) {
+        result = _jaro_winkler_pattern(s1.str, s1.len, s2.str, s2.len, TEXT_PM(s2), long_tolerance, 1);
+    } else {
+        result = jaro_winkler(s1.str, s1.len, s2.str, s2.len, long_tolerance);
+    }
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    // jaro returns a big negative number on error, don't use
+    // 0 here in case there's floating point inaccuracy
+    // .. used to use NaN but different compilers (*cough*MSVC*cough)
+    // handle it really poorly
+    if (result < -1) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return Py_BuildValue("d", result);
+}
+
+static PyObject * jellyfish_jaro_winkler_extract(PyObject *self, PyObject *args, PyObject *kw)
+{
+    struct text query;
+    struct text_list choices;
+    PyObject *choices_obj;
+    PyObject *snapshot;
+    PyObject *limit_obj = NULL;
+    PyObject *ret = NULL;
+    PyObject *choice, *item;
+    Py_ssize_t limit;
+    double score_cutoff = 0.0;
+    int long_tolerance = 0;
+    size_t *indices = NULL;
+    double *scores = NULL;
+    long found, i;
+    static char *keywords[] = {"query", "choices", "limit", "score_cutoff", "long_tolerance", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O|Odi", keywords, text_converter, &query, &choices_obj, &limit_obj, &score_cutoff, &long_tolerance)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    // results are built from the same items that were scored, whatever
+    // choices_obj iterates or is changed into meanwhile
+    snapshot = PySequence_Tuple(choices_obj);
+    if (!snapshot) {
+        text_release(&query);
+        return NULL;
+    }
+    if (!text_list_init(&choices, snapshot)) {
+        Py_DECREF(snapshot);
+        text_release(&query);
+        return NULL;
+    }
+
+    // None asks for every choice reaching score_cutoff
+    limit = 5;
+    if (limit_obj == Py_None) {
+        limit = choices.count;
+    } else if (limit_obj) {
+        limit = PyLong_AsSsize_t(limit_obj);
+        if (limit == -1 && PyErr_Occurred()) {
+            goto done;
+        }
+        if (limit < 0) {
+            PyErr_SetString(PyExc_ValueError, "limit must be non-negative");
+            goto done;
+        }
+    }
+    limit = limit < choices.count ? limit : choices.count;
+
+    indices = malloc((limit ? limit : 1) * sizeof(size_t));
+    scores = malloc((limit ? limit : 1) * sizeof(double));
+    if (!indices || !scores) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (TEXT_PM(query)) {
+        found = jaro_winkler_extract_pattern(query.str, query.len, TEXT_PM(query), query.prepared->counts,
+                                             choices.strs, choices.lens, choices.count,
+                                             limit, score_cutoff, long_tolerance, indices, scores);
+    } else {
+        found = jaro_winkler_extract(query.str, query.len, choices.strs, choices.lens, choices.count,
+                                     limit, score_cutoff, long_tolerance, indices, scores);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (found == -1) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    ret = PyList_New(found);
+    if (!ret) {
+        goto done;
+    }
+    for (i = 0; i < found; i++) {
+        choice = PyTuple_GET_ITEM(snapshot, indices[i]);
+        Py_INCREF(choice);
+        item = Py_BuildValue("(Ndn)", choice, scores[i], (Py_ssize_t)indices[i]);
+        if (!item) {
+            Py_CLEAR(ret);
+            goto done;
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
+
+ done:
+    free(indices);
+    free(scores);
+    text_list_free(&choices);
+    Py_DECREF(snapshot);
+    text_release(&query);
+    return ret;
+}
+
+static PyObject * jellyfish_jaro_distance(PyObject *self, PyObject *args)
+{
+    struct text s1, s2;
+    double result;
+
+    if (!PyArg_ParseTuple(args, "O&O&", text_converter, &s1, text_converter, &s2)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (TEXT_PM(s2)) {
+        result = _jaro_winkler_pattern(s1.str, s1.len, s2.str, s2.len, TEXT_PM(s2), 0, 0);
+    } else {
+        result = jaro_distance(s1.str, s1.len, s2.str, s2.len);
+    }
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    // see earlier note about jaro_distance return value
+    if (result < -1) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return Py_BuildValue("d", result);
+}
+
+static PyObject * jellyfish_hamming_distance(PyObject *self, PyObject *args)
+{
+    struct text s1, s2;
+    unsigned result;
+
+    if (!PyArg_ParseTuple(args, "O&O&", text_converter, &s1, text_converter, &s2)) {
         PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
         return NULL;
     }
 
-    result = jaro_winkler(s1, len1, s2, len2, long_tolerance);
-    // jaro returns a big negative number on error, don't use
-    // 0 here in case there's floating point inaccuracy
-    // .. used to use NaN but different compilers (*cough*MSVC*cough)
-    // handle it really poorly
-    if (result < -1) {
-        PyErr_NoMemory();
+    Py_BEGIN_ALLOW_THREADS
+    result = hamming_distance(s1.str, s1.len, s2.str, s2.len);
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    return Py_BuildValue("I", result);
+}
+
+/* Converts an int to the 64 bits of a fingerprint, negative ints as their
+ * two's complement.  Returns 0 with an exception set if it does not fit.
+ */
+static int fingerprint_bits(PyObject *obj, uint64_t *bits) {
+    long long value = PyLong_AsLongLong(obj);
+
+    if (value == -1 && PyErr_Occurred()) {
+        if (!PyErr_ExceptionMatches(PyExc_OverflowError)) {
+            return 0;
+        }
+        PyErr_Clear();
+        *bits = PyLong_AsUnsignedLongLong(obj);
+        return !(*bits == (uint64_t)-1 && PyErr_Occurred());
+    }
+    *bits = (uint64_t)value;
+    return 1;
+}
+
+static PyObject * jellyfish_hamming_distance_bits(PyObject *self, PyObject *args)
+{
+    PyObject *obj1, *obj2;
+    Py_buffer view1, view2;
+    uint64_t bits1, bits2;
+    size_t result;
+
+    if (!PyArg_ParseTuple(args, "OO", &obj1, &obj2)) {
+        return NULL;
+    }
+
+    if (PyLong_Check(obj1) && PyLong_Check(obj2)) {
+        if (!fingerprint_bits(obj1, &bits1) || !fingerprint_bits(obj2, &bits2)) {
+            return NULL;
+        }
+        return Py_BuildValue("i", bit_popcount64(bits1 ^ bits2));
+    }
+
+    if (PyLong_Check(obj1) || PyLong_Check(obj2) ||
+        !PyObject_CheckBuffer(obj1) || !PyObject_CheckBuffer(obj2)) {
+        PyErr_SetString(PyExc_TypeError, "two ints or two bytes-like objects expected");
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(obj1, &view1, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    if (PyObject_GetBuffer(obj2, &view2, PyBUF_SIMPLE) < 0) {
+        PyBuffer_Release(&view1);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    result = hamming_distance_bits(view1.buf, view1.len, view2.buf, view2.len);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view1);
+    PyBuffer_Release(&view2);
+
+    return PyLong_FromSize_t(result);
+}
+
+static PyObject* jellyfish_levenshtein_distance(PyObject *self, PyObject *args, PyObject *kw)
+{
+    struct text s1, s2;
+    int result;
+    int max_distance;
+    PyObject *max_distance_obj = Py_None;
+    static char *keywords[] = {"s1", "s2", "max_distance", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O&|O", keywords, text_converter, &s1, text_converter, &s2, &max_distance_obj)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    if (!parse_max_distance(max_distance_obj, &max_distance)) {
+        text_release(&s1);
+        text_release(&s2);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (TEXT_PM(s1)) {
+        result = levenshtein_distance_pattern(TEXT_PM(s1), s2.str, s2.len, max_distance);
+    } else if (TEXT_PM(s2)) {
+        result = levenshtein_distance_pattern(TEXT_PM(s2), s1.str, s1.len, max_distance);
+    } else {
+        result = levenshtein_distance_max(s1.str, s1.len, s2.str, s2.len, max_distance);
+    }
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    if (result == -1) {
+        // levenshtein_distance only returns failure code (-1) on
+        // failed malloc
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return Py_BuildValue("i", result);
+}
+
+static PyObject* jellyfish_levenshtein_distance_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+    struct text query;
+    struct text_list candidates;
+    PyObject *candidates_obj;
+    PyObject *max_distance_obj = Py_None;
+    PyObject *ret = NULL;
+    int *results;
+    int max_distance;
+    int status;
+    static char *keywords[] = {"query", "candidates", "max_distance", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O|O", keywords, text_converter, &query, &candidates_obj, &max_distance_obj)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    if (!parse_max_distance(max_distance_obj, &max_distance) ||
+        !text_list_init(&candidates, candidates_obj)) {
+        text_release(&query);
+        return NULL;
+    }
+
+    results = malloc((candidates.count ? candidates.count : 1) * sizeof(int));
+    if (!results) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (TEXT_PM(query)) {
+        status = levenshtein_distance_many_pattern(TEXT_PM(query), candidates.strs, candidates.lens, candidates.count, max_distance, results);
+    } else {
+        status = levenshtein_distance_many(query.str, query.len, candidates.strs, candidates.lens, candidates.count, max_distance, results);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (status == -1) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    ret = new_array(self, "i", results, candidates.count * sizeof(int));
+
+ done:
+    free(results);
+    text_list_free(&candidates);
+    text_release(&query);
+    return ret;
+}
+
+typedef struct {
+    PyObject_HEAD
+    struct weight_table *table;
+} WeightTableObject;
+
+static int WeightTable_init(WeightTableObject *self, PyObject *args, PyObject *kw)
+{
+    PyObject *insert_weights_dict = NULL;
+    PyObject *delete_weights_dict = NULL;
+    PyObject *substitute_weights_dict = NULL;
+    PyObject *empty = NULL;
+    struct weight_table *table;
+    int raced;
+    static char *keywords[] = {"insert_weights", "delete_weights", "substitute_weights", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "|O!O!O!", keywords, &PyDict_Type, &insert_weights_dict, &PyDict_Type, &delete_weights_dict, &PyDict_Type, &substitute_weights_dict)) {
+        return -1;
+    }
+
+    // tables are read without the GIL, so swapping one out from under a
+    // running distance is not allowed
+    if (self->table) {
+        PyErr_SetString(PyExc_RuntimeError, "WeightTable is already initialized");
+        return -1;
+    }
+
+    if (!insert_weights_dict || !delete_weights_dict || !substitute_weights_dict) {
+        empty = PyDict_New();
+        if (!empty) {
+            return -1;
+        }
+    }
+
+    table = weight_table_from_dicts(insert_weights_dict ? insert_weights_dict : empty,
+                                    delete_weights_dict ? delete_weights_dict : empty,
+                                    substitute_weights_dict ? substitute_weights_dict : empty);
+    Py_XDECREF(empty);
+    if (!table) {
+        return -1;
+    }
+
+    // a concurrent __init__ may have got there first, only one is kept
+    Py_BEGIN_CRITICAL_SECTION(self);
+    raced = self->table != NULL;
+    if (!raced) {
+        self->table = table;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (raced) {
+        weight_table_free(table);
+        PyErr_SetString(PyExc_RuntimeError, "WeightTable is already initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static void WeightTable_dealloc(WeightTableObject *self)
+{
+    weight_table_free(self->table);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyTypeObject WeightTable_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "jellyfish.cjellyfish.WeightTable",
+    .tp_basicsize = sizeof(WeightTableObject),
+    .tp_dealloc = (destructor)WeightTable_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "WeightTable(insert_weights=None, delete_weights=None, substitute_weights=None)\n\n"
+              "Precompiled weights for weighted_levenshtein_distance.  Takes the same\n"
+              "dicts as weighted_levenshtein_distance and converts them once.",
+    .tp_init = (initproc)WeightTable_init,
+    .tp_new = PyType_GenericNew,
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct hamming_table *table;
+} HammingTableObject;
+
+static int HammingTable_init(HammingTableObject *self, PyObject *args, PyObject *kw)
+{
+    PyObject *codes_obj;
+    PyObject *width_obj = Py_None;
+    struct text_list codes;
+    struct hamming_table *table;
+    Py_ssize_t i;
+    long width;
+    int status;
+    int raced;
+    static char *keywords[] = {"codes", "width", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", keywords, &codes_obj, &width_obj)) {
+        return -1;
+    }
+
+    // tables are read without the GIL, so they are never swapped out
+    if (self->table) {
+        PyErr_SetString(PyExc_RuntimeError, "HammingTable is already initialized");
+        return -1;
+    }
+
+    if (!text_list_init(&codes, codes_obj)) {
+        return -1;
+    }
+
+    if (width_obj != Py_None) {
+        width = PyLong_AsLong(width_obj);
+        if (width == -1 && PyErr_Occurred()) {
+            text_list_free(&codes);
+            return -1;
+        }
+    } else {
+        width = codes.count ? codes.lens[0] : 0;
+    }
+    if (width < 0 || width > HAMMING_TABLE_MAX_WIDTH) {
+        PyErr_Format(PyExc_ValueError, "width must be between 0 and %d", HAMMING_TABLE_MAX_WIDTH);
+        text_list_free(&codes);
+        return -1;
+    }
+    for (i = 0; i < codes.count; i++) {
+        if (codes.lens[i] != width) {
+            PyErr_Format(PyExc_ValueError, "code %zd is not %ld characters long", i, width);
+            text_list_free(&codes);
+            return -1;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = hamming_table_create(&table, codes.strs, codes.count, (int)width);
+    Py_END_ALLOW_THREADS
+    text_list_free(&codes);
+
+    if (status == 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (status == -1) {
+        PyErr_SetString(PyExc_ValueError, "codes hold more than 65535 distinct characters");
+        return -1;
+    }
+
+    // a concurrent __init__ may have got there first, only one is kept
+    Py_BEGIN_CRITICAL_SECTION(self);
+    raced = self->table != NULL;
+    if (!raced) {
+        self->table = table;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (raced) {
+        hamming_table_free(table);
+        PyErr_SetString(PyExc_RuntimeError, "HammingTable is already initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static void HammingTable_dealloc(HammingTableObject *self)
+{
+    hamming_table_free(self->table);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* HammingTable_search(HammingTableObject *self, PyObject *args, PyObject *kw)
+{
+    struct text query;
+    int max_distance;
+    int threads = 1;
+    size_t *results;
+    size_t found;
+    PyObject *ret;
+    static char *keywords[] = {"query", "max_distance", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&i|i", keywords, text_converter, &query, &max_distance, &threads)) {
+        return NULL;
+    }
+
+    if (!self->table) {
+        text_release(&query);
+        PyErr_SetString(PyExc_TypeError, "HammingTable is not initialized");
+        return NULL;
+    }
+    if (max_distance < 0) {
+        text_release(&query);
+        PyErr_SetString(PyExc_ValueError, "max_distance must be non-negative");
+        return NULL;
+    }
+
+    // room for every code, so the threads never need to grow anything
+    results = malloc((hamming_table_count(self->table) + 1) * sizeof(size_t));
+    if (!results) {
+        text_release(&query);
+        return PyErr_NoMemory();
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    found = hamming_table_search(self->table, query.str, query.len, max_distance, threads, results);
+    Py_END_ALLOW_THREADS
+    text_release(&query);
+
+    ret = new_array(PyState_FindModule(&moduledef), SIZE_T_TYPECODE, results, found * sizeof(size_t));
+    free(results);
+    return ret;
+}
+
+static Py_ssize_t HammingTable_length(HammingTableObject *self)
+{
+    return self->table ? (Py_ssize_t)hamming_table_count(self->table) : 0;
+}
+
+static PyObject* HammingTable_get_width(HammingTableObject *self, void *closure)
+{
+    return PyLong_FromLong(self->table ? hamming_table_width(self->table) : 0);
+}
+
+static PyMethodDef HammingTable_methods[] = {
+    {"search", (PyCFunction)HammingTable_search, METH_VARARGS|METH_KEYWORDS,
+     "search(query, max_distance, threads=1)\n\n"
+     "The indices of every code within Hamming distance max_distance of\n"
+     "query, in table order, as an array.  Large tables are scanned on up to\n"
+     "threads threads, 0 meaning one per CPU."},
+    {NULL}
+};
+
+static PyGetSetDef HammingTable_getset[] = {
+    {"width", (getter)HammingTable_get_width, NULL, "The length of every code.", NULL},
+    {NULL}
+};
+
+static PySequenceMethods HammingTable_as_sequence = {
+    .sq_length = (lenfunc)HammingTable_length,
+};
+
+static PyTypeObject HammingTable_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "jellyfish.cjellyfish.HammingTable",
+    .tp_basicsize = sizeof(HammingTableObject),
+    .tp_dealloc = (destructor)HammingTable_dealloc,
+    .tp_as_sequence = &HammingTable_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "HammingTable(codes, width=None)\n\n"
+              "A table of fixed width codes for Hamming distance searches.  codes is\n"
+              "a sequence of str all width characters long, width defaulting to\n"
+              "the length of the first.",
+    .tp_methods = HammingTable_methods,
+    .tp_getset = HammingTable_getset,
+    .tp_init = (initproc)HammingTable_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static const char *const phonetic_encoder_names[PHONETIC_ENCODERS] = {
+    "soundex",
+    "metaphone",
+    "nysiis",
+    "match_rating_codex",
+};
+
+/* soundex and metaphone work on the NFKD bytes, the others on the str */
+#define PHONETIC_NFKD_ENCODERS ((1u << PHONETIC_SOUNDEX) | (1u << PHONETIC_METAPHONE))
+
+typedef struct {
+    PyObject_HEAD
+    struct phonetic_index *index;
+    unsigned encoders;
+} PhoneticIndexObject;
+
+/* Converts an encoder name or a sequence of them to a bitmask, returns 0
+ * with an exception set on bad input.
+ */
+static unsigned parse_encoders(PyObject *obj)
+{
+    PyObject *seq;
+    PyObject *name;
+    unsigned encoders = 0;
+    Py_ssize_t i;
+    int e;
+
+    if (PyUnicode_Check(obj)) {
+        seq = PyTuple_Pack(1, obj);
+    } else {
+        seq = PySequence_Fast(obj, "encoders must be a str or a sequence of str");
+    }
+    if (!seq) {
+        return 0;
+    }
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        name = PySequence_Fast_GET_ITEM(seq, i);
+        for (e = 0; e < PHONETIC_ENCODERS; e++) {
+            if (PyUnicode_Check(name) && !PyUnicode_CompareWithASCIIString(name, phonetic_encoder_names[e])) {
+                break;
+            }
+        }
+        if (e == PHONETIC_ENCODERS) {
+            PyErr_Format(PyExc_ValueError, "unknown encoder %R", name);
+            Py_DECREF(seq);
+            return 0;
+        }
+        encoders |= 1u << e;
+    }
+    Py_DECREF(seq);
+
+    if (!encoders) {
+        PyErr_SetString(PyExc_ValueError, "at least one encoder is required");
+    }
+    return encoders;
+}
+
+static int PhoneticIndex_init(PhoneticIndexObject *self, PyObject *args, PyObject *kw)
+{
+    PyObject *strings_obj;
+    PyObject *encoders_obj = NULL;
+    PyObject *seq;
+    struct text_list strs = {0};
+    struct nfkd_list nfkd = {0};
+    struct phonetic_index *index;
+    unsigned encoders = 1u << PHONETIC_SOUNDEX;
+    Py_ssize_t count;
+    int threads = 1;
+    int status = 0;
+    int raced;
+    static char *keywords[] = {"strings", "encoders", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|Oi", keywords, &strings_obj, &encoders_obj, &threads)) {
+        return -1;
+    }
+
+    // indexes are read without the GIL, so they are never swapped out
+    if (self->index) {
+        PyErr_SetString(PyExc_RuntimeError, "PhoneticIndex is already initialized");
+        return -1;
+    }
+    if (encoders_obj && !(encoders = parse_encoders(encoders_obj))) {
+        return -1;
+    }
+
+    // a single pass over strings, which may be an iterator
+    seq = PySequence_Fast(strings_obj, "a sequence of str is required");
+    if (!seq) {
+        return -1;
+    }
+    if ((encoders & ~PHONETIC_NFKD_ENCODERS) && !text_list_init(&strs, seq)) {
+        Py_DECREF(seq);
+        return -1;
+    }
+    if ((encoders & PHONETIC_NFKD_ENCODERS) && !nfkd_list_init(&nfkd, PyState_FindModule(&moduledef), seq)) {
+        text_list_free(&strs);
+        Py_DECREF(seq);
+        return -1;
+    }
+
+    // the lists can only disagree if another thread resized strings
+    count = PySequence_Fast_GET_SIZE(seq);
+    if (encoders & ~PHONETIC_NFKD_ENCODERS) {
+        count = MIN(count, strs.count);
+    }
+    if (encoders & PHONETIC_NFKD_ENCODERS) {
+        count = MIN(count, nfkd.count);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = phonetic_index_create(&index, encoders, nfkd.bytes, strs.strs, strs.lens,
+                                   count, threads);
+    Py_END_ALLOW_THREADS
+    nfkd_list_free(&nfkd);
+    text_list_free(&strs);
+    Py_DECREF(seq);
+
+    if (status == 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (status == -1) {
+        PyErr_SetString(PyExc_ValueError, "too many strings for a PhoneticIndex");
+        return -1;
+    }
+
+    // a concurrent __init__ may have got there first, only one is kept
+    Py_BEGIN_CRITICAL_SECTION(self);
+    raced = self->index != NULL;
+    if (!raced) {
+        self->encoders = encoders;
+        self->index = index;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (raced) {
+        phonetic_index_free(index);
+        PyErr_SetString(PyExc_RuntimeError, "PhoneticIndex is already initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static void PhoneticIndex_dealloc(PhoneticIndexObject *self)
+{
+    phonetic_index_free(self->index);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* PhoneticIndex_candidates(PhoneticIndexObject *self, PyObject *args)
+{
+    PyObject *query;
+    PyObject *mod = PyState_FindModule(&moduledef);
+    PyObject *ret;
+    struct text str;
+    struct nfkd normalized;
+    uint32_t *results;
+    long found;
+
+    if (!PyArg_ParseTuple(args, "O", &query)) {
+        return NULL;
+    }
+
+    if (!self->index) {
+        PyErr_SetString(PyExc_TypeError, "PhoneticIndex is not initialized");
+        return NULL;
+    }
+    if (!text_converter(query, &str)) {
+        return NULL;
+    }
+    normalized.bytes = NULL;
+    normalized.normalized = NULL;
+    if ((self->encoders & PHONETIC_NFKD_ENCODERS) && !nfkd_init(&normalized, mod, str_of(query))) {
+        text_release(&str);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    found = phonetic_index_candidates(self->index, normalized.bytes, str.str, str.len, &results);
+    Py_END_ALLOW_THREADS
+    nfkd_release(&normalized);
+    text_release(&str);
+
+    if (found == -1) {
+        return PyErr_NoMemory();
+    }
+    ret = new_array(mod, "I", results, found * sizeof(uint32_t));
+    free(results);
+    return ret;
+}
+
+static PyObject* PhoneticIndex_sizeof(PhoneticIndexObject *self, PyObject *unused)
+{
+    size_t size = Py_TYPE(self)->tp_basicsize;
+
+    if (self->index) {
+        size += phonetic_index_size(self->index);
+    }
+    return PyLong_FromSize_t(size);
+}
+
+static Py_ssize_t PhoneticIndex_length(PhoneticIndexObject *self)
+{
+    return self->index ? (Py_ssize_t)phonetic_index_count(self->index) : 0;
+}
+
+static PyObject* PhoneticIndex_get_keys(PhoneticIndexObject *self, void *closure)
+{
+    return PyLong_FromSize_t(self->index ? phonetic_index_keys(self->index) : 0);
+}
+
+static PyObject* PhoneticIndex_get_encoders(PhoneticIndexObject *self, void *closure)
+{
+    PyObject *names;
+    PyObject *name;
+    Py_ssize_t n = 0;
+    int e;
+
+    for (e = 0; e < PHONETIC_ENCODERS; e++) {
+        n += (self->encoders >> e) & 1;
+    }
+    names = PyTuple_New(n);
+    if (!names) {
+        return NULL;
+    }
+    for (n = 0, e = 0; e < PHONETIC_ENCODERS; e++) {
+        if (!(self->encoders & (1u << e))) {
+            continue;
+        }
+        name = PyUnicode_FromString(phonetic_encoder_names[e]);
+        if (!name) {
+            Py_DECREF(names);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(names, n++, name);
+    }
+    return names;
+}
+
+static PyMethodDef PhoneticIndex_methods[] = {
+    {"candidates", (PyCFunction)PhoneticIndex_candidates, METH_VARARGS,
+     "candidates(query)\n\n"
+     "The indices of every string that shares a code with query under any of\n"
+     "the index's encoders, in order, as an array('I')."},
+    {"__sizeof__", (PyCFunction)PhoneticIndex_sizeof, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PyGetSetDef PhoneticIndex_getset[] = {
+    {"keys", (getter)PhoneticIndex_get_keys, NULL, "The number of distinct codes.", NULL},
+    {"encoders", (getter)PhoneticIndex_get_encoders, NULL, "The names of the encoders.", NULL},
+    {NULL}
+};
+
+static PySequenceMethods PhoneticIndex_as_sequence = {
+    .sq_length = (lenfunc)PhoneticIndex_length,
+};
+
+static PyTypeObject PhoneticIndex_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "jellyfish.cjellyfish.PhoneticIndex",
+    .tp_basicsize = sizeof(PhoneticIndexObject),
+    .tp_dealloc = (destructor)PhoneticIndex_dealloc,
+    .tp_as_sequence = &PhoneticIndex_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "PhoneticIndex(strings, encoders='soundex', threads=1)\n\n"
+              "A blocking index from the phonetic codes of strings to the indices\n"
+              "of the strings that have them.  encoders names one or more of\n"
+              "'soundex', 'metaphone', 'nysiis' and 'match_rating_codex'.  The\n"
+              "strings are encoded on up to threads threads, 0 meaning one per CPU.",
+    .tp_methods = PhoneticIndex_methods,
+    .tp_getset = PhoneticIndex_getset,
+    .tp_init = (initproc)PhoneticIndex_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static PyObject* jellyfish_weighted_levenshtein_distance(PyObject *self, PyObject *args, PyObject *kw)
+{
+    struct text s1, s2;
+    double result;
+    PyObject *weights;
+    PyObject *delete_weights_dict = NULL;
+    PyObject *substitute_weights_dict = NULL;
+    struct weight_table *table;
+    struct weight_table *compiled = NULL;
+    PyObject *max_cost_obj = Py_None;
+    double max_cost;
+    static char *keywords[] = {"s1", "s2", "insert_weights", "delete_weights", "substitute_weights", "max_cost", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O&O|O!O!$O", keywords, text_converter, &s1, text_converter, &s2, &weights, &PyDict_Type, &delete_weights_dict, &PyDict_Type, &substitute_weights_dict, &max_cost_obj)) {
+        // TODO : Implement more generic error handling
+        // PyErr_SetFromErrno(PyExc_TypeError);
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    if (!parse_max_cost(max_cost_obj, &max_cost)) {
+        table = NULL;
+    } else if (PyObject_TypeCheck(weights, &WeightTable_Type) && !delete_weights_dict) {
+        table = ((WeightTableObject*)weights)->table;
+        if (!table) {
+            PyErr_SetString(PyExc_ValueError, "WeightTable is not initialized");
+        }
+    } else if (PyDict_Check(weights) && delete_weights_dict && substitute_weights_dict) {
+        // the dicts are converted with the GIL held, the distance runs without
+        table = compiled = weight_table_from_dicts(weights, delete_weights_dict, substitute_weights_dict);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "expected a WeightTable or insert, delete and substitute weight dicts");
+        table = NULL;
+    }
+
+    if (!table) {
+        text_release(&s1);
+        text_release(&s2);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    result = weighted_levenshtein_distance_table_max(s1.str, s1.len, s2.str, s2.len, table, max_cost);
+    Py_END_ALLOW_THREADS
+    weight_table_free(compiled);
+    text_release(&s1);
+    text_release(&s2);
+
+    if (result == -1) {
+        // weighted_levenshtein_distance only returns failure code (-1) on
+        // failed malloc
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return Py_BuildValue("d", result);
+}
+
+typedef struct {
+    PyObject_HEAD
+    struct cost_model *model;
+} CostModelObject;
+
+/* Reads a sequence of exactly n numbers into costs.  Returns 0 with an
+ * exception set on bad input.
+ */
+static int parse_costs(PyObject *obj, Py_ssize_t n, double *costs, const char *name) {
+    PyObject *seq;
+    Py_ssize_t i;
+    int ok = 1;
+
+    seq = PySequence_Fast(obj, name);
+    if (!seq) {
+        return 0;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(seq);
+    if (PySequence_Fast_GET_SIZE(seq) != n) {
+        PyErr_Format(PyExc_ValueError, "%s must have one entry per class", name);
+        ok = 0;
+    }
+    for (i = 0; ok && i < n; i++) {
+        costs[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+        if (costs[i] == -1.0 && PyErr_Occurred()) {
+            ok = 0;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    Py_DECREF(seq);
+    return ok;
+}
+
+/* Converts an optional class index, None meaning fallback. */
+static int parse_class(PyObject *obj, int classes, int fallback, int *cls) {
+    long index;
+
+    *cls = fallback;
+    if (obj == Py_None) {
+        return 1;
+    }
+
+    index = PyLong_AsLong(obj);
+    if (index == -1 && PyErr_Occurred()) {
+        return 0;
+    }
+    if (index < 0 || index >= classes) {
+        PyErr_SetString(PyExc_ValueError, "class index out of range");
+        return 0;
+    }
+    *cls = (int)index;
+    return 1;
+}
+
+static int set_classes(struct cost_model *model, PyObject *seq) {
+    PyObject *item;
+    Py_ssize_t i, k;
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyUnicode_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, "classes must be a sequence of str");
+            return 0;
+        }
+        for (k = 0; k < PyUnicode_GET_LENGTH(item); k++) {
+            if (!cost_model_set_class(model, (Py_UNICODE)PyUnicode_READ_CHAR(item, k), (int)i)) {
+                PyErr_NoMemory();
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int CostModel_init(CostModelObject *self, PyObject *args, PyObject *kw)
+{
+    PyObject *classes_obj, *insert_obj, *delete_obj, *substitute_obj;
+    PyObject *categories[COST_MODEL_CATEGORIES] = {Py_None, Py_None, Py_None, Py_None};
+    PyObject *classes = NULL;
+    PyObject *rows = NULL;
+    struct cost_model *model = NULL;
+    double costs[COST_MODEL_MAX_CLASSES];
+    double *substitute_costs = NULL;
+    int category_class[COST_MODEL_CATEGORIES];
+    Py_ssize_t n, i, j;
+    int ok;
+    int raced;
+    static char *keywords[] = {"classes", "insert_costs", "delete_costs", "substitute_costs", "digit", "alpha", "space", "other", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OOOO|OOOO", keywords, &classes_obj, &insert_obj, &delete_obj, &substitute_obj, &categories[COST_MODEL_DIGIT], &categories[COST_MODEL_ALPHA], &categories[COST_MODEL_SPACE], &categories[COST_MODEL_OTHER])) {
+        return -1;
+    }
+
+    // models are read without the GIL, so swapping one out from under a
+    // running distance is not allowed
+    if (self->model) {
+        PyErr_SetString(PyExc_RuntimeError, "CostModel is already initialized");
+        return -1;
+    }
+
+    classes = PySequence_Fast(classes_obj, "classes must be a sequence of str");
+    if (!classes) {
+        return -1;
+    }
+    n = PySequence_Fast_GET_SIZE(classes);
+    if (n < 1 || n > COST_MODEL_MAX_CLASSES) {
+        PyErr_Format(PyExc_ValueError, "between 1 and %d classes are supported", COST_MODEL_MAX_CLASSES);
+        goto fail;
+    }
+
+    model = cost_model_create((int)n);
+    substitute_costs = PyMem_Malloc(n * n * sizeof(double));
+    if (!model || !substitute_costs) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    // unlisted characters of a category without a class of its own go to
+    // the class given for other, which defaults to 0
+    if (!parse_class(categories[COST_MODEL_OTHER], (int)n, 0, &category_class[COST_MODEL_OTHER])) {
+        goto fail;
+    }
+    for (i = 0; i < COST_MODEL_OTHER; i++) {
+        if (!parse_class(categories[i], (int)n, category_class[COST_MODEL_OTHER], &category_class[i])) {
+            goto fail;
+        }
+    }
+    for (i = 0; i < COST_MODEL_CATEGORIES; i++) {
+        cost_model_set_category(model, (enum cost_model_category)i, category_class[i]);
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(classes);
+    ok = set_classes(model, classes);
+    Py_END_CRITICAL_SECTION();
+    if (!ok) {
+        goto fail;
+    }
+
+    if (!parse_costs(insert_obj, n, costs, "insert_costs")) {
+        goto fail;
+    }
+    for (i = 0; i < n; i++) {
+        cost_model_set_insert(model, (int)i, costs[i]);
+    }
+
+    if (!parse_costs(delete_obj, n, costs, "delete_costs")) {
+        goto fail;
+    }
+    for (i = 0; i < n; i++) {
+        cost_model_set_delete(model, (int)i, costs[i]);
+    }
+
+    rows = PySequence_Fast(substitute_obj, "substitute_costs must be a sequence of sequences");
+    if (!rows) {
+        goto fail;
+    }
+    Py_BEGIN_CRITICAL_SECTION(rows);
+    ok = PySequence_Fast_GET_SIZE(rows) == n;
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "substitute_costs must have one row per class");
+    }
+    for (i = 0; ok && i < n; i++) {
+        ok = parse_costs(PySequence_Fast_GET_ITEM(rows, i), n, substitute_costs + i * n, "substitute_costs rows");
+    }
+    Py_END_CRITICAL_SECTION();
+    if (!ok) {
+        goto fail;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            cost_model_set_substitute(model, (int)i, (int)j, substitute_costs[i * n + j]);
+        }
+    }
+
+    Py_DECREF(rows);
+    Py_DECREF(classes);
+    PyMem_Free(substitute_costs);
+
+    // a concurrent __init__ may have got there first, only one is kept
+    Py_BEGIN_CRITICAL_SECTION(self);
+    raced = self->model != NULL;
+    if (!raced) {
+        self->model = model;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (raced) {
+        cost_model_free(model);
+        PyErr_SetString(PyExc_RuntimeError, "CostModel is already initialized");
+        return -1;
+    }
+    return 0;
+
+ fail:
+    Py_XDECREF(rows);
+    Py_DECREF(classes);
+    PyMem_Free(substitute_costs);
+    cost_model_free(model);
+    return -1;
+}
+
+static void CostModel_dealloc(CostModelObject *self)
+{
+    cost_model_free(self->model);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyTypeObject CostModel_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "jellyfish.cjellyfish.CostModel",
+    .tp_basicsize = sizeof(CostModelObject),
+    .tp_dealloc = (destructor)CostModel_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "CostModel(classes, insert_costs, delete_costs, substitute_costs, digit=None, alpha=None, space=None, other=0)\n\n"
+              "Character class costs for custom_weighted_levenshtein_distance.  classes\n"
+              "is a sequence of str, class i holding the characters of classes[i].\n"
+              "insert_costs and delete_costs hold one cost per class, substitute_costs\n"
+              "one row of costs per class.  Characters in no class are classified by\n"
+              "category (digit, other alphanumeric, space or other), a category\n"
+              "without a class of its own falling back to the class given for other.",
+    .tp_init = (initproc)CostModel_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static PyObject* jellyfish_custom_weighted_levenshtein_distance(PyObject *self, PyObject *args, PyObject *kw)
+{
+    struct text s1, s2;
+    double result;
+    double insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight;
+    CostModelObject *model_obj = NULL;
+    PyObject *max_cost_obj = Py_None;
+    PyObject *cost_model_kw = NULL;
+    double max_cost;
+    static char *model_keywords[] = {"s1", "s2", "cost_model", "max_cost", NULL};
+    static char *weight_keywords[] = {"s1", "s2", "insert_numeric_weight", "insert_alpha_weight", "delete_numeric_weight", "delete_alpha_weight", "substitute_numeric_weight", "substitute_alpha_weight", "max_cost", NULL};
+
+    // a third argument that is a CostModel, or one passed as cost_model,
+    // picks the model form, three positional arguments can only be it
+    if (kw) {
+        cost_model_kw = PyDict_GetItemString(kw, "cost_model");
+    }
+    if (cost_model_kw || PyTuple_GET_SIZE(args) == 3 ||
+        (PyTuple_GET_SIZE(args) > 3 && PyObject_TypeCheck(PyTuple_GET_ITEM(args, 2), &CostModel_Type))) {
+        if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O&O!|$O", model_keywords, text_converter, &s1, text_converter, &s2, &CostModel_Type, &model_obj, &max_cost_obj)) {
+            return NULL;
+        }
+        if (!model_obj->model) {
+            PyErr_SetString(PyExc_ValueError, "CostModel is not initialized");
+            text_release(&s1);
+            text_release(&s2);
+            return NULL;
+        }
+    } else if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O&dddddd|$O", weight_keywords, text_converter, &s1, text_converter, &s2, &insert_numeric_weight, &insert_alpha_weight, &delete_numeric_weight, &delete_alpha_weight, &substitute_numeric_weight, &substitute_alpha_weight, &max_cost_obj)) {
+        return NULL;
+    }
+
+    if (!parse_max_cost(max_cost_obj, &max_cost)) {
+        text_release(&s1);
+        text_release(&s2);
+        return NULL;
+    }
+
+    // the weights are priced by a model on the stack, nothing is built
+    Py_BEGIN_ALLOW_THREADS
+    if (model_obj) {
+        result = custom_weighted_levenshtein_distance_model_max(s1.str, s1.len, s2.str, s2.len, model_obj->model, max_cost);
+    } else {
+        result = custom_weighted_levenshtein_distance_max(s1.str, s1.len, s2.str, s2.len, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight, max_cost);
+    }
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    if (result == -1) {
+        // weighted_levenshtein_distance only returns failure code (-1) on
+        // failed malloc
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return Py_BuildValue("d", result);
+}
+
+static PyObject* jellyfish_damerau_levenshtein_distance(PyObject *self,
+                                                        PyObject *args,
+                                                        PyObject *kw)
+{
+    struct text s1, s2;
+    int result;
+    int max_distance;
+    PyObject *max_distance_obj = Py_None;
+    static char *keywords[] = {"s1", "s2", "max_distance", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O&O&|O", keywords, text_converter, &s1, text_converter, &s2, &max_distance_obj)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    if (!parse_max_distance(max_distance_obj, &max_distance)) {
+        text_release(&s1);
+        text_release(&s2);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    result = damerau_levenshtein_distance_max(s1.str, s2.str, s1.len, s2.len, max_distance);
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    if (result == -1) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return Py_BuildValue("i", result);
+}
+
+static PyObject* jellyfish_optimal_string_alignment_distance(PyObject *self,
+                                                             PyObject *args)
+{
+    struct text s1, s2;
+    int result;
+
+    if (!PyArg_ParseTuple(args, "O&O&", text_converter, &s1, text_converter, &s2)) {
+        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (TEXT_PM(s1)) {
+        result = optimal_string_alignment_distance_pattern(TEXT_PM(s1), s2.str, s2.len);
+    } else if (TEXT_PM(s2)) {
+        result = optimal_string_alignment_distance_pattern(TEXT_PM(s2), s1.str, s1.len);
+    } else {
+        result = optimal_string_alignment_distance(s1.str, s1.len, s2.str, s2.len);
+    }
+    Py_END_ALLOW_THREADS
+    text_release(&s1);
+    text_release(&s2);
+
+    if (result == -1) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return Py_BuildValue("i", result);
+}
+
+/* The unary functions the result cache sits in front of, the phonetic
+ * codes numbered as on a Prepared.
+ */
+enum {
+    CACHED_PORTER_STEM = PREPARED_CODES,
+    CACHED_FUNCTIONS
+};
+
+struct cache_entry {
+    // next in the same bucket
+    struct cache_entry *chain;
+    // neighbours in order of use
+    struct cache_entry *newer;
+    struct cache_entry *older;
+    PyObject *key;
+    PyObject *value;
+    Py_hash_t hash;
+    size_t size;
+    int function;
+};
+
+/* An opt-in LRU cache of the unary functions' results for exact strs, keyed
+ * on the function and the str, found by its hash and compared by identity
+ * before contents.  Each entry is charged roughly the memory it keeps
+ * alive, and the least recently used go once max_bytes is passed; a
+ * max_bytes of 0 turns the cache off.
+ *
+ * Everything is done under a critical section on the module.  The
+ * functions themselves run outside it, so threads missing on the same str
+ * at once all compute it and the first to store it wins.
+ */
+struct code_cache {
+    // recent.older is the most recently used entry, recent.newer the least
+    struct cache_entry recent;
+    struct cache_entry **buckets;
+    size_t mask;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+#define CACHE_MIN_BUCKETS 64
+
+static size_t str_size(PyObject *str)
+{
+    return (PyUnicode_IS_ASCII(str) ? sizeof(PyASCIIObject) : sizeof(PyCompactUnicodeObject)) +
+           (PyUnicode_GET_LENGTH(str) + 1) * PyUnicode_KIND(str);
+}
+
+static int same_str(PyObject *a, PyObject *b)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(a);
+
+    // equal strs always have the same kind
+    return a == b || (len == PyUnicode_GET_LENGTH(b) && PyUnicode_KIND(a) == PyUnicode_KIND(b) &&
+                      !memcmp(PyUnicode_DATA(a), PyUnicode_DATA(b), len * PyUnicode_KIND(a)));
+}
+
+static struct cache_entry** cache_bucket(struct code_cache *cache, int function, Py_hash_t hash)
+{
+    return &cache->buckets[((size_t)hash ^ (size_t)function) & cache->mask];
+}
+
+static struct cache_entry* cache_find(struct code_cache *cache, int function,
+                                      PyObject *key, Py_hash_t hash)
+{
+    struct cache_entry *entry = *cache_bucket(cache, function, hash);
+
+    for ( ; entry; entry = entry->chain) {
+        if (entry->hash == hash && entry->function == function && same_str(entry->key, key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cache_unlink(struct cache_entry *entry)
+{
+    entry->newer->older = entry->older;
+    entry->older->newer = entry->newer;
+}
+
+static void cache_use(struct code_cache *cache, struct cache_entry *entry)
+{
+    entry->newer = &cache->recent;
+    entry->older = cache->recent.older;
+    cache->recent.older->newer = entry;
+    cache->recent.older = entry;
+}
+
+/* Doubles the buckets once there are more entries than buckets.  Failing
+ * to only makes the chains longer.
+ */
+static void cache_grow(struct code_cache *cache)
+{
+    struct cache_entry **buckets;
+    struct cache_entry **bucket;
+    struct cache_entry *entry;
+    size_t size = 2 * (cache->mask + 1);
+
+    if (cache->entries <= cache->mask + 1) {
+        return;
+    }
+    buckets = calloc(size, sizeof(struct cache_entry*));
+    if (!buckets) {
+        return;
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->mask = size - 1;
+    for (entry = cache->recent.newer; entry != &cache->recent; entry = entry->newer) {
+        bucket = cache_bucket(cache, entry->function, entry->hash);
+        entry->chain = *bucket;
+        *bucket = entry;
+    }
+}
+
+/* Takes the least recently used entries out until the rest fit in
+ * max_bytes, returning them chained for cache_release.
+ */
+static struct cache_entry* cache_trim(struct code_cache *cache, size_t max_bytes)
+{
+    struct cache_entry *dropped = NULL;
+    struct cache_entry *entry;
+    struct cache_entry **link;
+
+    while (cache->bytes > max_bytes) {
+        entry = cache->recent.newer;
+        cache_unlink(entry);
+        for (link = cache_bucket(cache, entry->function, entry->hash); *link != entry;
+             link = &(*link)->chain);
+        *link = entry->chain;
+        cache->bytes -= entry->size;
+        cache->entries--;
+        entry->chain = dropped;
+        dropped = entry;
+    }
+    return dropped;
+}
+
+/* Frees entries taken out of the cache, outside its critical section. */
+static void cache_release(struct cache_entry *dropped)
+{
+    struct cache_entry *entry;
+
+    while (dropped) {
+        entry = dropped;
+        dropped = entry->chain;
+        Py_DECREF(entry->key);
+        Py_DECREF(entry->value);
+        free(entry);
+    }
+}
+
+/* A new reference to the cached result of function for key, or NULL
+ * without an error set.
+ */
+static PyObject* cache_get(PyObject *mod, int function, PyObject *key, Py_hash_t hash)
+{
+    struct code_cache *cache;
+    struct cache_entry *entry;
+    PyObject *value = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(mod);
+    cache = GETSTATE(mod)->cache;
+    if (cache && cache->max_bytes) {
+        entry = cache_find(cache, function, key, hash);
+        if (entry) {
+            cache->hits++;
+            cache_unlink(entry);
+            cache_use(cache, entry);
+            value = entry->value;
+            Py_INCREF(value);
+        } else {
+            cache->misses++;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    return value;
+}
+
+/* Stores value, a new reference, as the result of function for key, and
+ * returns a new reference to the stored result.  Only if the cache is full
+ * of entries used since, or off, is value not stored.
+ */
+static PyObject* cache_put(PyObject *mod, int function, PyObject *key, Py_hash_t hash,
+                           PyObject *value)
+{
+    struct code_cache *cache;
+    struct cache_entry *entry;
+    struct cache_entry *dropped = NULL;
+    struct cache_entry **bucket;
+    PyObject *ret = value;
+    size_t size = sizeof(struct cache_entry) + 2 * sizeof(struct cache_entry*) +
+                  str_size(key) + str_size(value);
+
+    Py_BEGIN_CRITICAL_SECTION(mod);
+    cache = GETSTATE(mod)->cache;
+    if (cache && size <= cache->max_bytes) {
+        entry = cache_find(cache, function, key, hash);
+        if (entry) {
+            // another thread stored it first
+            ret = entry->value;
+            Py_INCREF(ret);
+        } else if ((entry = malloc(sizeof(struct cache_entry)))) {
+            Py_INCREF(key);
+            Py_INCREF(value);
+            entry->key = key;
+            entry->value = value;
+            entry->hash = hash;
+            entry->size = size;
+            entry->function = function;
+            bucket = cache_bucket(cache, function, hash);
+            entry->chain = *bucket;
+            *bucket = entry;
+            cache_use(cache, entry);
+            cache->bytes += size;
+            cache->entries++;
+            cache_grow(cache);
+            dropped = cache_trim(cache, cache->max_bytes);
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (ret != value) {
+        Py_DECREF(value);
+    }
+    cache_release(dropped);
+    return ret;
+}
+
+/* Returns a new reference to function's result for a str, computed by
+ * compute or found in the result cache.
+ */
+static PyObject* cached_code(PyObject *mod, PyObject *str, int function,
+                             PyObject* (*compute)(PyObject*, PyObject*))
+{
+    PyObject *result;
+    Py_hash_t hash;
+
+    // a subclass could make hashing and comparing run Python code
+    if (!PyUnicode_CheckExact(str)) {
+        return compute(mod, str);
+    }
+    hash = PyObject_Hash(str);
+    if (hash == -1) {
+        return NULL;
+    }
+
+    result = cache_get(mod, function, str, hash);
+    if (result) {
+        return result;
+    }
+    result = compute(mod, str);
+    if (!result) {
+        return NULL;
+    }
+    return cache_put(mod, function, str, hash, result);
+}
+
+static PyObject* jellyfish_set_cache_size(PyObject *self, PyObject *args)
+{
+    struct jellyfish_state *state = GETSTATE(self);
+    struct code_cache *cache;
+    struct cache_entry *dropped = NULL;
+    struct cache_entry **buckets = NULL;
+    Py_ssize_t max_bytes;
+    int ok = 1;
+
+    if (!PyArg_ParseTuple(args, "n", &max_bytes)) {
+        return NULL;
+    }
+    if (max_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_bytes must not be negative");
+        return NULL;
+    }
+
+    if (max_bytes) {
+        buckets = calloc(CACHE_MIN_BUCKETS, sizeof(struct cache_entry*));
+        if (!buckets) {
+            return PyErr_NoMemory();
+        }
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    cache = state->cache;
+    if (!cache && max_bytes) {
+        cache = calloc(1, sizeof(struct code_cache));
+        if (cache) {
+            cache->recent.newer = cache->recent.older = &cache->recent;
+            cache->buckets = buckets;
+            cache->mask = CACHE_MIN_BUCKETS - 1;
+            buckets = NULL;
+            state->cache = cache;
+        } else {
+            ok = 0;
+        }
+    }
+    if (cache) {
+        cache->max_bytes = max_bytes;
+        dropped = cache_trim(cache, max_bytes);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    free(buckets);
+    cache_release(dropped);
+    if (!ok) {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* jellyfish_cache_info(PyObject *self, PyObject *unused)
+{
+    struct code_cache *cache;
+    unsigned long long hits = 0, misses = 0;
+    size_t entries = 0, bytes = 0, max_bytes = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    cache = GETSTATE(self)->cache;
+    if (cache) {
+        hits = cache->hits;
+        misses = cache->misses;
+        entries = cache->entries;
+        bytes = cache->bytes;
+        max_bytes = cache->max_bytes;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    return Py_BuildValue("{s:K,s:K,s:n,s:n,s:n}", "hits", hits, "misses", misses,
+                         "entries", (Py_ssize_t)entries, "bytes", (Py_ssize_t)bytes,
+                         "max_bytes", (Py_ssize_t)max_bytes);
+}
+
+static PyObject* jellyfish_cache_clear(PyObject *self, PyObject *unused)
+{
+    struct code_cache *cache;
+    struct cache_entry *dropped = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    cache = GETSTATE(self)->cache;
+    if (cache) {
+        dropped = cache_trim(cache, 0);
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    cache_release(dropped);
+    Py_RETURN_NONE;
+}
+
+/* Returns a new reference to the phonetic code of a str, computed by
+ * compute or found in the result cache, or to the one cached on a
+ * Prepared, computed on first use.
+ */
+static PyObject* phonetic_code(PyObject *mod, PyObject *obj, int code,
+                               PyObject* (*compute)(PyObject*, PyObject*))
+{
+    PreparedObject *prep = (PreparedObject*)obj;
+    PyObject *result;
+
+    if (!Prepared_Check(obj)) {
+        if (!PyUnicode_Check(obj)) {
+            PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+            return NULL;
+        }
+        return cached_code(mod, obj, code, compute);
+    }
+    if (!prep->string) {
+        PyErr_SetString(PyExc_TypeError, "Prepared is not initialized");
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(prep);
+    result = prep->codes[code];
+    Py_XINCREF(result);
+    Py_END_CRITICAL_SECTION();
+    if (result) {
+        return result;
+    }
+
+    result = compute(mod, prep->string);
+    if (!result) {
+        return NULL;
+    }
+
+    // another thread may have got there first, everyone gets the stored code
+    Py_BEGIN_CRITICAL_SECTION(prep);
+    if (prep->codes[code]) {
+        Py_DECREF(result);
+        result = prep->codes[code];
+        Py_INCREF(result);
+    } else {
+        Py_INCREF(result);
+        prep->codes[code] = result;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    return result;
+}
+
+static PyObject* soundex_of(PyObject *mod, PyObject *str)
+{
+    struct nfkd normalized;
+    char code[SOUNDEX_SIZE];
+
+    if (!nfkd_init(&normalized, mod, str)) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    soundex_into(normalized.bytes, code);
+    Py_END_ALLOW_THREADS
+    nfkd_release(&normalized);
+
+    return Py_BuildValue("s", code);
+}
+
+static PyObject* jellyfish_soundex(PyObject *self, PyObject *args)
+{
+    PyObject *str;
+
+    if (!PyArg_ParseTuple(args, "O", &str)) {
+        return NULL;
+    }
+
+    return phonetic_code(self, str, PREPARED_SOUNDEX, soundex_of);
+}
+
+static int soundex_many_fill(PyObject *mod, PyObject *seq, uint16_t *codes)
+{
+    PyObject *item;
+    struct nfkd normalized;
+    char code[SOUNDEX_SIZE];
+    Py_ssize_t i;
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        item = str_of(PySequence_Fast_GET_ITEM(seq, i));
+        if (!item || !nfkd_init(&normalized, mod, item)) {
+            return 0;
+        }
+        soundex_into(normalized.bytes, code);
+        nfkd_release(&normalized);
+        codes[i] = soundex_pack(code);
+    }
+    return 1;
+}
+
+static PyObject* jellyfish_soundex_many(PyObject *self, PyObject *args)
+{
+    PyObject *strings;
+    PyObject *seq;
+    PyObject *ret = NULL;
+    uint16_t *codes;
+    Py_ssize_t count;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "O", &strings)) {
+        return NULL;
+    }
+
+    seq = PySequence_Fast(strings, "a sequence of str is required");
+    if (!seq) {
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(seq);
+    count = PySequence_Fast_GET_SIZE(seq);
+    codes = malloc((count ? count : 1) * sizeof(uint16_t));
+    if (!codes) {
+        PyErr_NoMemory();
+        ok = 0;
+    } else {
+        ok = soundex_many_fill(self, seq, codes);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (ok) {
+        ret = new_array(self, "H", codes, count * sizeof(uint16_t));
+    }
+    free(codes);
+    Py_DECREF(seq);
+    return ret;
+}
+
+static PyObject* jellyfish_soundex_unpack(PyObject *self, PyObject *args)
+{
+    unsigned long packed;
+    char code[SOUNDEX_SIZE];
+
+    if (!PyArg_ParseTuple(args, "k", &packed)) {
+        return NULL;
+    }
+
+    if (packed > 0xFFFF || !soundex_unpack((uint16_t)packed, code)) {
+        PyErr_Format(PyExc_ValueError, "%lu is not a packed soundex code", packed);
+        return NULL;
+    }
+    return Py_BuildValue("s", code);
+}
+
+static PyObject* metaphone_of(PyObject *mod, PyObject *str)
+{
+    struct nfkd normalized;
+    PyObject *ret;
+    char *result;
+
+    if (!nfkd_init(&normalized, mod, str)) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    result = metaphone(normalized.bytes);
+    Py_END_ALLOW_THREADS
+    nfkd_release(&normalized);
+
+    if (!result) {
+        // metaphone only fails on bad malloc
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    ret = Py_BuildValue("s", result);
+    free(result);
+
+    return ret;
+}
+
+static PyObject* jellyfish_metaphone(PyObject *self, PyObject *args)
+{
+    PyObject *str;
+
+    if (!PyArg_ParseTuple(args, "O", &str)) {
         return NULL;
     }
 
-    return Py_BuildValue("d", result);
+    return phonetic_code(self, str, PREPARED_METAPHONE, metaphone_of);
 }
 
-static PyObject * jellyfish_jaro_distance(PyObject *self, PyObject *args)
+static PyObject* match_rating_codex_of(PyObject *mod, PyObject *obj)
 {
-    const Py_UNICODE *s1, *s2;
-    int len1, len2;
-    double result;
+    struct text str;
+    Py_UNICODE *result;
+    PyObject *ret;
 
-    if (!PyArg_ParseTuple(args, "u#u#", &s1, &len1, &s2, &len2)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!text_converter(obj, &str)) {
         return NULL;
     }
 
-    result = jaro_distance(s1, len1, s2, len2);
-    // see earlier note about jaro_distance return value
-    if (result < -1) {
+    Py_BEGIN_ALLOW_THREADS
+    result = match_rating_codex(str.str, str.len);
+    Py_END_ALLOW_THREADS
+    text_release(&str);
+
+    if (!result) {
         PyErr_NoMemory();
         return NULL;
     }
 
-    return Py_BuildValue("d", result);
+    ret = PyUnicode_FromWideChar(result, -1);
+    free(result);
+
+    return ret;
 }
 
-static PyObject * jellyfish_hamming_distance(PyObject *self, PyObject *args)
+static PyObject* jellyfish_match_rating_codex(PyObject *self, PyObject *args)
 {
-    const Py_UNICODE *s1, *s2;
-    int len1, len2;
-    unsigned result;
+    PyObject *str;
 
-    if (!PyArg_ParseTuple(args, "u#u#", &s1, &len1, &s2, &len2)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!PyArg_ParseTuple(args, "O", &str)) {
         return NULL;
     }
 
-    result = hamming_distance(s1, len1, s2, len2);
+    return phonetic_code(self, str, PREPARED_MATCH_RATING_CODEX, match_rating_codex_of);
+}
 
-    return Py_BuildValue("I", result);
+/* Copies a codex str into buf, which has room for 7 code units. */
+static int codex_units(PyObject *codex, Py_UNICODE *buf, size_t *len)
+{
+    Py_ssize_t n = PyUnicode_AsWideChar(codex, buf, 7);
+
+    if (n == -1) {
+        return 0;
+    }
+    *len = n < 7 ? n : 6;
+    return 1;
 }
 
-static PyObject* jellyfish_levenshtein_distance(PyObject *self, PyObject *args)
+static PyObject* jellyfish_match_rating_comparison(PyObject *self,
+                                                   PyObject *args)
 {
-    const Py_UNICODE *s1, *s2;
-    int len1, len2;
+    PyObject *obj1, *obj2;
+    PyObject *codex1, *codex2 = NULL;
+    Py_UNICODE buf1[7], buf2[7];
+    size_t len1, len2;
+    struct text str1, str2;
     int result;
 
-    if (!PyArg_ParseTuple(args, "u#u#", &s1, &len1, &s2, &len2)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!PyArg_ParseTuple(args, "OO", &obj1, &obj2)) {
         return NULL;
     }
 
-    result = levenshtein_distance(s1, len1, s2, len2);
-    if (result == -1) {
-        // levenshtein_distance only returns failure code (-1) on
-        // failed malloc
-        PyErr_NoMemory();
-        return NULL;
+    if (Prepared_Check(obj1) || Prepared_Check(obj2)) {
+        // compare the codexes, cached on the Prepared side
+        codex1 = phonetic_code(self, obj1, PREPARED_MATCH_RATING_CODEX, match_rating_codex_of);
+        if (codex1) {
+            codex2 = phonetic_code(self, obj2, PREPARED_MATCH_RATING_CODEX, match_rating_codex_of);
+        }
+        if (!codex2 || !codex_units(codex1, buf1, &len1) || !codex_units(codex2, buf2, &len2)) {
+            Py_XDECREF(codex1);
+            Py_XDECREF(codex2);
+            return NULL;
+        }
+        Py_DECREF(codex1);
+        Py_DECREF(codex2);
+
+        result = match_rating_comparison_codex(buf1, len1, buf2, len2);
+    } else {
+        if (!text_converter(obj1, &str1)) {
+            return NULL;
+        }
+        if (!text_converter(obj2, &str2)) {
+            text_release(&str1);
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        result = match_rating_comparison(str1.str, str1.len, str2.str, str2.len);
+        Py_END_ALLOW_THREADS
+        text_release(&str1);
+        text_release(&str2);
     }
 
-    return Py_BuildValue("i", result);
+    if (result == -1) {
+        Py_RETURN_NONE;
+    } else if (result) {
+        Py_RETURN_TRUE;
+    } else {
+        Py_RETURN_FALSE;
+    }
 }
 
-static PyObject* jellyfish_weighted_levenshtein_distance(PyObject *self, PyObject *args)
+static PyObject* jellyfish_match_rating_codex_many(PyObject *self, PyObject *args)
 {
-    const Py_UNICODE *s1, *s2;
-    int len1, len2;
-    double result;
-    PyObject *insert_weights_dict;
-    PyObject *delete_weights_dict;
-    PyObject *substitute_weights_dict;
+    struct text_list strings;
+    PyObject *strings_obj;
+    PyObject *ret = NULL;
+    uint64_t *codexes;
 
-    if (!PyArg_ParseTuple(args, "u#u#O!O!O!", &s1, &len1, &s2, &len2, &PyDict_Type, &insert_weights_dict, &PyDict_Type, &delete_weights_dict, &PyDict_Type, &substitute_weights_dict)) {
-        // TODO : Implement more generic error handling
-        // PyErr_SetFromErrno(PyExc_TypeError);
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!PyArg_ParseTuple(args, "O", &strings_obj)) {
         return NULL;
     }
 
-    result = weighted_levenshtein_distance(s1, len1, s2, len2, insert_weights_dict, delete_weights_dict, substitute_weights_dict);
-    if (result == -1) {
-        // weighted_levenshtein_distance only returns failure code (-1) on
-        // failed malloc
-        PyErr_NoMemory();
+    if (!text_list_init(&strings, strings_obj)) {
         return NULL;
     }
 
-    return Py_BuildValue("d", result);
+    codexes = malloc((strings.count ? strings.count : 1) * sizeof(uint64_t));
+    if (!codexes) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    match_rating_codex_many(strings.strs, strings.lens, strings.count, codexes);
+    Py_END_ALLOW_THREADS
+
+    ret = new_array(self, "Q", codexes, strings.count * sizeof(uint64_t));
+
+ done:
+    free(codexes);
+    text_list_free(&strings);
+    return ret;
 }
 
-static PyObject* jellyfish_custom_weighted_levenshtein_distance(PyObject *self, PyObject *args)
+static PyObject* jellyfish_match_rating_comparison_many(PyObject *self, PyObject *args)
 {
-    const Py_UNICODE *s1, *s2;
-    int len1, len2;
-    double result;
-    double insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight;
-
-    if (!PyArg_ParseTuple(args, "u#u#dddddd", &s1, &len1, &s2, &len2, &insert_numeric_weight, &insert_alpha_weight, &delete_numeric_weight, &delete_alpha_weight, &substitute_numeric_weight, &substitute_alpha_weight)) {
-        // TODO : Implement more generic error handling
-        //PyErr_SetFromErrno(PyExc_TypeError);
-        PyErr_SetString(PyExc_TypeError, "Grrr...Arg");
+    PyObject *query_obj, *codexes_obj;
+    PyObject *ret = NULL;
+    struct text query;
+    Py_buffer view;
+    signed char *results;
+    uint64_t codex;
+    size_t count;
+
+    if (!PyArg_ParseTuple(args, "OO", &query_obj, &codexes_obj)) {
         return NULL;
     }
 
-    result = custom_weighted_levenshtein_distance(s1, len1, s2, len2, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight);
-    if (result == -1) {
-        // weighted_levenshtein_distance only returns failure code (-1) on
-        // failed malloc
-        PyErr_NoMemory();
-        return NULL;
+    if (PyLong_Check(query_obj)) {
+        codex = PyLong_AsUnsignedLongLong(query_obj);
+        if (codex == (uint64_t)-1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    } else {
+        if (!text_converter(query_obj, &query)) {
+            return NULL;
+        }
+        codex = match_rating_codex_packed(query.str, query.len);
+        text_release(&query);
     }
 
-    return Py_BuildValue("d", result);
-}
-
-static PyObject* jellyfish_damerau_levenshtein_distance(PyObject *self,
-                                                        PyObject *args)
-{
-    Py_UNICODE *s1, *s2;
-    int len1, len2;
-    int result;
-
-    if (!PyArg_ParseTuple(args, "u#u#", &s1, &len1, &s2, &len2)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (PyObject_GetBuffer(codexes_obj, &view, PyBUF_SIMPLE) < 0) {
         return NULL;
     }
+    if (view.len % sizeof(uint64_t)) {
+        PyErr_SetString(PyExc_ValueError, "codexes must hold 64-bit packed codexes");
+        goto done;
+    }
+    count = view.len / sizeof(uint64_t);
 
-    result = damerau_levenshtein_distance(s1, s2, len1, len2);
-    if (result == -1) {
+    results = malloc(count ? count : 1);
+    if (!results) {
         PyErr_NoMemory();
-        return NULL;
+        goto done;
     }
-    return Py_BuildValue("i", result);
+
+    Py_BEGIN_ALLOW_THREADS
+    match_rating_comparison_packed_many(codex, (const uint64_t*)view.buf, count, results);
+    Py_END_ALLOW_THREADS
+
+    ret = new_array(self, "b", results, count);
+    free(results);
+
+ done:
+    PyBuffer_Release(&view);
+    return ret;
 }
 
-static PyObject* jellyfish_soundex(PyObject *self, PyObject *args)
+static PyObject* nysiis_of(PyObject *mod, PyObject *obj)
 {
-    const Py_UNICODE *str;
+    struct text str;
+    Py_UNICODE inline_code[TEXT_INLINE];
+    Py_UNICODE *code = inline_code;
+    PyObject *ret;
     int len;
-    PyObject *normalized;
-    PyObject* ret;
-    char *result;
 
-    if (!PyArg_ParseTuple(args, "u#", &str, &len)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!text_converter(obj, &str)) {
         return NULL;
     }
 
-    normalized = normalize(self, str);
-    if (!normalized) {
-        return NULL;
+    if (NYSIIS_SIZE(str.len, -1) > TEXT_INLINE) {
+        code = PyMem_Malloc(NYSIIS_SIZE(str.len, -1) * sizeof(Py_UNICODE));
+        if (!code) {
+            text_release(&str);
+            return PyErr_NoMemory();
+        }
     }
 
-    result = soundex(UTF8_BYTES(normalized));
-    Py_DECREF(normalized);
+    Py_BEGIN_ALLOW_THREADS
+    len = nysiis_into(str.str, str.len, -1, code);
+    Py_END_ALLOW_THREADS
+    text_release(&str);
 
-    if (!result) {
-        // soundex only fails on bad malloc
-        PyErr_NoMemory();
-        return NULL;
+    ret = PyUnicode_FromWideChar(code, len);
+    if (code != inline_code) {
+        PyMem_Free(code);
     }
 
-    ret = Py_BuildValue("s", result);
-    free(result);
-
     return ret;
 }
 
-static PyObject* jellyfish_metaphone(PyObject *self, PyObject *args)
+static PyObject* jellyfish_nysiis(PyObject *self, PyObject *args)
 {
-    const Py_UNICODE *str;
-    int len;
-    PyObject *normalized;
-    PyObject *ret;
-    char *result;
+    PyObject *str;
 
-    if (!PyArg_ParseTuple(args, "u#", &str, &len)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!PyArg_ParseTuple(args, "O", &str)) {
         return NULL;
     }
 
-    normalized = normalize(self, str);
-    if (!normalized) {
+    return phonetic_code(self, str, PREPARED_NYSIIS, nysiis_of);
+}
+
+/* Where Py_UNICODE is 16 bits, turns offsets into a buffer of code units
+ * into offsets into the str made from it, in which surrogate pairs are
+ * single characters.
+ */
+static void code_point_offsets(const Py_UNICODE *buf, size_t *offsets, size_t count) {
+    size_t i, unit = 0, pairs = 0;
+
+    if (sizeof(Py_UNICODE) != 2) {
+        return;
+    }
+    for (i = 0; i <= count; i++) {
+        for ( ; unit < offsets[i]; unit++) {
+            if (buf[unit] >= 0xD800 && buf[unit] < 0xDC00 && unit + 1 < offsets[i] &&
+                buf[unit + 1] >= 0xDC00 && buf[unit + 1] < 0xE000) {
+                unit++;
+                pairs++;
+            }
+        }
+        offsets[i] -= pairs;
+    }
+}
+
+static PyObject* jellyfish_nysiis_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+    struct text_list strings;
+    PyObject *strings_obj;
+    PyObject *max_length_obj = Py_None;
+    PyObject *codes_str = NULL;
+    PyObject *offsets_array = NULL;
+    PyObject *ret = NULL;
+    Py_UNICODE *codes = NULL;
+    size_t *offsets = NULL;
+    size_t size = 1, total;
+    Py_ssize_t i;
+    int max_length;
+    static char *keywords[] = {"strings", "max_length", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", keywords, &strings_obj, &max_length_obj)) {
         return NULL;
     }
 
-    result = metaphone((const char*)UTF8_BYTES(normalized));
-    Py_DECREF(normalized);
+    if (!parse_bound(max_length_obj, "max_length", &max_length) ||
+        !text_list_init(&strings, strings_obj)) {
+        return NULL;
+    }
 
-    if (!result) {
-        // metaphone only fails on bad malloc
+    for (i = 0; i < strings.count; i++) {
+        size += NYSIIS_SIZE(strings.lens[i], max_length);
+    }
+    codes = PyMem_Malloc(size * sizeof(Py_UNICODE));
+    offsets = malloc((strings.count + 1) * sizeof(size_t));
+    if (!codes || !offsets) {
         PyErr_NoMemory();
-        return NULL;
+        goto done;
     }
 
-    ret = Py_BuildValue("s", result);
-    free(result);
+    Py_BEGIN_ALLOW_THREADS
+    total = nysiis_many(strings.strs, strings.lens, strings.count, max_length, codes, offsets);
+    Py_END_ALLOW_THREADS
 
+    codes_str = PyUnicode_FromWideChar(codes, total);
+    if (!codes_str) {
+        goto done;
+    }
+    code_point_offsets(codes, offsets, strings.count);
+    offsets_array = new_array(self, SIZE_T_TYPECODE, offsets, (strings.count + 1) * sizeof(size_t));
+    if (!offsets_array) {
+        goto done;
+    }
+    ret = PyTuple_Pack(2, codes_str, offsets_array);
+
+ done:
+    Py_XDECREF(codes_str);
+    Py_XDECREF(offsets_array);
+    PyMem_Free(codes);
+    free(offsets);
+    text_list_free(&strings);
     return ret;
 }
 
-static PyObject* jellyfish_match_rating_codex(PyObject *self, PyObject *args)
+static PyObject* porter_stem_of(PyObject *mod, PyObject *obj)
 {
-    const Py_UNICODE *str;
-    int len;
+    struct text str;
     Py_UNICODE *result;
     PyObject *ret;
+    struct stemmer *z;
+    int end;
 
-    if (!PyArg_ParseTuple(args, "u#", &str, &len)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!text_converter(obj, &str)) {
+        return NULL;
+    }
+
+    z = create_stemmer();
+    if (!z) {
+        text_release(&str);
+        PyErr_NoMemory();
         return NULL;
     }
 
-    result = match_rating_codex(str, len);
+    result = malloc((str.len+1) * sizeof(Py_UNICODE));
     if (!result) {
+        text_release(&str);
+        free_stemmer(z);
         PyErr_NoMemory();
         return NULL;
     }
+    memcpy(result, str.str, str.len * sizeof(Py_UNICODE));
 
-    ret = Py_BuildValue("u", result);
+    Py_BEGIN_ALLOW_THREADS
+    end = stem(z, result, str.len - 1);
+    Py_END_ALLOW_THREADS
+    result[end + 1] = '\0';
+
+    ret = PyUnicode_FromWideChar(result, -1);
+
+    text_release(&str);
     free(result);
+    free_stemmer(z);
 
     return ret;
 }
 
-static PyObject* jellyfish_match_rating_comparison(PyObject *self,
-                                                   PyObject *args)
+static PyObject* jellyfish_porter_stem(PyObject *self, PyObject *args)
 {
-    const Py_UNICODE *str1, *str2;
-    int len1, len2;
-    int result;
+    PyObject *str;
 
-    if (!PyArg_ParseTuple(args, "u#u#", &str1, &len1, &str2, &len2)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    if (!PyArg_ParseTuple(args, "O", &str)) {
         return NULL;
     }
 
-    result = match_rating_comparison(str1, len1, str2, len2);
-
-    if (result == -1) {
-        Py_RETURN_NONE;
-    } else if (result) {
-        Py_RETURN_TRUE;
-    } else {
-        Py_RETURN_FALSE;
+    if (PyUnicode_Check(str)) {
+        return cached_code(self, str, CACHED_PORTER_STEM, porter_stem_of);
     }
+    return porter_stem_of(self, str);
 }
 
-static PyObject* jellyfish_nysiis(PyObject *self, PyObject *args)
+static PyObject* jellyfish_porter_stem_text(PyObject *self, PyObject *args)
 {
-    const Py_UNICODE *str;
-    Py_UNICODE *result;
-    int len;
-    PyObject *ret;
-
-    if (!PyArg_ParseTuple(args, "u#", &str, &len)) {
+    struct text text;
+    struct stemmer *z;
+    PyObject *stems_str = NULL;
+    PyObject *offsets_array = NULL;
+    PyObject *spans_array = NULL;
+    PyObject *ret = NULL;
+    Py_UNICODE *stems;
+    size_t *offsets, *spans, *grown;
+    size_t pos = 0, count = 0, size;
+    int ok = 1;
+
+    if (!PyArg_ParseTuple(args, "O&", text_converter, &text)) {
         PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
         return NULL;
     }
 
-    result = nysiis(str, len);
-    if (!result) {
+    // stems are never longer than their words, the word count is not known
+    // up front so the spans and offsets grow as they fill
+    size = text.len / 8 + 16;
+    z = create_stemmer();
+    stems = PyMem_Malloc((text.len + 1) * sizeof(Py_UNICODE));
+    offsets = malloc((size + 1) * sizeof(size_t));
+    spans = malloc(2 * size * sizeof(size_t));
+    if (!z || !stems || !offsets || !spans) {
         PyErr_NoMemory();
-        return NULL;
+        goto done;
     }
 
-    ret = Py_BuildValue("u", result);
-    free(result);
+    Py_BEGIN_ALLOW_THREADS
+    offsets[0] = 0;
+    for (;;) {
+        count += stem_text(z, text.str, text.len, &pos, stems, offsets + count,
+                           spans + 2 * count, size - count);
+        if (pos == (size_t)text.len) {
+            break;
+        }
+        size *= 2;
+        grown = realloc(offsets, (size + 1) * sizeof(size_t));
+        if (!grown) {
+            ok = 0;
+            break;
+        }
+        offsets = grown;
+        grown = realloc(spans, 2 * size * sizeof(size_t));
+        if (!grown) {
+            ok = 0;
+            break;
+        }
+        spans = grown;
+    }
+    Py_END_ALLOW_THREADS
+    if (!ok) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    stems_str = PyUnicode_FromWideChar(stems, offsets[count]);
+    if (!stems_str) {
+        goto done;
+    }
+    code_point_offsets(stems, offsets, count);
+    if (count) {
+        code_point_offsets(text.str, spans, 2 * count - 1);
+    }
+    offsets_array = new_array(self, SIZE_T_TYPECODE, offsets, (count + 1) * sizeof(size_t));
+    spans_array = new_array(self, SIZE_T_TYPECODE, spans, 2 * count * sizeof(size_t));
+    if (!offsets_array || !spans_array) {
+        goto done;
+    }
+    ret = PyTuple_Pack(3, stems_str, offsets_array, spans_array);
 
+ done:
+    Py_XDECREF(stems_str);
+    Py_XDECREF(offsets_array);
+    Py_XDECREF(spans_array);
+    if (z) {
+        free_stemmer(z);
+    }
+    PyMem_Free(stems);
+    free(offsets);
+    free(spans);
+    text_release(&text);
     return ret;
 }
 
-static PyObject* jellyfish_porter_stem(PyObject *self, PyObject *args)
+/* Numbers the distinct tokens of seq in order of appearance, appending
+ * each to uniques the first time it is seen.
+ */
+static int number_tokens(PyObject *seq, PyObject *uniques, Py_ssize_t *numbers)
 {
-    const Py_UNICODE *str;
-    int len;
-    Py_UNICODE *result;
-    PyObject *ret;
-    struct stemmer *z;
-    int end;
+    PyObject *seen = PyDict_New();
+    PyObject *token;
+    PyObject *number;
+    Py_ssize_t i;
+    int ok = 0;
+
+    if (!seen) {
+        return 0;
+    }
 
-    if (!PyArg_ParseTuple(args, "u#", &str, &len)) {
-        PyErr_SetString(PyExc_TypeError, NO_BYTES_ERR_STR);
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        token = str_of(PySequence_Fast_GET_ITEM(seq, i));
+        if (!token) {
+            goto done;
+        }
+        number = PyDict_GetItemWithError(seen, token);
+        if (number) {
+            numbers[i] = PyLong_AsSsize_t(number);
+            continue;
+        }
+        if (PyErr_Occurred()) {
+            goto done;
+        }
+        numbers[i] = PyList_GET_SIZE(uniques);
+        number = PyLong_FromSsize_t(numbers[i]);
+        if (!number || PyDict_SetItem(seen, token, number) < 0 || PyList_Append(uniques, token) < 0) {
+            Py_XDECREF(number);
+            goto done;
+        }
+        Py_DECREF(number);
+    }
+    ok = 1;
+
+ done:
+    Py_DECREF(seen);
+    return ok;
+}
+
+static PyObject* jellyfish_porter_stem_many(PyObject *self, PyObject *args)
+{
+    PyObject *tokens;
+    PyObject *seq;
+    PyObject *uniques = NULL;
+    PyObject *stems = NULL;
+    PyObject *ret = NULL;
+    PyObject *stem_str;
+    struct text_list words = {0};
+    struct stemmer *z = NULL;
+    Py_UNICODE *buf = NULL, *p;
+    Py_ssize_t *numbers = NULL;
+    Py_ssize_t i, count, total = 0;
+    int *stem_lens = NULL;
+    int n, ok;
+
+    if (!PyArg_ParseTuple(args, "O", &tokens)) {
         return NULL;
     }
 
-    z = create_stemmer();
-    if (!z) {
-        PyErr_NoMemory();
+    seq = PySequence_Fast(tokens, "a sequence of str is required");
+    if (!seq) {
         return NULL;
     }
 
-    result = malloc((len+1) * sizeof(Py_UNICODE));
-    if (!result) {
-        free_stemmer(z);
+    // every distinct token is stemmed once
+    uniques = PyList_New(0);
+    if (!uniques) {
+        goto done;
+    }
+    Py_BEGIN_CRITICAL_SECTION(seq);
+    count = PySequence_Fast_GET_SIZE(seq);
+    numbers = malloc((count ? count : 1) * sizeof(Py_ssize_t));
+    if (!numbers) {
         PyErr_NoMemory();
-        return NULL;
+        ok = 0;
+    } else {
+        ok = number_tokens(seq, uniques, numbers);
+    }
+    Py_END_CRITICAL_SECTION();
+    if (!ok || !text_list_init(&words, uniques)) {
+        goto done;
     }
-    memcpy(result, str, len * sizeof(Py_UNICODE));
 
-    end = stem(z, result, len - 1);
-    result[end + 1] = '\0';
+    // stemmed in place, so copied end to end into one scratch buffer
+    for (i = 0; i < words.count; i++) {
+        total += words.lens[i];
+    }
+    buf = PyMem_Malloc((total ? total : 1) * sizeof(Py_UNICODE));
+    stem_lens = malloc((words.count ? words.count : 1) * sizeof(int));
+    z = create_stemmer();
+    if (!buf || !stem_lens || !z) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (p = buf, i = 0; i < words.count; i++) {
+        memcpy(p, words.strs[i], words.lens[i] * sizeof(Py_UNICODE));
+        p += words.lens[i];
+    }
 
-    ret = Py_BuildValue("u", result);
+    Py_BEGIN_ALLOW_THREADS
+    stem_many(z, buf, words.lens, words.count, stem_lens);
+    Py_END_ALLOW_THREADS
 
-    free(result);
-    free_stemmer(z);
+    stems = PyList_New(words.count);
+    if (!stems) {
+        goto done;
+    }
+    for (p = buf, i = 0; i < words.count; i++) {
+        // porter_stem ends its stems at a NUL, and so do these
+        for (n = 0; n < stem_lens[i] && p[n]; n++);
+        stem_str = PyUnicode_FromWideChar(p, n);
+        if (!stem_str) {
+            goto done;
+        }
+        PyList_SET_ITEM(stems, i, stem_str);
+        p += words.lens[i];
+    }
+
+    ret = PyList_New(count);
+    if (!ret) {
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        stem_str = PyList_GET_ITEM(stems, numbers[i]);
+        Py_INCREF(stem_str);
+        PyList_SET_ITEM(ret, i, stem_str);
+    }
 
+ done:
+    if (z) {
+        free_stemmer(z);
+    }
+    free(stem_lens);
+    PyMem_Free(buf);
+    text_list_free(&words);
+    free(numbers);
+    Py_XDECREF(stems);
+    Py_XDECREF(uniques);
+    Py_DECREF(seq);
     return ret;
 }
 
@@ -377,6 +3073,12 @@ static PyMethodDef jellyfish_methods[] = {
      "jaro_winkler(string1, string2, long_tolerance)\n\n"
      "Do a Jaro-Winkler string comparison between string1 and string2."},
 
+    {"jaro_winkler_extract", (PyCFunction)jellyfish_jaro_winkler_extract, METH_VARARGS|METH_KEYWORDS,
+     "jaro_winkler_extract(query, choices, limit=5, score_cutoff=0.0, long_tolerance=False)\n\n"
+     "Find the limit choices with the highest Jaro-Winkler score against\n"
+     "query, as a list of (choice, score, index) best first.  Only scores of\n"
+     "at least score_cutoff are returned, limit=None returns all of them."},
+
     {"jaro_distance", jellyfish_jaro_distance, METH_VARARGS,
      "jaro_distance(string1, string2)\n\n"
      "Get a Jaro string distance metric for string1 and string2."},
@@ -385,27 +3087,64 @@ static PyMethodDef jellyfish_methods[] = {
      "hamming_distance(string1, string2)\n\n"
      "Compute the Hamming distance between string1 and string2."},
 
-    {"levenshtein_distance", jellyfish_levenshtein_distance, METH_VARARGS,
-     "levenshtein_distance(string1, string2)\n\n"
-     "Compute the Levenshtein distance between string1 and string2."},
-
-    {"weighted_levenshtein_distance", jellyfish_weighted_levenshtein_distance, METH_VARARGS,
-     "weighted_levenshtein_distance(string1, string2, insert_weights, delete_weights, subsitute_weights)\n\n"
-     "Compute the weighted Levenshtein distance between string1 and string2."},
-
-    {"custom_weighted_levenshtein_distance", jellyfish_custom_weighted_levenshtein_distance, METH_VARARGS,
-     "custom_weighted_levenshtein_distance(string1, string2, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight)\n\n"
-     "Compute the weighted Levenshtein distance between string1 and string2."},
-
-    {"damerau_levenshtein_distance", jellyfish_damerau_levenshtein_distance,
+    {"hamming_distance_bits", jellyfish_hamming_distance_bits, METH_VARARGS,
+     "hamming_distance_bits(a, b)\n\n"
+     "Count the bits that differ between two bytes-like objects, every bit\n"
+     "past the end of the shorter one counting as different, or between\n"
+     "two ints taken as 64-bit fingerprints."},
+
+    {"levenshtein_distance", (PyCFunction)jellyfish_levenshtein_distance, METH_VARARGS|METH_KEYWORDS,
+     "levenshtein_distance(string1, string2, max_distance=None)\n\n"
+     "Compute the Levenshtein distance between string1 and string2.\n"
+     "If max_distance is given, any distance above it is reported as\n"
+     "max_distance + 1."},
+
+    {"levenshtein_distance_many", (PyCFunction)jellyfish_levenshtein_distance_many, METH_VARARGS|METH_KEYWORDS,
+     "levenshtein_distance_many(query, candidates, max_distance=None)\n\n"
+     "Compute the Levenshtein distance between query and every string in\n"
+     "candidates, returned as an array('i').  If max_distance is given, any\n"
+     "distance above it is reported as max_distance + 1."},
+
+    {"weighted_levenshtein_distance", (PyCFunction)jellyfish_weighted_levenshtein_distance, METH_VARARGS|METH_KEYWORDS,
+     "weighted_levenshtein_distance(string1, string2, insert_weights, delete_weights, subsitute_weights, *, max_cost=None)\n"
+     "weighted_levenshtein_distance(string1, string2, weight_table, *, max_cost=None)\n\n"
+     "Compute the weighted Levenshtein distance between string1 and string2.\n"
+     "If max_cost is given, any distance above it is reported as inf."},
+
+    {"custom_weighted_levenshtein_distance", (PyCFunction)jellyfish_custom_weighted_levenshtein_distance, METH_VARARGS|METH_KEYWORDS,
+     "custom_weighted_levenshtein_distance(string1, string2, insert_numeric_weight, insert_alpha_weight, delete_numeric_weight, delete_alpha_weight, substitute_numeric_weight, substitute_alpha_weight, *, max_cost=None)\n"
+     "custom_weighted_levenshtein_distance(string1, string2, cost_model, *, max_cost=None)\n\n"
+     "Compute the weighted Levenshtein distance between string1 and string2.\n"
+     "If max_cost is given, any distance above it is reported as inf."},
+
+    {"damerau_levenshtein_distance", (PyCFunction)jellyfish_damerau_levenshtein_distance,
+     METH_VARARGS|METH_KEYWORDS,
+     "damerau_levenshtein_distance(string1, string2, max_distance=None)\n\n"
+     "Compute the Damerau-Levenshtein distance between string1 and string2.\n"
+     "If max_distance is given, any distance above it is reported as\n"
+     "max_distance + 1."},
+
+    {"optimal_string_alignment_distance", jellyfish_optimal_string_alignment_distance,
      METH_VARARGS,
-     "damerau_levenshtein_distance(string1, string2)\n\n"
-     "Compute the Damerau-Levenshtein distance between string1 and string2."},
+     "optimal_string_alignment_distance(string1, string2)\n\n"
+     "Compute the optimal string alignment (restricted Damerau-Levenshtein)\n"
+     "distance between string1 and string2."},
 
     {"soundex", jellyfish_soundex, METH_VARARGS,
      "soundex(string)\n\n"
      "Calculate the soundex code for a given name."},
 
+    {"soundex_many", jellyfish_soundex_many, METH_VARARGS,
+     "soundex_many(strings)\n\n"
+     "Calculate the soundex code of every string in strings, packed into an\n"
+     "array('H').  Packed codes sort in the same order as the codes; the\n"
+     "empty code packs to 0, and codes that begin with a non-ASCII\n"
+     "character, which do not fit, to 65535."},
+
+    {"soundex_unpack", jellyfish_soundex_unpack, METH_VARARGS,
+     "soundex_unpack(code)\n\n"
+     "The soundex code a value from soundex_many stands for."},
+
     {"metaphone", jellyfish_metaphone, METH_VARARGS,
      "metaphone(string)\n\n"
      "Calculate the metaphone representation of a given string."},
@@ -419,21 +3158,85 @@ static PyMethodDef jellyfish_methods[] = {
      "Compute the Match Rating Approach similarity between string1 and"
      "string2."},
 
+    {"match_rating_codex_many", jellyfish_match_rating_codex_many, METH_VARARGS,
+     "match_rating_codex_many(strings)\n\n"
+     "Calculate the Match Rating Approach codex of every string in strings,\n"
+     "each packed into 64 bits, as an array('Q').  Codexes with characters\n"
+     "beyond U+00FF do not fit and are 2**64 - 1."},
+
+    {"match_rating_comparison_many", jellyfish_match_rating_comparison_many, METH_VARARGS,
+     "match_rating_comparison_many(query, codexes)\n\n"
+     "Compare query, a string or a packed codex, with every packed codex in\n"
+     "codexes, as returned by match_rating_codex_many.  Returns an array('b')\n"
+     "of 1 for a match, 0 for none, -1 where match_rating_comparison would\n"
+     "give None, and -2 where either codex could not be packed."},
+
     {"nysiis", jellyfish_nysiis, METH_VARARGS,
      "nysiis(string)\n\n"
      "Compute the NYSIIS (New York State Identification and Intelligence\n"
      "System) code for a string."},
 
+    {"nysiis_many", (PyCFunction)jellyfish_nysiis_many, METH_VARARGS|METH_KEYWORDS,
+     "nysiis_many(strings, max_length=None)\n\n"
+     "Compute the NYSIIS code of every string in strings, cut to max_length\n"
+     "characters if given (6 in the original NYSIIS).  Returns (codes, offsets):\n"
+     "the codes joined into one str and an array of len(strings) + 1 offsets,\n"
+     "code i being codes[offsets[i]:offsets[i + 1]]."},
+
     {"porter_stem", jellyfish_porter_stem, METH_VARARGS,
      "porter_stem(string)\n\n"
      "Return the result of running the Porter stemming algorithm on "
      "a single-word string."},
 
+    {"porter_stem_many", jellyfish_porter_stem_many, METH_VARARGS,
+     "porter_stem_many(tokens)\n\n"
+     "The porter_stem of every single-word string in tokens, as a list.\n"
+     "Every distinct token is stemmed once and equal tokens share one stem."},
+
+    {"porter_stem_text", jellyfish_porter_stem_text, METH_VARARGS,
+     "porter_stem_text(text)\n\n"
+     "Splits text into words of letters and digits, as str.isalnum() counts\n"
+     "them, lower cases their ASCII letters and stems them, in one pass.\n"
+     "Returns the stems end to end as one str, an array of their count + 1\n"
+     "offsets into it, and an array of the start and end of each word in\n"
+     "text, in pairs."},
+
+    {"set_cache_size", jellyfish_set_cache_size, METH_VARARGS,
+     "set_cache_size(max_bytes)\n\n"
+     "Caches the results of soundex, metaphone, nysiis, match_rating_codex\n"
+     "and porter_stem for plain strs, in at most about max_bytes, dropping\n"
+     "the least recently used first. 0, the default, turns the cache off."},
+
+    {"cache_info", jellyfish_cache_info, METH_NOARGS,
+     "cache_info()\n\n"
+     "The result cache's hits, misses, entries, bytes and max_bytes, as a dict."},
+
+    {"cache_clear", jellyfish_cache_clear, METH_NOARGS,
+     "cache_clear()\n\n"
+     "Empties the result cache and resets its hits and misses."},
+
     {NULL, NULL, 0, NULL}
 };
 
 #define INITERROR return NULL
 
+/* Empties the result cache and drops the state's references when the
+ * module goes away.
+ */
+static void jellyfish_free(void *mod)
+{
+    struct jellyfish_state *state = GETSTATE((PyObject*)mod);
+
+    if (state->cache) {
+        cache_release(cache_trim(state->cache, 0));
+        free(state->cache->buckets);
+        free(state->cache);
+        state->cache = NULL;
+    }
+    Py_CLEAR(state->unicodedata_normalize);
+    Py_CLEAR(state->array_type);
+}
+
 static struct PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
     "jellyfish.cjellyfish",
@@ -443,12 +3246,13 @@ static struct PyModuleDef moduledef = {
     NULL,
     NULL,
     NULL,
-    NULL
+    jellyfish_free
 };
 
 PyObject* PyInit_cjellyfish(void)
 {
     PyObject *unicodedata;
+    PyObject *array;
     PyObject *module = PyModule_Create(&moduledef);
 
     if (module == NULL) {
@@ -464,5 +3268,48 @@ PyObject* PyInit_cjellyfish(void)
         PyObject_GetAttrString(unicodedata, "normalize");
     Py_DECREF(unicodedata);
 
+    array = PyImport_ImportModule("array");
+    if (!array) {
+        INITERROR;
+    }
+
+    GETSTATE(module)->array_type = PyObject_GetAttrString(array, "array");
+    Py_DECREF(array);
+
+    if (PyType_Ready(&WeightTable_Type) < 0) {
+        INITERROR;
+    }
+    Py_INCREF(&WeightTable_Type);
+    PyModule_AddObject(module, "WeightTable", (PyObject*)&WeightTable_Type);
+
+    if (PyType_Ready(&CostModel_Type) < 0) {
+        INITERROR;
+    }
+    Py_INCREF(&CostModel_Type);
+    PyModule_AddObject(module, "CostModel", (PyObject*)&CostModel_Type);
+
+    if (PyType_Ready(&HammingTable_Type) < 0) {
+        INITERROR;
+    }
+    Py_INCREF(&HammingTable_Type);
+    PyModule_AddObject(module, "HammingTable", (PyObject*)&HammingTable_Type);
+
+    if (PyType_Ready(&PhoneticIndex_Type) < 0) {
+        INITERROR;
+    }
+    Py_INCREF(&PhoneticIndex_Type);
+    PyModule_AddObject(module, "PhoneticIndex", (PyObject*)&PhoneticIndex_Type);
+
+    if (PyType_Ready(&Prepared_Type) < 0) {
+        INITERROR;
+    }
+    Py_INCREF(&Prepared_Type);
+    PyModule_AddObject(module, "Prepared", (PyObject*)&Prepared_Type);
+
+#ifdef Py_GIL_DISABLED
+    // every kernel works on its own buffers, nothing needs the GIL
+    PyUnstable_Module_SetGIL(module, Py_MOD_GIL_NOT_USED);
+#endif
+
     return module;
 }
@@ -0,0 +1,74 @@
+#include "jellyfish.h"
+
+/* The NFKD form of U+0080 to U+024F (Latin-1 Supplement, Latin Extended-A
+   and -B), UTF-8 encoded.  None of these characters is a combining mark and
+   every decomposition begins with a starter, so the NFKD form of a string of
+   them is the concatenation of their own. */
+static const char latin_nfkd_table[LATIN_NFKD_END - 0x80][LATIN_NFKD_MAX + 1] = {
+    /* 0080 */ "\302\200", "\302\201", "\302\202", "\302\203", "\302\204", "\302\205", "\302\206", "\302\207",
+    /* 0088 */ "\302\210", "\302\211", "\302\212", "\302\213", "\302\214", "\302\215", "\302\216", "\302\217",
+    /* 0090 */ "\302\220", "\302\221", "\302\222", "\302\223", "\302\224", "\302\225", "\302\226", "\302\227",
+    /* 0098 */ "\302\230", "\302\231", "\302\232", "\302\233", "\302\234", "\302\235", "\302\236", "\302\237",
+    /* 00A0 */ " ", "\302\241", "\302\242", "\302\243", "\302\244", "\302\245", "\302\246", "\302\247",
+    /* 00A8 */ " \314\210", "\302\251", "a", "\302\253", "\302\254", "\302\255", "\302\256", " \314\204",
+    /* 00B0 */ "\302\260", "\302\261", "2", "3", " \314\201", "\316\274", "\302\266", "\302\267",
+    /* 00B8 */ " \314\247", "1", "o", "\302\273", "1\342\201\2044", "1\342\201\2042", "3\342\201\2044", "\302\277",
+    /* 00C0 */ "A\314\200", "A\314\201", "A\314\202", "A\314\203", "A\314\210", "A\314\212", "\303\206", "C\314\247",
+    /* 00C8 */ "E\314\200", "E\314\201", "E\314\202", "E\314\210", "I\314\200", "I\314\201", "I\314\202", "I\314\210",
+    /* 00D0 */ "\303\220", "N\314\203", "O\314\200", "O\314\201", "O\314\202", "O\314\203", "O\314\210", "\303\227",
+    /* 00D8 */ "\303\230", "U\314\200", "U\314\201", "U\314\202", "U\314\210", "Y\314\201", "\303\236", "\303\237",
+    /* 00E0 */ "a\314\200", "a\314\201", "a\314\202", "a\314\203", "a\314\210", "a\314\212", "\303\246", "c\314\247",
+    /* 00E8 */ "e\314\200", "e\314\201", "e\314\202", "e\314\210", "i\314\200", "i\314\201", "i\314\202", "i\314\210",
+    /* 00F0 */ "\303\260", "n\314\203", "o\314\200", "o\314\201", "o\314\202", "o\314\203", "o\314\210", "\303\267",
+    /* 00F8 */ "\303\270", "u\314\200", "u\314\201", "u\314\202", "u\314\210", "y\314\201", "\303\276", "y\314\210",
+    /* 0100 */ "A\314\204", "a\314\204", "A\314\206", "a\314\206", "A\314\250", "a\314\250", "C\314\201", "c\314\201",
+    /* 0108 */ "C\314\202", "c\314\202", "C\314\207", "c\314\207", "C\314\214", "c\314\214", "D\314\214", "d\314\214",
+    /* 0110 */ "\304\220", "\304\221", "E\314\204", "e\314\204", "E\314\206", "e\314\206", "E\314\207", "e\314\207",
+    /* 0118 */ "E\314\250", "e\314\250", "E\314\214", "e\314\214", "G\314\202", "g\314\202", "G\314\206", "g\314\206",
+    /* 0120 */ "G\314\207", "g\314\207", "G\314\247", "g\314\247", "H\314\202", "h\314\202", "\304\246", "\304\247",
+    /* 0128 */ "I\314\203", "i\314\203", "I\314\204", "i\314\204", "I\314\206", "i\314\206", "I\314\250", "i\314\250",
+    /* 0130 */ "I\314\207", "\304\261", "IJ", "ij", "J\314\202", "j\314\202", "K\314\247", "k\314\247",
+    /* 0138 */ "\304\270", "L\314\201", "l\314\201", "L\314\247", "l\314\247", "L\314\214", "l\314\214", "L\302\267",
+    /* 0140 */ "l\302\267", "\305\201", "\305\202", "N\314\201", "n\314\201", "N\314\247", "n\314\247", "N\314\214",
+    /* 0148 */ "n\314\214", "\312\274n", "\305\212", "\305\213", "O\314\204", "o\314\204", "O\314\206", "o\314\206",
+    /* 0150 */ "O\314\213", "o\314\213", "\305\222", "\305\223", "R\314\201", "r\314\201", "R\314\247", "r\314\247",
+    /* 0158 */ "R\314\214", "r\314\214", "S\314\201", "s\314\201", "S\314\202", "s\314\202", "S\314\247", "s\314\247",
+    /* 0160 */ "S\314\214", "s\314\214", "T\314\247", "t\314\247", "T\314\214", "t\314\214", "\305\246", "\305\247",
+    /* 0168 */ "U\314\203", "u\314\203", "U\314\204", "u\314\204", "U\314\206", "u\314\206", "U\314\212", "u\314\212",
+    /* 0170 */ "U\314\213", "u\314\213", "U\314\250", "u\314\250", "W\314\202", "w\314\202", "Y\314\202", "y\314\202",
+    /* 0178 */ "Y\314\210", "Z\314\201", "z\314\201", "Z\314\207", "z\314\207", "Z\314\214", "z\314\214", "s",
+    /* 0180 */ "\306\200", "\306\201", "\306\202", "\306\203", "\306\204", "\306\205", "\306\206", "\306\207",
+    /* 0188 */ "\306\210", "\306\211", "\306\212", "\306\213", "\306\214", "\306\215", "\306\216", "\306\217",
+    /* 0190 */ "\306\220", "\306\221", "\306\222", "\306\223", "\306\224", "\306\225", "\306\226", "\306\227",
+    /* 0198 */ "\306\230", "\306\231", "\306\232", "\306\233", "\306\234", "\306\235", "\306\236", "\306\237",
+    /* 01A0 */ "O\314\233", "o\314\233", "\306\242", "\306\243", "\306\244", "\306\245", "\306\246", "\306\247",
+    /* 01A8 */ "\306\250", "\306\251", "\306\252", "\306\253", "\306\254", "\306\255", "\306\256", "U\314\233",
+    /* 01B0 */ "u\314\233", "\306\261", "\306\262", "\306\263", "\306\264", "\306\265", "\306\266", "\306\267",
+    /* 01B8 */ "\306\270", "\306\271", "\306\272", "\306\273", "\306\274", "\306\275", "\306\276", "\306\277",
+    /* 01C0 */ "\307\200", "\307\201", "\307\202", "\307\203", "DZ\314\214", "Dz\314\214", "dz\314\214", "LJ",
+    /* 01C8 */ "Lj", "lj", "NJ", "Nj", "nj", "A\314\214", "a\314\214", "I\314\214",
+    /* 01D0 */ "i\314\214", "O\314\214", "o\314\214", "U\314\214", "u\314\214", "U\314\210\314\204", "u\314\210\314\204", "U\314\210\314\201",
+    /* 01D8 */ "u\314\210\314\201", "U\314\210\314\214", "u\314\210\314\214", "U\314\210\314\200", "u\314\210\314\200", "\307\235", "A\314\210\314\204", "a\314\210\314\204",
+    /* 01E0 */ "A\314\207\314\204", "a\314\207\314\204", "\303\206\314\204", "\303\246\314\204", "\307\244", "\307\245", "G\314\214", "g\314\214",
+    /* 01E8 */ "K\314\214", "k\314\214", "O\314\250", "o\314\250", "O\314\250\314\204", "o\314\250\314\204", "\306\267\314\214", "\312\222\314\214",
+    /* 01F0 */ "j\314\214", "DZ", "Dz", "dz", "G\314\201", "g\314\201", "\307\266", "\307\267",
+    /* 01F8 */ "N\314\200", "n\314\200", "A\314\212\314\201", "a\314\212\314\201", "\303\206\314\201", "\303\246\314\201", "\303\230\314\201", "\303\270\314\201",
+    /* 0200 */ "A\314\217", "a\314\217", "A\314\221", "a\314\221", "E\314\217", "e\314\217", "E\314\221", "e\314\221",
+    /* 0208 */ "I\314\217", "i\314\217", "I\314\221", "i\314\221", "O\314\217", "o\314\217", "O\314\221", "o\314\221",
+    /* 0210 */ "R\314\217", "r\314\217", "R\314\221", "r\314\221", "U\314\217", "u\314\217", "U\314\221", "u\314\221",
+    /* 0218 */ "S\314\246", "s\314\246", "T\314\246", "t\314\246", "\310\234", "\310\235", "H\314\214", "h\314\214",
+    /* 0220 */ "\310\240", "\310\241", "\310\242", "\310\243", "\310\244", "\310\245", "A\314\207", "a\314\207",
+    /* 0228 */ "E\314\247", "e\314\247", "O\314\210\314\204", "o\314\210\314\204", "O\314\203\314\204", "o\314\203\314\204", "O\314\207", "o\314\207",
+    /* 0230 */ "O\314\207\314\204", "o\314\207\314\204", "Y\314\204", "y\314\204", "\310\264", "\310\265", "\310\266", "\310\267",
+    /* 0238 */ "\310\270", "\310\271", "\310\272", "\310\273", "\310\274", "\310\275", "\310\276", "\310\277",
+    /* 0240 */ "\311\200", "\311\201", "\311\202", "\311\203", "\311\204", "\311\205", "\311\206", "\311\207",
+    /* 0248 */ "\311\210", "\311\211", "\311\212", "\311\213", "\311\214", "\311\215", "\311\216", "\311\217",
+};
+
+const char* latin_nfkd(uint32_t c)
+{
+    if (c < 0x80 || c >= LATIN_NFKD_END) {
+        return NULL;
+    }
+    return latin_nfkd_table[c - 0x80];
+}
@@ -1,47 +1,595 @@
 #include "jellyfish.h"
+#include "pattern_match.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
-int levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len)
+/* rows up to this many cells are kept on the stack instead of the heap */
+#define LEVENSHTEIN_STACK_ROW 128
+
+/* Single-row DP, used when the bit-parallel kernels cannot build their
+   match table and no wavefront kernel runs on this CPU.  s2 must be the
+   shorter string. */
+static int levenshtein_row(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len)
 {
     size_t rows = s1_len + 1;
     size_t cols = s2_len + 1;
     size_t i, j;
 
-    unsigned result;
-    unsigned d1, d2, d3;
-    unsigned *dist = malloc(rows * cols * sizeof(unsigned));
-    if (!dist) {
-        return -1;
-    }
+    unsigned stack_row[LEVENSHTEIN_STACK_ROW];
+    unsigned *row = stack_row;
+    unsigned diag, up, result;
 
-    for (i = 0; i < rows; i++) {
-        dist[i * cols] = i;
+    if (cols > LEVENSHTEIN_STACK_ROW) {
+        row = malloc(cols * sizeof(unsigned));
+        if (!row) {
+            return -1;
+        }
     }
 
-
     for (j = 0; j < cols; j++) {
-        dist[j] = j;
+        row[j] = j;
     }
 
-    for (j = 1; j < cols; j++) {
-        for (i = 1; i < rows; i++) {
+    /* row[j] holds dist[i - 1][j] until it is overwritten with dist[i][j],
+       diag carries dist[i - 1][j - 1] along the row */
+    for (i = 1; i < rows; i++) {
+        diag = row[0];
+        row[0] = i;
+        for (j = 1; j < cols; j++) {
+            up = row[j];
             if (s1[i - 1] == s2[j - 1]) {
-                dist[(i * cols) + j] = dist[((i - 1) * cols) + (j - 1)];
+                row[j] = diag;
             } else {
-                d1 = dist[((i - 1) * cols) + j] + 1;
-                d2 = dist[(i * cols) + (j - 1)] + 1;
-                d3 = dist[((i - 1) * cols) + (j - 1)] + 1;
+                row[j] = MIN(up, MIN(row[j - 1], diag)) + 1;
+            }
+            diag = up;
+        }
+    }
+
+    result = row[cols - 1];
+
+    if (row != stack_row) {
+        free(row);
+    }
+
+    return result;
+}
+
+/* The wavefront kernels are compiled for SSE4.1 and AVX2 whatever the
+   build flags, and picked at run time by what the CPU supports. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEVENSHTEIN_WAVEFRONT 1
+#define WAVEFRONT_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && !defined(__clang__) && (defined(_M_X64) || defined(_M_IX86))
+#define LEVENSHTEIN_WAVEFRONT 1
+#define WAVEFRONT_TARGET(isa)
+#include <intrin.h>
+#endif
+
+#ifdef LEVENSHTEIN_WAVEFRONT
+
+#include <immintrin.h>
+
+/* Anti-diagonal (wavefront) DP.  All cells with i + j == t depend only on
+   diagonals t - 1 and t - 2, so a diagonal is filled lanes cells at a time
+   with the 32-bit LANES_* operations in scope where this is instantiated.
+   Cells are indexed by row i; reading s2 backwards makes the characters
+   compared along a diagonal contiguous.  Code points are widened to 32-bit
+   lanes whatever the width of JFISH_UNICODE (wchar_t is 16 bits on
+   Windows).  Both strings must be non-empty.
 
-                dist[(i * cols) + j] = MIN(d1, MIN(d2, d3));
+   This is slower than the blocked bit-parallel kernel, so it only handles
+   inputs whose alphabet is too large for a match table. */
+#define LEVENSHTEIN_WAVEFRONT_KERNEL(name, isa, lanes)                         \
+static WAVEFRONT_TARGET(isa) int name(const JFISH_UNICODE *s1, int s1_len,     \
+                                      const JFISH_UNICODE *s2, int s2_len)     \
+{                                                                              \
+    size_t diag_len = s1_len + 1;                                              \
+    JFISH_UNICODE *r2;                                                         \
+    uint32_t *buf, *prev2, *prev1, *cur, *tmp;                                 \
+    uint32_t up, result;                                                       \
+    const lanes_t one = LANES_SET1(1);                                         \
+    lanes_t eq, v;                                                             \
+    long t, i, lo, hi;                                                         \
+                                                                               \
+    buf = malloc(3 * diag_len * sizeof(uint32_t)                               \
+                 + s2_len * sizeof(JFISH_UNICODE));                            \
+    if (!buf) {                                                                \
+        return -1;                                                             \
+    }                                                                          \
+    prev2 = buf;                                                               \
+    prev1 = prev2 + diag_len;                                                  \
+    cur = prev1 + diag_len;                                                    \
+    r2 = (JFISH_UNICODE*)(cur + diag_len);                                     \
+                                                                               \
+    for (i = 0; i < s2_len; i++) {                                             \
+        r2[i] = s2[s2_len - 1 - i];                                            \
+    }                                                                          \
+                                                                               \
+    prev1[0] = 0;                                                              \
+    for (t = 1; t <= s1_len + s2_len; t++) {                                   \
+        /* interior cells of diagonal t, 1 <= i <= s1_len, 1 <= j <= s2_len */ \
+        lo = t > s2_len ? t - s2_len : 1;                                      \
+        hi = t - 1 < s1_len ? t - 1 : s1_len;                                  \
+                                                                               \
+        /* s2[t - i - 1] == r2[s2_len - t + i] */                              \
+        for (i = lo; i + lanes - 1 <= hi; i += lanes) {                        \
+            if (sizeof(JFISH_UNICODE) == 4) {                                  \
+                eq = LANES_CMPEQ(LANES_LOAD(s1 + i - 1),                       \
+                                 LANES_LOAD(r2 + s2_len - t + i));             \
+            } else {                                                           \
+                eq = LANES_CMPEQ(LANES_WIDEN16(s1 + i - 1),                    \
+                                 LANES_WIDEN16(r2 + s2_len - t + i));          \
+            }                                                                  \
+            v = LANES_ADD(LANES_LOAD(prev2 + i - 1), LANES_ANDNOT(eq, one));   \
+            v = LANES_MIN(v, LANES_ADD(LANES_MIN(LANES_LOAD(prev1 + i - 1),    \
+                                                 LANES_LOAD(prev1 + i)), one));\
+            LANES_STORE(cur + i, v);                                           \
+        }                                                                      \
+        for (; i <= hi; i++) {                                                 \
+            if (s1[i - 1] == s2[t - i - 1]) {                                  \
+                cur[i] = prev2[i - 1];                                         \
+            } else {                                                           \
+                up = MIN(prev1[i - 1], prev1[i]);                              \
+                cur[i] = MIN(up, prev2[i - 1]) + 1;                            \
+            }                                                                  \
+        }                                                                      \
+                                                                               \
+        /* borders: row 0 and column 0 */                                     \
+        if (t <= s2_len) {                                                     \
+            cur[0] = t;                                                        \
+        }                                                                      \
+        if (t <= s1_len) {                                                     \
+            cur[t] = t;                                                        \
+        }                                                                      \
+                                                                               \
+        tmp = prev2;                                                           \
+        prev2 = prev1;                                                         \
+        prev1 = cur;                                                           \
+        cur = tmp;                                                             \
+    }                                                                          \
+                                                                               \
+    result = prev1[s1_len];                                                    \
+                                                                               \
+    free(buf);                                                                 \
+    return result;                                                             \
+}
+
+#define lanes_t __m128i
+#define LANES_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define LANES_STORE(p, v) _mm_storeu_si128((__m128i*)(p), (v))
+#define LANES_SET1(x) _mm_set1_epi32(x)
+#define LANES_CMPEQ(a, b) _mm_cmpeq_epi32((a), (b))
+#define LANES_ADD(a, b) _mm_add_epi32((a), (b))
+#define LANES_MIN(a, b) _mm_min_epu32((a), (b))
+#define LANES_ANDNOT(a, b) _mm_andnot_si128((a), (b))
+#define LANES_WIDEN16(p) _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(p)))
+
+LEVENSHTEIN_WAVEFRONT_KERNEL(levenshtein_wavefront_sse41, "sse4.1", 4)
+
+#undef lanes_t
+#undef LANES_LOAD
+#undef LANES_STORE
+#undef LANES_SET1
+#undef LANES_CMPEQ
+#undef LANES_ADD
+#undef LANES_MIN
+#undef LANES_ANDNOT
+#undef LANES_WIDEN16
+
+#define lanes_t __m256i
+#define LANES_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define LANES_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), (v))
+#define LANES_SET1(x) _mm256_set1_epi32(x)
+#define LANES_CMPEQ(a, b) _mm256_cmpeq_epi32((a), (b))
+#define LANES_ADD(a, b) _mm256_add_epi32((a), (b))
+#define LANES_MIN(a, b) _mm256_min_epu32((a), (b))
+#define LANES_ANDNOT(a, b) _mm256_andnot_si256((a), (b))
+#define LANES_WIDEN16(p) _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p)))
+
+LEVENSHTEIN_WAVEFRONT_KERNEL(levenshtein_wavefront_avx2, "avx2", 8)
+
+#undef lanes_t
+#undef LANES_LOAD
+#undef LANES_STORE
+#undef LANES_SET1
+#undef LANES_CMPEQ
+#undef LANES_ADD
+#undef LANES_MIN
+#undef LANES_ANDNOT
+#undef LANES_WIDEN16
+
+enum wavefront_isa { WAVEFRONT_NONE, WAVEFRONT_SSE41, WAVEFRONT_AVX2 };
+
+/* The widest wavefront kernel this CPU (and OS, for the AVX state) runs. */
+static enum wavefront_isa wavefront_isa(void)
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return WAVEFRONT_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return WAVEFRONT_SSE41;
+    }
+#else
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 1) {
+        return WAVEFRONT_NONE;
+    }
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 19))) {
+        return WAVEFRONT_NONE;
+    }
+    /* OSXSAVE and AVX, with the OS saving the YMM registers */
+    if ((info[2] & (1 << 27)) && (info[2] & (1 << 28))
+            && (_xgetbv(0) & 6) == 6) {
+        __cpuid(info, 0);
+        if (info[0] >= 7) {
+            __cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5)) {
+                return WAVEFRONT_AVX2;
             }
         }
     }
+    return WAVEFRONT_SSE41;
+#endif
+    return WAVEFRONT_NONE;
+}
+
+#endif
 
-    result = dist[(cols * rows) - 1];
+/* Unit-cost DP over the whole matrix, through the widest wavefront kernel
+   the CPU runs.  The check costs nothing next to the O(n * m) kernels it
+   picks between.  s2 must be the shorter, non-empty string. */
+static int levenshtein_dp(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len)
+{
+#ifdef LEVENSHTEIN_WAVEFRONT
+    switch (wavefront_isa()) {
+    case WAVEFRONT_AVX2:
+        return levenshtein_wavefront_avx2(s1, s1_len, s2, s2_len);
+    case WAVEFRONT_SSE41:
+        return levenshtein_wavefront_sse41(s1, s1_len, s2, s2_len);
+    case WAVEFRONT_NONE:
+        break;
+    }
+#endif
+    return levenshtein_row(s1, s1_len, s2, s2_len);
+}
+
+/* Myers' bit-vector algorithm in Hyyrö's formulation, for patterns of at
+   most 64 code points.  VP/VN hold the vertical +1/-1 deltas of the current
+   DP column. */
+static int levenshtein_myers64(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len, int max)
+{
+    uint64_t VP = ~(uint64_t)0;
+    uint64_t VN = 0;
+    uint64_t last = (uint64_t)1 << (pm->len - 1);
+    uint64_t X, D0, HP, HN;
+    int score = pm->len;
+    int j;
+
+    for (j = 0; j < text_len; j++) {
+        X = *pattern_match_get(pm, text[j]) | VN;
+        D0 = (((X & VP) + VP) ^ VP) | X;
+        HP = VN | ~(D0 | VP);
+        HN = VP & D0;
+
+        score += (HP & last) != 0;
+        score -= (HN & last) != 0;
+
+        /* each remaining column lowers the score by at most one */
+        if (score - (text_len - j - 1) > max) {
+            return max + 1;
+        }
+
+        HP = (HP << 1) | 1;
+        HN = HN << 1;
+        VP = HN | ~(D0 | HP);
+        VN = HP & D0;
+    }
+
+    return score;
+}
+
+/* Hyyrö's blocked extension for longer patterns: the horizontal deltas
+   leaving the top bit of one word are carried into the next.  vectors is
+   scratch space for 2 * pm->words words. */
+static int levenshtein_myers_blocked(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len, int max, uint64_t *vectors)
+{
+    int words = pm->words;
+    uint64_t *VP = vectors;
+    uint64_t *VN = vectors + words;
+    uint64_t last = (uint64_t)1 << ((pm->len - 1) % PATTERN_MATCH_WORD_BITS);
+    uint64_t X, D0, HP, HN, HP_carry, HN_carry, carry;
+    const uint64_t *PM;
+    int score = pm->len;
+    int j, w;
+
+    for (w = 0; w < words; w++) {
+        VP[w] = ~(uint64_t)0;
+        VN[w] = 0;
+    }
+
+    for (j = 0; j < text_len; j++) {
+        PM = pattern_match_get(pm, text[j]);
+        HP_carry = 1;
+        HN_carry = 0;
+
+        for (w = 0; w < words; w++) {
+            X = PM[w] | HN_carry;
+            D0 = (((X & VP[w]) + VP[w]) ^ VP[w]) | X | VN[w];
+            HP = VN[w] | ~(D0 | VP[w]);
+            HN = VP[w] & D0;
+
+            if (w == words - 1) {
+                score += (HP & last) != 0;
+                score -= (HN & last) != 0;
+            }
+
+            carry = HP >> 63;
+            HP = (HP << 1) | HP_carry;
+            HP_carry = carry;
+
+            carry = HN >> 63;
+            HN = (HN << 1) | HN_carry;
+            HN_carry = carry;
+
+            VP[w] = HN | ~(D0 | HP);
+            VN[w] = HP & D0;
+        }
+
+        if (score - (text_len - j - 1) > max) {
+            return max + 1;
+        }
+    }
+
+    return score;
+}
+
+/* Ukkonen's banded DP: only cells with |i - j| <= max can lead to a distance
+   of at most max, so each row keeps the 2 * max + 1 cells of that band, with
+   max + 1 standing in for everything outside it.  s2 must be the shorter
+   string and s1_len - s2_len <= max. */
+static int levenshtein_banded(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, int max)
+{
+    size_t width = 2 * (size_t)max + 1;
+    size_t d, lo, hi;
+    long i, j;
+
+    unsigned stack_band[LEVENSHTEIN_STACK_ROW];
+    unsigned *buf = stack_band;
+    unsigned *band;
+    unsigned inf = max + 1;
+    unsigned up, row_min, result;
+
+    if (width + 1 > LEVENSHTEIN_STACK_ROW) {
+        buf = malloc((width + 1) * sizeof(unsigned));
+        if (!buf) {
+            return -1;
+        }
+    }
+
+    /* band[-1] is a permanent inf sentinel left of the band */
+    buf[0] = inf;
+    band = buf + 1;
+
+    /* band[d] holds the cell at column j = i + d - max; cells left of
+       column 0 stay at inf for good */
+    for (d = 0; d < width; d++) {
+        j = (long)d - max;
+        band[d] = (j < 0 || j > s2_len) ? inf : (unsigned)j;
+    }
 
-    free(dist);
+    for (i = 1; i <= s1_len; i++) {
+        lo = i < max ? max - i : 0;
+        hi = MIN(width - 1, (size_t)(s2_len - i + max));
+        row_min = inf;
+
+        d = lo;
+        if (i <= max) {
+            /* column 0 */
+            band[d] = i;
+            row_min = i;
+            d++;
+        }
+        for (; d <= hi; d++) {
+            j = i + (long)d - max;
+            if (s1[i - 1] != s2[j - 1]) {
+                /* band[d] is still the diagonal cell of the previous row, and
+                   band[d + 1] the cell above */
+                up = d + 1 < width ? band[d + 1] : inf;
+                band[d] = MIN(inf, MIN(band[d], MIN(up, band[d - 1])) + 1);
+            }
+            row_min = MIN(row_min, band[d]);
+        }
+
+        /* no later row can get back below the best cell of this one */
+        if (row_min > (unsigned)max) {
+            result = inf;
+            goto done;
+        }
+    }
+
+    result = band[s2_len - s1_len + max];
+
+ done:
+    if (buf != stack_band) {
+        free(buf);
+    }
+
+    return result;
+}
+
+int levenshtein_distance_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, int max_distance)
+{
+    const JFISH_UNICODE *tmp;
+    struct pattern_match pm;
+    uint64_t *vectors;
+    int n, result;
+    int max = max_distance < 0 ? INT_MAX - 1 : max_distance;
+
+    /* common affixes never contribute to the distance */
+    while (s1_len && s2_len && *s1 == *s2) {
+        s1++; s2++;
+        s1_len--; s2_len--;
+    }
+    while (s1_len && s2_len && s1[s1_len - 1] == s2[s2_len - 1]) {
+        s1_len--; s2_len--;
+    }
+
+    /* the distance is symmetric, use the shorter string as the pattern */
+    if (s2_len > s1_len) {
+        tmp = s1; s1 = s2; s2 = tmp;
+        n = s1_len; s1_len = s2_len; s2_len = n;
+    }
+
+    /* the distance is at least the difference in length */
+    if (s1_len - s2_len > max) {
+        return max + 1;
+    }
+
+    if (!s2_len) {
+        return s1_len;
+    }
+
+    /* a band narrower than the number of words the blocked kernel would
+       process per column is cheaper to fill cell by cell */
+    if (2 * (long)max + 1 < (s2_len + PATTERN_MATCH_WORD_BITS - 1) / PATTERN_MATCH_WORD_BITS) {
+        return levenshtein_banded(s1, s1_len, s2, s2_len, max);
+    }
+
+    switch (pattern_match_init(&pm, s2, s2_len)) {
+    case 0:
+        return -1;
+    case -1:
+        result = levenshtein_dp(s1, s1_len, s2, s2_len);
+        return result > max ? max + 1 : result;
+    }
+
+    if (pm.words == 1) {
+        result = levenshtein_myers64(&pm, s1, s1_len, max);
+    } else {
+        vectors = malloc(2 * pm.words * sizeof(uint64_t));
+        if (vectors) {
+            result = levenshtein_myers_blocked(&pm, s1, s1_len, max, vectors);
+            free(vectors);
+        } else {
+            result = -1;
+        }
+    }
+
+    pattern_match_free(&pm);
+
+    return result;
+}
+
+int levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len)
+{
+    return levenshtein_distance_max(s1, s1_len, s2, s2_len, -1);
+}
+
+/* The distance between the pattern pm was built from and text, for callers
+   holding on to a pattern's match table.  The pattern must not be empty. */
+int levenshtein_distance_pattern(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len, int max_distance)
+{
+    uint64_t *vectors;
+    int max = max_distance < 0 ? INT_MAX - 1 : max_distance;
+    int result;
+
+    if (abs(text_len - pm->len) > max) {
+        return max + 1;
+    }
+    if (!text_len) {
+        return pm->len;
+    }
+
+    if (pm->words == 1) {
+        return levenshtein_myers64(pm, text, text_len, max);
+    }
+
+    vectors = malloc(2 * pm->words * sizeof(uint64_t));
+    if (!vectors) {
+        return -1;
+    }
+    result = levenshtein_myers_blocked(pm, text, text_len, max, vectors);
+    free(vectors);
 
     return result;
 }
+
+/* The same for many texts, the blocked kernel's scratch space shared
+   between them.  Returns 0, or -1 on failed malloc. */
+int levenshtein_distance_many_pattern(const struct pattern_match *pm,
+        const JFISH_UNICODE *const *candidates, const int *lens, size_t count,
+        int max_distance, int *results)
+{
+    uint64_t *vectors = NULL;
+    int max = max_distance < 0 ? INT_MAX - 1 : max_distance;
+    int len;
+    size_t i;
+
+    if (pm->words > 1) {
+        vectors = malloc(2 * pm->words * sizeof(uint64_t));
+        if (!vectors) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        len = lens[i];
+        if (abs(len - pm->len) > max) {
+            results[i] = max + 1;
+        } else if (!len) {
+            results[i] = pm->len;
+        } else if (pm->words == 1) {
+            results[i] = levenshtein_myers64(pm, candidates[i], len, max);
+        } else {
+            results[i] = levenshtein_myers_blocked(pm, candidates[i], len, max, vectors);
+        }
+    }
+
+    free(vectors);
+
+    return 0;
+}
+
+int levenshtein_distance_many(const JFISH_UNICODE *query, int query_len,
+        const JFISH_UNICODE *const *candidates, const int *lens, size_t count,
+        int max_distance, int *results)
+{
+    struct pattern_match pm;
+    int max = max_distance < 0 ? INT_MAX - 1 : max_distance;
+    int status;
+    size_t i;
+
+    if (!query_len) {
+        for (i = 0; i < count; i++) {
+            results[i] = lens[i] > max ? max + 1 : lens[i];
+        }
+        return 0;
+    }
+
+    /* the query's match table is built once and shared by every candidate */
+    switch (pattern_match_init(&pm, query, query_len)) {
+    case 0:
+        return -1;
+    case -1:
+        for (i = 0; i < count; i++) {
+            results[i] = levenshtein_distance_max(query, query_len, candidates[i], lens[i], max_distance);
+            if (results[i] == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    status = levenshtein_distance_many_pattern(&pm, candidates, lens, count, max_distance, results);
+    pattern_match_free(&pm);
+
+    return status;
+}
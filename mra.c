@@ -1,18 +1,50 @@
 #include "jellyfish.h"
+#include "pattern_match.h"
 #include <string.h>
 #include <ctype.h>
 
-static size_t compute_match_rating_codex(const JFISH_UNICODE *str, size_t len, JFISH_UNICODE codex[7]);
+#define BYTES_LOW7 0x7F7F7F7F7F7F7F7FULL
+#define BYTES_HIGH 0x8080808080808080ULL
+
+/* Whether codexes of len1 and len2 characters that have unmatched
+ * characters left in the longer one are a match. */
+static int match_rating(size_t len1, size_t len2, int unmatched) {
+    int diff = 6 - unmatched;
+    size_t i = len1 + len2;
+
+    if (i <= 4) {
+        return diff >= 5;
+    } else if (i <= 7) {
+        return diff >= 4;
+    } else if (i <= 11) {
+        return diff >= 3;
+    } else {
+        return diff >= 2;
+    }
+}
 
 int match_rating_comparison(const JFISH_UNICODE *s1, size_t len1, const JFISH_UNICODE *s2, size_t len2) {
     size_t s1c_len, s2c_len;
+
+    JFISH_UNICODE s1_codex[7], s2_codex[7];
+    s1c_len = match_rating_codex_into(s1, len1, s1_codex);
+    s2c_len = match_rating_codex_into(s2, len2, s2_codex);
+
+    return match_rating_comparison_codex(s1_codex, s1c_len, s2_codex, s2c_len);
+}
+
+/* The comparison of two codexes already computed, of at most 6 characters
+ * each. */
+int match_rating_comparison_codex(const JFISH_UNICODE *codex1, size_t s1c_len, const JFISH_UNICODE *codex2, size_t s2c_len) {
     size_t i, j;
     int diff;
     JFISH_UNICODE *longer;
 
     JFISH_UNICODE s1_codex[7], s2_codex[7];
-    s1c_len = compute_match_rating_codex(s1, len1, s1_codex);
-    s2c_len = compute_match_rating_codex(s2, len2, s2_codex);
+    memcpy(s1_codex, codex1, s1c_len * sizeof(JFISH_UNICODE));
+    memcpy(s2_codex, codex2, s2c_len * sizeof(JFISH_UNICODE));
+    s1_codex[s1c_len] = '\0';
+    s2_codex[s2c_len] = '\0';
 
     if (abs(s1c_len - s2c_len) >= 3) {
         return -1;
@@ -64,18 +96,7 @@ int match_rating_comparison(const JFISH_UNICODE *s1, size_t len1, const JFISH_UN
         }
     }
 
-    diff = 6 - diff;
-    i = s1c_len + s2c_len;
-
-    if (i <= 4) {
-        return diff >= 5;
-    } else if (i <= 7) {
-        return diff >= 4;
-    } else if (i <= 11) {
-        return diff >= 3;
-    } else {
-        return diff >= 2;
-    }
+    return match_rating(s1c_len, s2c_len, diff);
 }
 
 JFISH_UNICODE* match_rating_codex(const JFISH_UNICODE *str, size_t len) {
@@ -83,12 +104,12 @@ JFISH_UNICODE* match_rating_codex(const JFISH_UNICODE *str, size_t len) {
     if (!codex) {
         return NULL;
     }
-    compute_match_rating_codex(str, len, codex);
+    match_rating_codex_into(str, len, codex);
 
     return codex;
 }
 
-static size_t compute_match_rating_codex(const JFISH_UNICODE *str, size_t len, JFISH_UNICODE codex[7]) {
+size_t match_rating_codex_into(const JFISH_UNICODE *str, size_t len, JFISH_UNICODE *codex) {
     size_t i, j;
     JFISH_UNICODE c, prev;
 
@@ -117,3 +138,94 @@ static size_t compute_match_rating_codex(const JFISH_UNICODE *str, size_t len, J
     codex[j] = '\0';
     return j;
 }
+
+/* A packed codex holds character k in byte k and the length in byte 6, so
+ * the empty codex packs to 0.  Only equality between characters matters to
+ * the comparison, which is what lets it work on the bytes. */
+uint64_t match_rating_codex_pack(const JFISH_UNICODE *codex, size_t len) {
+    uint64_t packed = (uint64_t)len << 48;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((uint32_t)codex[i] > 0xFF) {
+            return MRA_CODEX_UNPACKABLE;
+        }
+        packed |= (uint64_t)codex[i] << (8 * i);
+    }
+    return packed;
+}
+
+uint64_t match_rating_codex_packed(const JFISH_UNICODE *str, size_t len) {
+    JFISH_UNICODE codex[7];
+    size_t codex_len;
+
+    codex_len = match_rating_codex_into(str, len, codex);
+    return match_rating_codex_pack(codex, codex_len);
+}
+
+void match_rating_codex_many(const JFISH_UNICODE *const *strs, const int *lens, size_t count, uint64_t *codexes) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        codexes[i] = match_rating_codex_packed(strs[i], lens[i]);
+    }
+}
+
+#define CODEX_CHAR(packed, i) (((packed) >> (8 * (i))) & 0xFF)
+
+int match_rating_comparison_packed(uint64_t codex1, uint64_t codex2) {
+    int len1 = (int)(codex1 >> 48), len2 = (int)(codex2 >> 48);
+    int i, j;
+    unsigned removed1, removed2, left;
+    uint64_t x, zero;
+
+    if (codex1 == MRA_CODEX_UNPACKABLE || codex2 == MRA_CODEX_UNPACKABLE) {
+        return -2;
+    }
+    if (len1 - len2 >= 3 || len2 - len1 >= 3 || (!len1 && !len2)) {
+        return -1;
+    }
+
+    // the characters equal at the same position, as the high bit of every
+    // zero byte of the difference gathered into the low bits
+    x = codex1 ^ codex2;
+    zero = ~(((x & BYTES_LOW7) + BYTES_LOW7) | x | BYTES_LOW7);
+    removed1 = (unsigned)(((zero & BYTES_HIGH) * 0x0002040810204081ULL) >> 56);
+    removed1 &= (1u << MIN(len1, len2)) - 1;
+    removed2 = removed1;
+
+    // then pairs from the right, never reaching the first characters
+    i = len1 - 1;
+    j = len2 - 1;
+    while (i > 0 && j > 0) {
+        if (removed1 & (1u << i)) {
+            i--;
+            continue;
+        }
+        if (removed2 & (1u << j)) {
+            j--;
+            continue;
+        }
+        if (CODEX_CHAR(codex1, i) == CODEX_CHAR(codex2, j)) {
+            removed1 |= 1u << i;
+            removed2 |= 1u << j;
+        }
+        i--;
+        j--;
+    }
+
+    if (len1 > len2) {
+        left = ~removed1 & ((1u << len1) - 1);
+    } else {
+        left = ~removed2 & ((1u << len2) - 1);
+    }
+    return match_rating(len1, len2, bit_popcount64(left));
+}
+
+void match_rating_comparison_packed_many(uint64_t codex, const uint64_t *codexes, size_t count, signed char *results) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        results[i] = (signed char)match_rating_comparison_packed(codex, codexes[i]);
+    }
+}
@@ -1,191 +1,264 @@
 #include "jellyfish.h"
 #include <stdlib.h>
 #include <ctype.h>
-#include <string.h>
 
 #define ISVOWEL(a) ((a) == 'A' || (a) == 'E' || (a) == 'I' || (a) == 'O' || (a) == 'U')
 
-JFISH_UNICODE *nysiis(const JFISH_UNICODE *str, int len) {
-    JFISH_UNICODE c1, c2, c3;
-    JFISH_UNICODE *copy = NULL;
-    JFISH_UNICODE *code = NULL;
-    JFISH_UNICODE *p, *cp;
+#ifdef _MSC_VER
+#define INLINE __inline
+#else
+#define INLINE inline
+#endif
 
-    copy = malloc((len + 1) * sizeof(JFISH_UNICODE));
-    if (!copy) {
-        return NULL;
-    }
-    memcpy(copy, str, (len+1) * sizeof(JFISH_UNICODE));
+/* The input as the steps below see it: upper cased, with steps 1 and 2
+   applied to its first three and last two characters.  Nothing is copied,
+   the rewritten ends are kept on the side. */
+struct nysiis_input {
+    const JFISH_UNICODE *str;
+    int len;
+    JFISH_UNICODE head[3];
+    JFISH_UNICODE tail[2];
+};
 
-    if (!*copy) {
-        free(copy);
-        return calloc(1, sizeof(JFISH_UNICODE));
+static INLINE JFISH_UNICODE upper(JFISH_UNICODE c)
+{
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 'A';
     }
+    return c < 128 ? c : toupper(c);
+}
 
-    code = calloc(len + 1, sizeof(JFISH_UNICODE));
-    if (!code) {
-        free(copy);
-        return NULL;
+/* Character i of the input, NUL past its end. */
+static INLINE JFISH_UNICODE at(const struct nysiis_input *in, int i)
+{
+    if (i >= in->len) {
+        return '\0';
+    }
+    if (i >= in->len - 2) {
+        return in->tail[i - (in->len - 2)];
     }
+    if (i < 3) {
+        return in->head[i];
+    }
+    return upper(in->str[i]);
+}
 
-    // Convert to upper case first
-    cp = p = copy;
-    while(*p) {
-        *(cp++) = toupper(*(p++));
+static void nysiis_input_init(struct nysiis_input *in, const JFISH_UNICODE *str, int len)
+{
+    JFISH_UNICODE *head = in->head;
+    JFISH_UNICODE *tail = in->tail;
+    JFISH_UNICODE c1, c2;
+    int i, j;
+
+    in->str = str;
+    in->len = len;
+    for (i = 0; i < 3; i++) {
+        head[i] = i < len ? upper(str[i]) : '\0';
     }
 
     // Step 1
-    if (len >= 3 && copy[0] == 'M' && copy[1] == 'A' && copy[2] == 'C') {
-        copy[1] = 'C';
-    } else if (len >= 2 && copy[0] == 'K' && copy[1] == 'N') {
-        copy[0] = 'N';
-    } else if (len >= 1 && copy[0] == 'K') {
-        copy[0] = 'C';
-    } else if (len >= 2 && copy[0] == 'P' && (copy[1] == 'H' || copy[1] == 'F')) {
-        copy[0] = 'F';
-        copy[1] = 'F';
-    } else if (len >= 3 && copy[0] == 'S' && copy[1] == 'C' && copy[2] == 'H') {
-        copy[1] = 'S';
-        copy[2] = 'S';
+    if (len >= 3 && head[0] == 'M' && head[1] == 'A' && head[2] == 'C') {
+        head[1] = 'C';
+    } else if (len >= 2 && head[0] == 'K' && head[1] == 'N') {
+        head[0] = 'N';
+    } else if (len >= 1 && head[0] == 'K') {
+        head[0] = 'C';
+    } else if (len >= 2 && head[0] == 'P' && (head[1] == 'H' || head[1] == 'F')) {
+        head[0] = 'F';
+        head[1] = 'F';
+    } else if (len >= 3 && head[0] == 'S' && head[1] == 'C' && head[2] == 'H') {
+        head[1] = 'S';
+        head[2] = 'S';
+    }
+
+    for (i = 0; i < 2; i++) {
+        j = len - 2 + i;
+        tail[i] = j < 0 ? '\0' : j < 3 ? head[j] : upper(str[j]);
     }
 
     // Step 2
-    c1 = copy[len - 1];
+    c1 = tail[1];
+    c2 = tail[0];
     if (c1 == 'E') {
-        c2 = copy[len - 2];
         if (c2 == 'E' || c2 == 'I') {
-            copy[len - 1] = ' ';
-            copy[len - 2] = 'Y';
+            tail[1] = ' ';
+            tail[0] = 'Y';
         }
     } else if (c1 == 'T') {
-        c2 = copy[len - 2];
         if (c2 == 'D' || c2 == 'R' || c2 == 'N') {
-            copy[len - 1] = ' ';
-            copy[len - 2] = 'D';
+            tail[1] = ' ';
+            tail[0] = 'D';
         }
     } else if (c1 == 'D') {
-        c2 = copy[len - 2];
         if (c2 == 'R' || c2 == 'N') {
-            copy[len - 1] = ' ';
-            copy[len - 2] = 'D';
+            tail[1] = ' ';
+            tail[0] = 'D';
         }
     }
+}
 
-    cp = code;
-    p = copy;
+int nysiis_into(const JFISH_UNICODE *str, int len, int max_len, JFISH_UNICODE *code)
+{
+    struct nysiis_input in;
+    JFISH_UNICODE c1, c2, c3;
+    int p, cp;
+
+    if (!len || !*str) {
+        code[0] = '\0';
+        return 0;
+    }
+
+    nysiis_input_init(&in, str, len);
 
     // Step 3
-    *(cp++) = *(p++);
+    code[0] = at(&in, 0);
+    cp = 1;
 
-    while ((c1 = *p)) {
-        if (c1 == ' ') {
-            break;
+    for (p = 1; (c1 = at(&in, p)) && c1 != ' '; p++) {
+        // steps 7 and 9 only rewrite the last three characters, anything
+        // before them is final
+        if (max_len >= 0 && cp >= max_len + 3) {
+            code[max_len] = '\0';
+            return max_len;
         }
 
         // Step 5
         switch(c1) {
         case 'E':
-            if ((*(p + 1)) == 'V') {
-                *cp = 'A';
-                *(++cp) = 'F';
-                ++p;
-                break;
+            if (at(&in, p + 1) == 'V') {
+                code[cp] = 'A';
+                code[++cp] = 'F';
+                p++;
+            } else {
+                code[cp] = 'A';
             }
+            break;
         case 'A':
         case 'I':
         case 'O':
         case 'U':
-            *cp = 'A';
+            code[cp] = 'A';
             break;
         case 'Q':
-            *cp = 'G';
+            code[cp] = 'G';
             break;
         case 'Z':
-            *cp = 'S';
+            code[cp] = 'S';
             break;
         case 'M':
-            *cp = 'N';
+            code[cp] = 'N';
             break;
         case 'K':
-            if ((*(p + 1)) == 'N') {
-                *cp = 'N';
+            if (at(&in, p + 1) == 'N') {
+                code[cp] = 'N';
             } else {
-                *cp = 'C';
+                code[cp] = 'C';
             }
             break;
         case 'S':
-            if ((*(p + 1)) == 'C' && (*(p + 2)) == 'H') {
-                *(cp++) = 'S';
-                *(cp++) = 'S';
-                *cp = 'S';
+            if (at(&in, p + 1) == 'C' && at(&in, p + 2) == 'H') {
+                code[cp++] = 'S';
+                code[cp++] = 'S';
+                code[cp] = 'S';
                 p += 2;
             } else {
-                *cp = 'S';
+                code[cp] = 'S';
             }
             break;
         case 'P':
-            if ((*(p + 1)) == 'H') {
-                *cp = 'F';
-                *(++cp) = 'F';
+            if (at(&in, p + 1) == 'H') {
+                code[cp] = 'F';
+                code[++cp] = 'F';
                 p++;
             } else {
-                *cp = 'P';
+                code[cp] = 'P';
             }
             break;
         case 'H':
-            c2 = (*(p + 1));
-            c3 = (*(p - 1));
+            c2 = at(&in, p + 1);
+            c3 = at(&in, p - 1);
             if (!ISVOWEL(c2) || !ISVOWEL(c3)) {
                 if ISVOWEL(c3) {
-                    *cp = 'A';
+                    code[cp] = 'A';
                 } else {
-                    *cp = c3;
+                    code[cp] = c3;
                 }
             } else {
-                *cp = 'H';
+                code[cp] = 'H';
             }
             break;
         case 'W':
-            c2 = (*(p - 1));
+            c2 = at(&in, p - 1);
             if (ISVOWEL(c2)) {
-                *cp = c2;
+                code[cp] = c2;
             } else {
-                *cp = 'W';
+                code[cp] = 'W';
             }
             break;
         default:
-            *cp = (c1);
+            code[cp] = c1;
         }
 
         // Step 6
-        if (*cp != *(cp - 1)) {
+        if (code[cp] != code[cp - 1]) {
             cp++;
         }
-
-        p++;
     }
 
-    *cp = '\0';
+    code[cp] = '\0';
 
     // Step 7
-    // (cp-1 != code) checks are to make sure we don't remove the last char from code
-    c1 = *(cp - 1);
-    if (c1 == 'S' && (cp-1) != code) {
-        *(--cp) = '\0';
+    // (cp - 1 != 0) checks are to make sure we don't remove the last char from code
+    c1 = code[cp - 1];
+    if (c1 == 'S' && cp - 1 != 0) {
+        code[--cp] = '\0';
     } else if (c1 == 'Y') {
-        if (*(cp - 2) == 'A') {
-            *(--cp) = '\0';
-            *(--cp) = 'Y';
+        if (cp >= 2 && code[cp - 2] == 'A') {
+            code[--cp] = '\0';
+            code[--cp] = 'Y';
         }
     }
 
     // There is no step 8!
 
     // Step 9
-    if (*(cp - 1) == 'A' && (cp-1) != code) {
-        *(cp - 1) = '\0';
+    if (cp >= 2 && code[cp - 1] == 'A') {
+        code[cp - 1] = '\0';
+    }
+
+    // step 9 may cut the code short of cp
+    for (cp = 0; code[cp]; cp++);
+    if (max_len >= 0 && cp > max_len) {
+        code[max_len] = '\0';
+        cp = max_len;
+    }
+    return cp;
+}
+
+JFISH_UNICODE *nysiis(const JFISH_UNICODE *str, int len) {
+    JFISH_UNICODE *code = malloc(NYSIIS_SIZE(len, -1) * sizeof(JFISH_UNICODE));
+
+    if (!code) {
+        return NULL;
     }
 
-    free(copy);
+    nysiis_into(str, len, -1, code);
     return code;
 }
+
+size_t nysiis_many(const JFISH_UNICODE *const *strs, const int *lens, size_t count,
+                   int max_len, JFISH_UNICODE *codes, size_t *offsets)
+{
+    size_t i, pos = 0;
+
+    // each code's terminator is overwritten by the next
+    for (i = 0; i < count; i++) {
+        offsets[i] = pos;
+        pos += nysiis_into(strs[i], lens[i], max_len, codes + pos);
+    }
+    offsets[count] = pos;
+    if (!count) {
+        codes[0] = '\0';
+    }
+    return pos;
+}
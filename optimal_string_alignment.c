@@ -0,0 +1,230 @@
+#include "jellyfish.h"
+#include "pattern_match.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+
+  Optimal string alignment, also known as the restricted Damerau-Levenshtein
+  distance: Levenshtein plus transpositions of two adjacent characters, where
+  no substring may be edited more than once.  Unlike
+  damerau_levenshtein_distance it never needs rows further back than the
+  previous two, which is what allows a bit-parallel kernel.
+
+*/
+
+/* rows up to this many cells are kept on the stack instead of the heap */
+#define OSA_STACK_ROW 128
+
+/* Three-row DP, used when the pattern's alphabet is too large for match
+   bitmasks. */
+static int osa_rows(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len)
+{
+    size_t rows = s1_len + 1;
+    size_t cols = s2_len + 1;
+    size_t i, j;
+
+    unsigned stack_rows[3 * OSA_STACK_ROW];
+    unsigned *buf = stack_rows;
+    unsigned *prev2, *prev, *row, *tmp;
+    unsigned cost, result;
+
+    if (cols > OSA_STACK_ROW) {
+        buf = malloc(3 * cols * sizeof(unsigned));
+        if (!buf) {
+            return -1;
+        }
+    }
+    prev2 = buf;
+    prev = buf + cols;
+    row = buf + 2 * cols;
+
+    for (j = 0; j < cols; j++) {
+        prev[j] = j;
+    }
+
+    for (i = 1; i < rows; i++) {
+        row[0] = i;
+        for (j = 1; j < cols; j++) {
+            cost = s1[i - 1] != s2[j - 1];
+            row[j] = MIN(MIN(prev[j], row[j - 1]) + 1, prev[j - 1] + cost);
+            if (i > 1 && j > 1 && s1[i - 1] == s2[j - 2] && s1[i - 2] == s2[j - 1]) {
+                row[j] = MIN(row[j], prev2[j - 2] + 1);
+            }
+        }
+        tmp = prev2; prev2 = prev; prev = row; row = tmp;
+    }
+
+    result = prev[cols - 1];
+
+    if (buf != stack_rows) {
+        free(buf);
+    }
+
+    return result;
+}
+
+/* Hyyrö's bit-parallel OSA for patterns of at most 64 code points: Myers'
+   kernel where TR marks the positions at which a transposition with the
+   previous text character resets the vertical delta. */
+static int osa_hyyro64(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len)
+{
+    uint64_t VP = ~(uint64_t)0;
+    uint64_t VN = 0;
+    uint64_t D0 = 0;
+    uint64_t PM_prev = 0;
+    uint64_t last = (uint64_t)1 << (pm->len - 1);
+    uint64_t PM, TR, HP, HN;
+    int score = pm->len;
+    int j;
+
+    for (j = 0; j < text_len; j++) {
+        PM = *pattern_match_get(pm, text[j]);
+        TR = (((~D0) & PM) << 1) & PM_prev;
+        D0 = (((PM & VP) + VP) ^ VP) | PM | VN | TR;
+        HP = VN | ~(D0 | VP);
+        HN = D0 & VP;
+
+        score += (HP & last) != 0;
+        score -= (HN & last) != 0;
+
+        HP = (HP << 1) | 1;
+        HN = HN << 1;
+        VP = HN | ~(D0 | HP);
+        VN = HP & D0;
+        PM_prev = PM;
+    }
+
+    return score;
+}
+
+/* The blocked version.  Besides the horizontal carries, the transposition
+   term of a word needs the top bit of the previous word's D0 and match
+   mask, so every word keeps VP, VN, D0 and PM of the previous column.
+   vectors is scratch space for 4 * pm->words words. */
+static int osa_hyyro_blocked(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len, uint64_t *vectors)
+{
+    int words = pm->words;
+    uint64_t *VP = vectors;
+    uint64_t *VN = vectors + words;
+    uint64_t *D0 = vectors + 2 * words;
+    uint64_t *PM_prev = vectors + 3 * words;
+    uint64_t last = (uint64_t)1 << ((pm->len - 1) % PATTERN_MATCH_WORD_BITS);
+    uint64_t X, TR, D, HP, HN, HP_carry, HN_carry, carry;
+    uint64_t D0_below, PM_below;
+    const uint64_t *PM;
+    int score = pm->len;
+    int j, w;
+
+    for (w = 0; w < words; w++) {
+        VP[w] = ~(uint64_t)0;
+        VN[w] = 0;
+        D0[w] = 0;
+        PM_prev[w] = 0;
+    }
+
+    for (j = 0; j < text_len; j++) {
+        PM = pattern_match_get(pm, text[j]);
+        HP_carry = 1;
+        HN_carry = 0;
+        /* the word below's D0 from the previous column and match mask from
+           this one */
+        D0_below = 0;
+        PM_below = 0;
+
+        for (w = 0; w < words; w++) {
+            TR = ((((~D0[w]) & PM[w]) << 1) | (((~D0_below) & PM_below) >> 63)) & PM_prev[w];
+            X = PM[w] | HN_carry;
+            D = (((X & VP[w]) + VP[w]) ^ VP[w]) | X | VN[w] | TR;
+            HP = VN[w] | ~(D | VP[w]);
+            HN = D & VP[w];
+
+            if (w == words - 1) {
+                score += (HP & last) != 0;
+                score -= (HN & last) != 0;
+            }
+
+            carry = HP >> 63;
+            HP = (HP << 1) | HP_carry;
+            HP_carry = carry;
+
+            carry = HN >> 63;
+            HN = (HN << 1) | HN_carry;
+            HN_carry = carry;
+
+            D0_below = D0[w];
+            PM_below = PM[w];
+
+            VP[w] = HN | ~(D | HP);
+            VN[w] = HP & D;
+            D0[w] = D;
+            PM_prev[w] = PM[w];
+        }
+    }
+
+    return score;
+}
+
+/* The distance between the pattern pm was built from and text, for callers
+   holding on to a pattern's match table.  The pattern must not be empty. */
+int optimal_string_alignment_distance_pattern(const struct pattern_match *pm, const JFISH_UNICODE *text, int text_len)
+{
+    uint64_t *vectors;
+    int result;
+
+    if (!text_len) {
+        return pm->len;
+    }
+
+    if (pm->words == 1) {
+        return osa_hyyro64(pm, text, text_len);
+    }
+
+    vectors = malloc(4 * pm->words * sizeof(uint64_t));
+    if (!vectors) {
+        return -1;
+    }
+    result = osa_hyyro_blocked(pm, text, text_len, vectors);
+    free(vectors);
+
+    return result;
+}
+
+int optimal_string_alignment_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len)
+{
+    const JFISH_UNICODE *tmp;
+    struct pattern_match pm;
+    int n, result;
+
+    /* common affixes never contribute to the distance */
+    while (s1_len && s2_len && *s1 == *s2) {
+        s1++; s2++;
+        s1_len--; s2_len--;
+    }
+    while (s1_len && s2_len && s1[s1_len - 1] == s2[s2_len - 1]) {
+        s1_len--; s2_len--;
+    }
+
+    /* the distance is symmetric, use the shorter string as the pattern */
+    if (s2_len > s1_len) {
+        tmp = s1; s1 = s2; s2 = tmp;
+        n = s1_len; s1_len = s2_len; s2_len = n;
+    }
+
+    if (!s2_len) {
+        return s1_len;
+    }
+
+    switch (pattern_match_init(&pm, s2, s2_len)) {
+    case 0:
+        return -1;
+    case -1:
+        return osa_rows(s1, s1_len, s2, s2_len);
+    }
+
+    result = optimal_string_alignment_distance_pattern(&pm, s1, s1_len);
+    pattern_match_free(&pm);
+
+    return result;
+}
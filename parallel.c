@@ -0,0 +1,89 @@
+#include "parallel.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* parts run on a worker thread, more than this run on the caller */
+#define PARALLEL_MAX_PARTS 256
+
+struct parallel_part {
+    parallel_fn fn;
+    void *arg;
+    int part;
+    int parts;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI parallel_start(LPVOID ptr)
+#else
+static void *parallel_start(void *ptr)
+#endif
+{
+    struct parallel_part *p = ptr;
+
+    p->fn(p->arg, p->part, p->parts);
+    return 0;
+}
+
+void parallel_run(parallel_fn fn, void *arg, int parts)
+{
+    struct parallel_part work[PARALLEL_MAX_PARTS];
+    int started[PARALLEL_MAX_PARTS];
+#ifdef _WIN32
+    HANDLE threads[PARALLEL_MAX_PARTS];
+#else
+    pthread_t threads[PARALLEL_MAX_PARTS];
+#endif
+    int i;
+
+    for (i = 1; i < parts && i < PARALLEL_MAX_PARTS; i++) {
+        work[i].fn = fn;
+        work[i].arg = arg;
+        work[i].part = i;
+        work[i].parts = parts;
+#ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, parallel_start, &work[i], 0, NULL);
+        started[i] = threads[i] != NULL;
+#else
+        started[i] = pthread_create(&threads[i], NULL, parallel_start, &work[i]) == 0;
+#endif
+    }
+
+    fn(arg, 0, parts);
+    for (i = 1; i < parts; i++) {
+        if (i >= PARALLEL_MAX_PARTS || !started[i]) {
+            fn(arg, i, parts);
+        }
+    }
+
+    for (i = 1; i < parts && i < PARALLEL_MAX_PARTS; i++) {
+        if (!started[i]) {
+            continue;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+}
+
+int parallel_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+#endif
+}
@@ -0,0 +1,23 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+/*
+
+  A minimal fork/join for the batch kernels, on pthreads or Win32 threads.
+
+  The work is split into parts by the caller; parallel_run calls
+  fn(arg, part, parts) once for every part, each on a thread of its own,
+  and returns once all of them are done.  The calling thread runs part 0
+  itself, and any part whose thread fails to start, so every part runs
+  even when no thread can be created.
+
+*/
+
+typedef void (*parallel_fn)(void *arg, int part, int parts);
+
+void parallel_run(parallel_fn fn, void *arg, int parts);
+
+/* The number of online CPUs, at least 1. */
+int parallel_cpu_count(void);
+
+#endif
@@ -0,0 +1,145 @@
+#include "pattern_match.h"
+#include <string.h>
+#include <stdlib.h>
+
+static void use_inline_keys(struct pattern_match *pm)
+{
+    pm->slots = PATTERN_MATCH_INLINE_SLOTS;
+    pm->keys = pm->inline_keys;
+    pm->key_rows = pm->inline_key_rows;
+    memset(pm->keys, 0, sizeof(pm->inline_keys));
+}
+
+static INLINE int assign_row(struct pattern_match *pm, JFISH_UNICODE c)
+{
+    unsigned i;
+
+    if ((uint32_t)c < 256) {
+        if (!pm->ascii_row[c]) {
+            pm->ascii_row[c] = pm->rows++;
+        }
+        return pm->ascii_row[c];
+    }
+
+    if (!pm->slots) {
+        /* only single word patterns size their hash lazily; at most 64 keys
+           always fit in the inline table */
+        use_inline_keys(pm);
+    }
+    for (i = pattern_match_hash(c, pm->slots); pm->keys[i]; i = (i + 1) & (pm->slots - 1)) {
+        if (pm->keys[i] == c) {
+            return pm->key_rows[i];
+        }
+    }
+    pm->keys[i] = c;
+    pm->key_rows[i] = pm->rows++;
+    return pm->key_rows[i];
+}
+
+int pattern_match_init(struct pattern_match *pm, const JFISH_UNICODE *str, int len)
+{
+    int i, row, rows, wide = 0;
+    size_t table_words;
+    uint64_t *mask;
+
+    pm->len = len;
+    pm->words = (len + PATTERN_MATCH_WORD_BITS - 1) / PATTERN_MATCH_WORD_BITS;
+    pm->rows = 1;
+    pm->slots = 0;
+    pm->keys = NULL;
+    pm->key_rows = NULL;
+    memset(pm->ascii_row, 0, sizeof(pm->ascii_row));
+
+    if (pm->words <= 1) {
+        /* single pass: rows are zeroed as they are handed out */
+        pm->words = 1;
+        pm->masks = pm->inline_masks;
+        pm->masks[0] = 0;
+        for (i = 0; i < len; i++) {
+            rows = pm->rows;
+            row = assign_row(pm, str[i]);
+            if (row == rows) {
+                pm->masks[row] = 0;
+            }
+            pm->masks[row] |= (uint64_t)1 << i;
+        }
+        return 1;
+    }
+
+    pm->masks = NULL;
+    for (i = 0; i < len; i++) {
+        if ((uint32_t)str[i] >= 256) {
+            wide++;
+        }
+    }
+
+    if (wide) {
+        /* keep the hash at most half full */
+        for (pm->slots = 16; pm->slots < 2 * (unsigned)wide; pm->slots *= 2);
+        if (pm->slots <= PATTERN_MATCH_INLINE_SLOTS) {
+            use_inline_keys(pm);
+        } else {
+            pm->keys = calloc(pm->slots, sizeof(JFISH_UNICODE));
+            pm->key_rows = malloc(pm->slots * sizeof(int));
+            if (!pm->keys || !pm->key_rows) {
+                free(pm->keys);
+                free(pm->key_rows);
+                return 0;
+            }
+        }
+    }
+
+    for (i = 0; i < len; i++) {
+        assign_row(pm, str[i]);
+        if ((size_t)pm->rows * pm->words > PATTERN_MATCH_MAX_WORDS) {
+            pattern_match_free(pm);
+            return -1;
+        }
+    }
+
+    table_words = (size_t)pm->rows * pm->words;
+    if (table_words <= PATTERN_MATCH_WORD_BITS + 1) {
+        pm->masks = pm->inline_masks;
+        memset(pm->masks, 0, table_words * sizeof(uint64_t));
+    } else {
+        pm->masks = calloc(table_words, sizeof(uint64_t));
+        if (!pm->masks) {
+            pattern_match_free(pm);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < len; i++) {
+        mask = pm->masks + (size_t)pattern_match_row(pm, str[i]) * pm->words;
+        mask[i / PATTERN_MATCH_WORD_BITS] |= (uint64_t)1 << (i % PATTERN_MATCH_WORD_BITS);
+    }
+
+    return 1;
+}
+
+void pattern_match_counts(const struct pattern_match *pm, int *counts)
+{
+    const uint64_t *mask = pm->masks;
+    int row, w;
+
+    for (row = 0; row < pm->rows; row++) {
+        counts[row] = 0;
+        for (w = 0; w < pm->words; w++) {
+            counts[row] += bit_popcount64(*mask++);
+        }
+    }
+}
+
+void pattern_match_free(struct pattern_match *pm)
+{
+    if (pm->keys != pm->inline_keys) {
+        free(pm->keys);
+        free(pm->key_rows);
+    }
+    if (pm->masks != pm->inline_masks) {
+        free(pm->masks);
+    }
+    pm->keys = NULL;
+    pm->key_rows = NULL;
+    pm->masks = NULL;
+}
@@ -0,0 +1,121 @@
+#ifndef _PATTERN_MATCH_H_
+#define _PATTERN_MATCH_H_
+
+#include <stdint.h>
+#include "jellyfish.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifndef INLINE
+#ifdef _MSC_VER
+#define INLINE __inline
+#else
+#define INLINE inline
+#endif
+#endif
+
+/*
+
+  Match bitmasks for the bit-parallel kernels.
+
+  For every distinct code point c of a pattern p, bit i of the mask for c is
+  set when p[i] == c.  Patterns longer than 64 code points are split into
+  64-bit words, word w covering p[64 * w] ... p[64 * w + 63].
+
+  Masks are stored as rows of `words` uint64_t.  Row 0 is all zeroes and is
+  what any code point absent from the pattern maps to, so lookups never
+  branch on "not found".  Code points below 256 find their row through a
+  direct table, everything else through a small open addressing hash.
+
+  Patterns of up to 64 code points are held entirely inside the struct, so
+  the common short-string case never touches the heap.  Since it may point
+  into itself, an initialised struct must not be copied.
+
+*/
+
+#define PATTERN_MATCH_WORD_BITS 64
+#define PATTERN_MATCH_INLINE_SLOTS 128
+
+/* Upper bound on the size of the mask table, in words.  Patterns drawn from
+   a huge alphabet would need rows * words ~ len^2 / 64 words; callers fall
+   back to a DP kernel when pattern_match_init reports this. */
+#define PATTERN_MATCH_MAX_WORDS (1 << 20)
+
+struct pattern_match {
+    int len;
+    int words;
+    int rows;
+    uint16_t ascii_row[256];
+
+    unsigned slots;
+    JFISH_UNICODE *keys;
+    int *key_rows;
+    uint64_t *masks;
+
+    JFISH_UNICODE inline_keys[PATTERN_MATCH_INLINE_SLOTS];
+    int inline_key_rows[PATTERN_MATCH_INLINE_SLOTS];
+    uint64_t inline_masks[PATTERN_MATCH_WORD_BITS + 1];
+};
+
+/* Returns 1 on success, 0 on failed malloc and -1 when the pattern's
+   alphabet is too large for PATTERN_MATCH_MAX_WORDS.  On failure nothing
+   needs to be freed. */
+int pattern_match_init(struct pattern_match *pm, const JFISH_UNICODE *str, int len);
+void pattern_match_free(struct pattern_match *pm);
+
+/* How often each row's code point occurs in the pattern, into rows ints. */
+void pattern_match_counts(const struct pattern_match *pm, int *counts);
+
+static INLINE unsigned pattern_match_hash(JFISH_UNICODE c, unsigned slots)
+{
+    return ((uint32_t)c * 2654435761u) & (slots - 1);
+}
+
+static INLINE int pattern_match_row(const struct pattern_match *pm, JFISH_UNICODE c)
+{
+    unsigned i;
+
+    if ((uint32_t)c < 256) {
+        return pm->ascii_row[c];
+    }
+    if (!pm->slots) {
+        return 0;
+    }
+    /* keys >= 256 are never zero, so a zero key marks an empty slot */
+    for (i = pattern_match_hash(c, pm->slots); pm->keys[i]; i = (i + 1) & (pm->slots - 1)) {
+        if (pm->keys[i] == c) {
+            return pm->key_rows[i];
+        }
+    }
+    return 0;
+}
+
+static INLINE const uint64_t *pattern_match_get(const struct pattern_match *pm, JFISH_UNICODE c)
+{
+    return pm->masks + (size_t)pattern_match_row(pm, c) * pm->words;
+}
+
+/* Index of the lowest set bit, x must not be 0. */
+static INLINE int bit_ctz64(uint64_t x)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+static INLINE int bit_popcount64(uint64_t x)
+{
+#ifdef _MSC_VER
+    return (int)__popcnt64(x);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+#endif
@@ -0,0 +1,556 @@
+#include "jellyfish.h"
+#include "parallel.h"
+#include <string.h>
+
+/*
+
+  An index from phonetic keys to the records that have them, for blocking.
+
+  Every record is encoded with each of the index's encoders, and its key
+  under an encoder is the bytes of the code followed by the encoder's
+  number.  Keys are numbered in an open addressing hash, their bytes kept
+  back to back in a pool, and the records of every key are one run of a
+  single array of postings, in record order.
+
+  A build splits the records into runs encoded on several threads, each
+  into a hash of its own, noting the local key of every record and encoder.
+  The local hashes are then merged into the index's, which hands every
+  local key its place in the postings of the key, and the threads write
+  their postings there.  Runs are in record order, so every key's postings
+  come out sorted without sorting anything.
+
+*/
+
+#define KEY_TABLE_MIN_SLOTS 16
+/* records a thread should have to itself before another one pays off */
+#define PHONETIC_INDEX_THREAD_RECORDS 4096
+#define PHONETIC_INDEX_MAX_THREADS 64
+
+#define NO_KEY UINT32_MAX
+
+struct index_key {
+    uint64_t hash;
+    size_t bytes;
+    uint32_t len;
+    // the key's first posting; while building, a local key's global key
+    // and then where its run's postings go
+    uint32_t start;
+    uint32_t count;
+};
+
+struct key_table {
+    size_t slots;
+    // key number + 1, 0 for an empty slot
+    uint32_t *slot_keys;
+    struct index_key *keys;
+    uint32_t count;
+    uint32_t capacity;
+    unsigned char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+};
+
+struct phonetic_index {
+    int encoders[PHONETIC_ENCODERS];
+    int encoder_count;
+    size_t records;
+    struct key_table keys;
+    uint32_t *postings;
+};
+
+/* Scratch space a key is encoded into. */
+struct key_buf {
+    unsigned char *buf;
+    size_t cap;
+};
+
+static uint64_t key_hash(const unsigned char *bytes, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void key_table_free(struct key_table *table)
+{
+    free(table->slot_keys);
+    free(table->keys);
+    free(table->pool);
+    memset(table, 0, sizeof(*table));
+}
+
+static int key_table_grow(struct key_table *table)
+{
+    size_t i, j;
+    size_t slots = table->slots ? table->slots * 2 : KEY_TABLE_MIN_SLOTS;
+    uint32_t *slot_keys = calloc(slots, sizeof(uint32_t));
+    uint32_t k;
+
+    if (!slot_keys) {
+        return 0;
+    }
+
+    for (i = 0; i < table->slots; i++) {
+        if (!(k = table->slot_keys[i])) {
+            continue;
+        }
+        for (j = table->keys[k - 1].hash & (slots - 1); slot_keys[j]; j = (j + 1) & (slots - 1));
+        slot_keys[j] = k;
+    }
+
+    free(table->slot_keys);
+    table->slot_keys = slot_keys;
+    table->slots = slots;
+    return 1;
+}
+
+/* The number of a key, NO_KEY if the table does not hold it. */
+static uint32_t key_table_find(const struct key_table *table, uint64_t hash,
+                               const unsigned char *bytes, size_t len)
+{
+    const struct index_key *key;
+    size_t i;
+    uint32_t k;
+
+    if (!table->slots) {
+        return NO_KEY;
+    }
+    for (i = hash & (table->slots - 1); (k = table->slot_keys[i]); i = (i + 1) & (table->slots - 1)) {
+        key = &table->keys[k - 1];
+        if (key->hash == hash && key->len == len && !memcmp(table->pool + key->bytes, bytes, len)) {
+            return k - 1;
+        }
+    }
+    return NO_KEY;
+}
+
+/* The number of a key, added with a count of 0 if it is new.  Returns
+   NO_KEY on failed malloc. */
+static uint32_t key_table_add(struct key_table *table, uint64_t hash,
+                              const unsigned char *bytes, size_t len)
+{
+    struct index_key *keys;
+    unsigned char *pool;
+    size_t i, cap;
+    uint32_t k = key_table_find(table, hash, bytes, len);
+
+    if (k != NO_KEY) {
+        return k;
+    }
+
+    // keep the hash at most half full
+    if (2 * ((size_t)table->count + 1) > table->slots && !key_table_grow(table)) {
+        return NO_KEY;
+    }
+    if (table->count == table->capacity) {
+        if (table->capacity == NO_KEY - 1) {
+            return NO_KEY;
+        }
+        cap = table->capacity ? 2 * (size_t)table->capacity : KEY_TABLE_MIN_SLOTS;
+        cap = MIN(cap, NO_KEY - 1);
+        keys = realloc(table->keys, cap * sizeof(struct index_key));
+        if (!keys) {
+            return NO_KEY;
+        }
+        table->keys = keys;
+        table->capacity = (uint32_t)cap;
+    }
+    if (table->pool_len + len > table->pool_cap) {
+        cap = table->pool_cap ? table->pool_cap : 256;
+        while (cap < table->pool_len + len) {
+            cap *= 2;
+        }
+        pool = realloc(table->pool, cap);
+        if (!pool) {
+            return NO_KEY;
+        }
+        table->pool = pool;
+        table->pool_cap = cap;
+    }
+
+    k = table->count++;
+    table->keys[k].hash = hash;
+    table->keys[k].bytes = table->pool_len;
+    table->keys[k].len = (uint32_t)len;
+    table->keys[k].start = 0;
+    table->keys[k].count = 0;
+    memcpy(table->pool + table->pool_len, bytes, len);
+    table->pool_len += len;
+
+    for (i = hash & (table->slots - 1); table->slot_keys[i]; i = (i + 1) & (table->slots - 1));
+    table->slot_keys[i] = k + 1;
+    return k;
+}
+
+static int key_buf_reserve(struct key_buf *kb, size_t size)
+{
+    unsigned char *buf;
+
+    if (size <= kb->cap) {
+        return 1;
+    }
+    buf = realloc(kb->buf, size);
+    if (!buf) {
+        return 0;
+    }
+    kb->buf = buf;
+    kb->cap = size;
+    return 1;
+}
+
+/* Encodes a record into kb, returning the length of its key, or -1 on
+   failed malloc.  nfkd is the NFKD form of str, UTF-8 encoded; soundex and
+   metaphone work on that, NYSIIS and match rating on str itself. */
+static long encode_key(struct key_buf *kb, int encoder, const char *nfkd,
+                       const JFISH_UNICODE *str, int len)
+{
+    char *code;
+    size_t n;
+
+    switch (encoder) {
+    case PHONETIC_SOUNDEX:
+        if (!key_buf_reserve(kb, SOUNDEX_SIZE + 1)) {
+            return -1;
+        }
+        soundex_into(nfkd, (char*)kb->buf);
+        n = strlen((char*)kb->buf);
+        break;
+    case PHONETIC_METAPHONE:
+        code = metaphone(nfkd);
+        if (!code) {
+            return -1;
+        }
+        n = strlen(code);
+        if (!key_buf_reserve(kb, n + 1)) {
+            free(code);
+            return -1;
+        }
+        memcpy(kb->buf, code, n);
+        free(code);
+        break;
+    case PHONETIC_NYSIIS:
+        if (!key_buf_reserve(kb, NYSIIS_SIZE(len, -1) * sizeof(JFISH_UNICODE) + 1)) {
+            return -1;
+        }
+        n = nysiis_into(str, len, -1, (JFISH_UNICODE*)kb->buf) * sizeof(JFISH_UNICODE);
+        break;
+    default:
+        if (!key_buf_reserve(kb, 7 * sizeof(JFISH_UNICODE) + 1)) {
+            return -1;
+        }
+        n = match_rating_codex_into(str, len, (JFISH_UNICODE*)kb->buf) * sizeof(JFISH_UNICODE);
+    }
+
+    // the code goes first, where it is aligned
+    kb->buf[n] = (unsigned char)encoder;
+    return (long)n + 1;
+}
+
+struct index_build {
+    struct phonetic_index *index;
+    const char *const *nfkd;
+    const JFISH_UNICODE *const *strs;
+    const int *lens;
+    // the local key of every record under every encoder, record by record
+    uint32_t *entries;
+    struct key_table local[PHONETIC_INDEX_MAX_THREADS];
+    int failed[PHONETIC_INDEX_MAX_THREADS];
+};
+
+static void build_encode_part(void *arg, int part, int parts)
+{
+    struct index_build *build = arg;
+    const struct phonetic_index *index = build->index;
+    struct key_table *local = &build->local[part];
+    struct key_buf kb = {NULL, 0};
+    size_t first = index->records * part / parts;
+    size_t last = index->records * (part + 1) / parts;
+    size_t r;
+    uint32_t k;
+    long len;
+    int e;
+
+    for (r = first; r < last; r++) {
+        for (e = 0; e < index->encoder_count; e++) {
+            len = encode_key(&kb, index->encoders[e], build->nfkd ? build->nfkd[r] : NULL,
+                             build->strs ? build->strs[r] : NULL, build->lens ? build->lens[r] : 0);
+            if (len == -1) {
+                goto fail;
+            }
+            k = key_table_add(local, key_hash(kb.buf, len), kb.buf, len);
+            if (k == NO_KEY) {
+                goto fail;
+            }
+            local->keys[k].count++;
+            build->entries[r * index->encoder_count + e] = k;
+        }
+    }
+    free(kb.buf);
+    return;
+
+ fail:
+    free(kb.buf);
+    build->failed[part] = 1;
+}
+
+static void build_fill_part(void *arg, int part, int parts)
+{
+    struct index_build *build = arg;
+    struct phonetic_index *index = build->index;
+    struct index_key *keys = build->local[part].keys;
+    const uint32_t *entry;
+    size_t first = index->records * part / parts;
+    size_t last = index->records * (part + 1) / parts;
+    size_t r;
+    int e;
+
+    for (r = first; r < last; r++) {
+        entry = build->entries + r * index->encoder_count;
+        for (e = 0; e < index->encoder_count; e++) {
+            index->postings[keys[entry[e]].start++] = (uint32_t)r;
+        }
+    }
+}
+
+/* Merges the local hashes into the index's, then gives every local key
+   the place of its run's postings.  Returns 0 on failed malloc. */
+static int build_merge(struct index_build *build, int parts)
+{
+    struct phonetic_index *index = build->index;
+    struct key_table *global = &index->keys;
+    struct index_key *key;
+    uint32_t k, g, start;
+    int part;
+
+    for (part = 0; part < parts; part++) {
+        for (k = 0; k < build->local[part].count; k++) {
+            key = &build->local[part].keys[k];
+            g = key_table_add(global, key->hash, build->local[part].pool + key->bytes, key->len);
+            if (g == NO_KEY) {
+                return 0;
+            }
+            global->keys[g].count += key->count;
+            key->start = g;
+        }
+    }
+
+    for (start = 0, k = 0; k < global->count; k++) {
+        global->keys[k].start = start;
+        start += global->keys[k].count;
+    }
+
+    // start runs ahead through every global key's postings as the runs
+    // claim them, and is put back afterwards
+    for (part = 0; part < parts; part++) {
+        for (k = 0; k < build->local[part].count; k++) {
+            key = &build->local[part].keys[k];
+            g = key->start;
+            key->start = global->keys[g].start;
+            global->keys[g].start += key->count;
+        }
+    }
+    for (k = 0; k < global->count; k++) {
+        global->keys[k].start -= global->keys[k].count;
+    }
+    return 1;
+}
+
+void phonetic_index_free(struct phonetic_index *index)
+{
+    if (!index) {
+        return;
+    }
+    key_table_free(&index->keys);
+    free(index->postings);
+    free(index);
+}
+
+/* Builds an index of count records under every encoder in the encoders
+   bitmask, 1 << PHONETIC_SOUNDEX and so on.  nfkd is only read for
+   soundex and metaphone and strs and lens only for the others, and either
+   may be NULL when not read.  Returns 1, 0 on
+   failed malloc, or -1 when there would be more than UINT32_MAX - 1
+   postings. */
+int phonetic_index_create(struct phonetic_index **out, unsigned encoders,
+        const char *const *nfkd, const JFISH_UNICODE *const *strs, const int *lens,
+        size_t count, int threads)
+{
+    struct phonetic_index *index;
+    struct index_build *build;
+    size_t parts;
+    int e, part, ok = 1;
+
+    *out = NULL;
+    index = calloc(1, sizeof(struct phonetic_index));
+    if (!index) {
+        return 0;
+    }
+    for (e = 0; e < PHONETIC_ENCODERS; e++) {
+        if (encoders & (1u << e)) {
+            index->encoders[index->encoder_count++] = e;
+        }
+    }
+    index->records = count;
+    if (index->encoder_count && count > (NO_KEY - 1) / index->encoder_count) {
+        free(index);
+        return -1;
+    }
+
+    build = calloc(1, sizeof(struct index_build));
+    index->postings = malloc((count * index->encoder_count + 1) * sizeof(uint32_t));
+    if (!build || !index->postings) {
+        free(build);
+        phonetic_index_free(index);
+        return 0;
+    }
+    build->index = index;
+    build->nfkd = nfkd;
+    build->strs = strs;
+    build->lens = lens;
+    build->entries = malloc((count * index->encoder_count + 1) * sizeof(uint32_t));
+    if (!build->entries) {
+        free(build);
+        phonetic_index_free(index);
+        return 0;
+    }
+
+    if (threads <= 0) {
+        threads = parallel_cpu_count();
+    }
+    parts = MIN((size_t)threads, count / PHONETIC_INDEX_THREAD_RECORDS);
+    parts = MIN(parts, PHONETIC_INDEX_MAX_THREADS);
+    if (parts <= 1) {
+        parts = 1;
+        build_encode_part(build, 0, 1);
+    } else {
+        parallel_run(build_encode_part, build, (int)parts);
+    }
+
+    for (part = 0; part < (int)parts; part++) {
+        ok &= !build->failed[part];
+    }
+    if (ok && build_merge(build, (int)parts)) {
+        if (parts == 1) {
+            build_fill_part(build, 0, 1);
+        } else {
+            parallel_run(build_fill_part, build, (int)parts);
+        }
+    } else {
+        ok = 0;
+    }
+
+    for (part = 0; part < (int)parts; part++) {
+        key_table_free(&build->local[part]);
+    }
+    free(build->entries);
+    free(build);
+    if (!ok) {
+        phonetic_index_free(index);
+        return 0;
+    }
+
+    *out = index;
+    return 1;
+}
+
+size_t phonetic_index_count(const struct phonetic_index *index)
+{
+    return index->records;
+}
+
+size_t phonetic_index_keys(const struct phonetic_index *index)
+{
+    return index->keys.count;
+}
+
+/* The memory held, in bytes. */
+size_t phonetic_index_size(const struct phonetic_index *index)
+{
+    return sizeof(struct phonetic_index)
+        + index->keys.slots * sizeof(uint32_t)
+        + index->keys.capacity * sizeof(struct index_key)
+        + index->keys.pool_cap
+        + index->records * index->encoder_count * sizeof(uint32_t);
+}
+
+/* Points *postings at the records that share query's key under one of the
+   index's encoders and returns how many there are, -1 on failed malloc. */
+static long phonetic_index_lookup(const struct phonetic_index *index, int encoder,
+        const char *nfkd, const JFISH_UNICODE *str, int len, const uint32_t **postings)
+{
+    struct key_buf kb = {NULL, 0};
+    const struct index_key *key;
+    long key_len;
+    uint32_t k;
+
+    key_len = encode_key(&kb, encoder, nfkd, str, len);
+    if (key_len == -1) {
+        return -1;
+    }
+    k = key_table_find(&index->keys, key_hash(kb.buf, key_len), kb.buf, key_len);
+    free(kb.buf);
+
+    if (k == NO_KEY) {
+        return 0;
+    }
+    key = &index->keys.keys[k];
+    *postings = index->postings + key->start;
+    return key->count;
+}
+
+/* Sets *results to a new array of the records that share a key with query
+   under any of the index's encoders, in record order, and returns how
+   many there are, or -1 on failed malloc. */
+long phonetic_index_candidates(const struct phonetic_index *index,
+        const char *nfkd, const JFISH_UNICODE *str, int len, uint32_t **results)
+{
+    const uint32_t *lists[PHONETIC_ENCODERS];
+    long lens[PHONETIC_ENCODERS];
+    size_t at[PHONETIC_ENCODERS] = {0};
+    size_t total = 0, found = 0;
+    uint32_t next;
+    int e, lists_count = 0;
+
+    for (e = 0; e < index->encoder_count; e++) {
+        lens[lists_count] = phonetic_index_lookup(index, index->encoders[e], nfkd, str, len, &lists[lists_count]);
+        if (lens[lists_count] == -1) {
+            return -1;
+        }
+        if (lens[lists_count]) {
+            total += lens[lists_count++];
+        }
+    }
+
+    *results = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!*results) {
+        return -1;
+    }
+    if (lists_count == 1) {
+        memcpy(*results, lists[0], total * sizeof(uint32_t));
+        return (long)total;
+    }
+
+    // a merge of the sorted lists that drops repeats
+    for (;;) {
+        next = NO_KEY;
+        for (e = 0; e < lists_count; e++) {
+            if (at[e] < (size_t)lens[e] && lists[e][at[e]] < next) {
+                next = lists[e][at[e]];
+            }
+        }
+        if (next == NO_KEY) {
+            break;
+        }
+        (*results)[found++] = next;
+        for (e = 0; e < lists_count; e++) {
+            if (at[e] < (size_t)lens[e] && lists[e][at[e]] == next) {
+                at[e]++;
+            }
+        }
+    }
+    return (long)found;
+}
@@ -44,6 +44,11 @@ extern struct stemmer * create_stemmer(void);
 extern void free_stemmer(struct stemmer * z);
 
 extern int stem(struct stemmer * z, JFISH_UNICODE * b, int k);
+extern void stem_many(struct stemmer * z, JFISH_UNICODE * b, const int * lens,
+                      size_t count, int * stem_lens);
+extern size_t stem_text(struct stemmer * z, const JFISH_UNICODE * text, size_t len,
+                        size_t * pos, JFISH_UNICODE * stems, size_t * offsets,
+                        size_t * spans, size_t count);
 
 
 
@@ -272,9 +277,10 @@ static void step1c(struct stemmer * z)
 
 /* step2(z) maps double suffices to single ones. so -ization ( = -ize plus
    -ation) maps to -ize etc. note that the string before the suffix must give
-   m(z) > 0. */
+   m(z) > 0. step1ab(z) may leave a single character, which has no
+   suffix and nothing before it to read. */
 
-static void step2(struct stemmer * z) { switch (z->b[z->k-1])
+static void step2(struct stemmer * z) { if (z->k == 0) return; switch (z->b[z->k-1])
 {
    case 'a': if (ends(z, 7, "ational")) { r(z, 3, "ate"); break; }
              if (ends(z, 6, "tional")) { r(z, 4, "tion"); break; }
@@ -333,7 +339,8 @@ static void step3(struct stemmer * z) { switch (z->b[z->k])
 /* step4(z) takes off -ant, -ence etc., in context <c>vcvc<v>. */
 
 static void step4(struct stemmer * z)
-{  switch (z->b[z->k-1])
+{  if (z->k == 0) return;
+   switch (z->b[z->k-1])
    {  case 'a': if (ends(z, 2, "al")) break; return;
       case 'c': if (ends(z, 4, "ance")) break;
                 if (ends(z, 4, "ence")) break; return;
@@ -345,7 +352,7 @@ static void step4(struct stemmer * z)
                 if (ends(z, 5, "ement")) break;
                 if (ends(z, 4, "ment")) break;
                 if (ends(z, 3, "ent")) break; return;
-      case 'o': if (ends(z, 3, "ion") && (z->b[z->j] == 's' || z->b[z->j] == 't')) break;
+      case 'o': if (ends(z, 3, "ion") && z->j >= 0 && (z->b[z->j] == 's' || z->b[z->j] == 't')) break;
                 if (ends(z, 2, "ou")) break; return;
                 /* takes care of -ous */
       case 's': if (ends(z, 3, "ism")) break; return;
@@ -393,3 +400,68 @@ extern int stem(struct stemmer * z, JFISH_UNICODE * b, int k)
    step1ab(z); step1c(z); step2(z); step3(z); step4(z); step5(z);
    return z->k;
 }
+
+/* stem_many(z, b, lens, count, stem_lens) stems count words laid end to
+   end in b, word i being lens[i] characters long, reusing the one stemmer
+   z. Each word is stemmed in place, its stem being the first stem_lens[i]
+   characters of it.
+*/
+
+extern void stem_many(struct stemmer * z, JFISH_UNICODE * b, const int * lens,
+                      size_t count, int * stem_lens)
+{
+   size_t i;
+   for (i = 0; i < count; i++)
+   {  stem_lens[i] = stem(z, b, lens[i] - 1) + 1;
+      b += lens[i];
+   }
+}
+
+/* wordchar(c) is TRUE when c belongs in a word: ASCII letters and digits,
+   and beyond ASCII whatever Unicode counts as a letter or a number, as
+   str.isalnum() does.
+*/
+
+static int wordchar(JFISH_UNICODE c)
+{  if (c < 0x80) return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+   return Py_UNICODE_ISALNUM((Py_UCS4)c);
+}
+
+/* stem_text(z, text, len, pos, stems, offsets, spans, count) splits text
+   into words at spaces and punctuation, lower cases their ASCII letters
+   and stems them, in one pass starting at *pos and ending after count
+   words or at len, whichever is first. *pos is left where it stopped.
+
+   Word i found is text[spans[2*i]] ... text[spans[2*i+1]-1]. Its stem is
+   stems[offsets[i]] ... stems[offsets[i+1]-1], offsets[0] being where the
+   stems start and the rest filled in here. stems needs room for as many
+   characters as the words have, which len always covers. The number of
+   words found is returned.
+*/
+
+extern size_t stem_text(struct stemmer * z, const JFISH_UNICODE * text, size_t len,
+                        size_t * pos, JFISH_UNICODE * stems, size_t * offsets,
+                        size_t * spans, size_t count)
+{
+   size_t i = *pos;
+   size_t n = 0;
+   JFISH_UNICODE * b = stems + offsets[0];
+   int k;
+   for (;;)
+   {  while (i < len && !wordchar(text[i])) i++;
+      if (i == len || n == count) break;
+      spans[2*n] = i;
+      k = 0;
+      for (; i < len && wordchar(text[i]); i++)
+      {  JFISH_UNICODE c = text[i];
+         b[k++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+      }
+      spans[2*n+1] = i;
+      k = stem(z, b, k - 1) + 1;
+      b += k;
+      n++;
+      offsets[n] = offsets[n-1] + k;
+   }
+   *pos = i;
+   return n;
+}
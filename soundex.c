@@ -1,70 +1,93 @@
 #include "jellyfish.h"
-#include <ctype.h>
 #include <stdlib.h>
 
-char* soundex(const char *str)
+/* The soundex digit of every byte, 0 for those that have none. */
+static const char soundex_digits[256] = {
+    ['B'] = '1', ['F'] = '1', ['P'] = '1', ['V'] = '1',
+    ['b'] = '1', ['f'] = '1', ['p'] = '1', ['v'] = '1',
+    ['C'] = '2', ['G'] = '2', ['J'] = '2', ['K'] = '2',
+    ['Q'] = '2', ['S'] = '2', ['X'] = '2', ['Z'] = '2',
+    ['c'] = '2', ['g'] = '2', ['j'] = '2', ['k'] = '2',
+    ['q'] = '2', ['s'] = '2', ['x'] = '2', ['z'] = '2',
+    ['D'] = '3', ['T'] = '3', ['d'] = '3', ['t'] = '3',
+    ['L'] = '4', ['l'] = '4',
+    ['M'] = '5', ['N'] = '5', ['m'] = '5', ['n'] = '5',
+    ['R'] = '6', ['r'] = '6',
+};
+
+void soundex_into(const char *str, char *code)
 {
-    const char *s;
+    const unsigned char *s = (const unsigned char*)str;
     char c, prev;
     int i;
-    char *result = calloc(5, sizeof(char));
-
-    if (!result) {
-        return NULL;
-    }
 
-    if (!*str) {
-        return result;
+    if (!*s) {
+        code[0] = '\0';
+        return;
     }
 
-    prev = '\0';
-    for(s = str, i = 1; *s && i < 4; s++) {
-        switch(tolower(*s)) {
-        case 'b':
-        case 'f':
-        case 'p':
-        case 'v':
-            c = '1';
-            break;
-        case 'c':
-        case 'g':
-        case 'j':
-        case 'k':
-        case 'q':
-        case 's':
-        case 'x':
-        case 'z':
-            c = '2';
-            break;
-        case 'd':
-        case 't':
-            c = '3';
-            break;
-        case 'l':
-            c = '4';
-            break;
-        case 'm':
-        case 'n':
-            c = '5';
-            break;
-        case 'r':
-            c = '6';
-            break;
-        default:
-            c = '\0';
-        }
-
-        if (c && c != prev && s != str) {
-            result[i++] = c;
+    prev = soundex_digits[*s];
+    for (s++, i = 1; *s && i < 4; s++) {
+        c = soundex_digits[*s];
+        if (c && c != prev) {
+            code[i++] = c;
         }
         prev = c;
     }
 
     for ( ; i < 4; i++) {
-        result[i] = '0';
+        code[i] = '0';
     }
+    code[4] = '\0';
 
-    result[0] = toupper(*str);
+    c = str[0];
+    code[0] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+char* soundex(const char *str)
+{
+    char *result = malloc(SOUNDEX_SIZE);
+
+    if (!result) {
+        return NULL;
+    }
 
+    soundex_into(str, result);
     return result;
 }
+
+/* The three digits are base 7, under the first character, so packed codes
+   sort the way the codes themselves do. */
+uint16_t soundex_pack(const char *code)
+{
+    const unsigned char *c = (const unsigned char*)code;
+
+    if (!c[0]) {
+        return SOUNDEX_EMPTY;
+    }
+    if (c[0] >= 0x80) {
+        return SOUNDEX_UNPACKABLE;
+    }
+    return (uint16_t)(c[0] * 343 + (c[1] - '0') * 49 + (c[2] - '0') * 7 + (c[3] - '0'));
+}
+
+int soundex_unpack(uint16_t packed, char *code)
+{
+    int i;
+
+    if (packed == SOUNDEX_EMPTY) {
+        code[0] = '\0';
+        return 1;
+    }
+    if (packed < 343 || packed >= 128 * 343) {
+        return 0;
+    }
+
+    code[0] = (char)(packed / 343);
+    for (i = 3; i > 0; i--) {
+        code[i] = '0' + packed % 7;
+        packed /= 7;
+    }
+    code[4] = '\0';
+    return 1;
+}
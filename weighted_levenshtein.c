@@ -3,54 +3,424 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
 
-double weighted_levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, PyObject *insert_weights, PyObject *delete_weights, PyObject *substitute_weights)
+/*
+
+  A weight table is the native form of the insert/delete/substitute weight
+  dicts.  Insert and delete weights of code points below 256 are looked up
+  directly, anything else goes through a small open addressing hash keyed by
+  the code point (or by the pair of code points, for substitutions).  Keys
+  are stored plus one so that 0 marks an empty slot.
+
+  Weights that are not in the table default to 1.0.  Once built, a table is
+  never written to by the distance kernel, so it can be shared between
+  threads.
+
+  The table also keeps the smallest insert and delete weight ever set and
+  whether any weight is negative, which is all the cost bounded distance
+  needs for its pruning.
+
+*/
+
+#define WEIGHT_TABLE_LATIN 256
+#define WEIGHT_HASH_MIN_SLOTS 16
+#define WEIGHT_STACK_COLS 64
+
+struct weight_hash {
+    size_t slots;
+    size_t used;
+    uint64_t *keys;
+    double *values;
+};
+
+struct weight_table {
+    double insert_latin[WEIGHT_TABLE_LATIN];
+    double delete_latin[WEIGHT_TABLE_LATIN];
+    struct weight_hash insert_wide;
+    struct weight_hash delete_wide;
+    struct weight_hash substitute;
+    double min_insert;
+    double min_delete;
+    int negative;
+};
+
+static uint64_t weight_hash_slot(uint64_t key, size_t slots)
+{
+    return (key * 0x9E3779B97F4A7C15ULL >> 32) & (slots - 1);
+}
+
+static const double* weight_hash_get(const struct weight_hash *h, uint64_t key)
+{
+    size_t i;
+
+    if (!h->used) {
+        return NULL;
+    }
+    key++;
+    for (i = weight_hash_slot(key, h->slots); h->keys[i]; i = (i + 1) & (h->slots - 1)) {
+        if (h->keys[i] == key) {
+            return &h->values[i];
+        }
+    }
+    return NULL;
+}
+
+static int weight_hash_grow(struct weight_hash *h)
+{
+    size_t i, j;
+    size_t slots = h->slots ? h->slots * 2 : WEIGHT_HASH_MIN_SLOTS;
+    uint64_t *keys = calloc(slots, sizeof(uint64_t));
+    double *values = malloc(slots * sizeof(double));
+
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return 0;
+    }
+
+    for (i = 0; i < h->slots; i++) {
+        if (!h->keys[i]) {
+            continue;
+        }
+        for (j = weight_hash_slot(h->keys[i], slots); keys[j]; j = (j + 1) & (slots - 1));
+        keys[j] = h->keys[i];
+        values[j] = h->values[i];
+    }
+
+    free(h->keys);
+    free(h->values);
+    h->keys = keys;
+    h->values = values;
+    h->slots = slots;
+    return 1;
+}
+
+static int weight_hash_set(struct weight_hash *h, uint64_t key, double value)
+{
+    size_t i;
+
+    /* keep the hash at most half full */
+    if (2 * (h->used + 1) > h->slots && !weight_hash_grow(h)) {
+        return 0;
+    }
+
+    key++;
+    for (i = weight_hash_slot(key, h->slots); h->keys[i]; i = (i + 1) & (h->slots - 1)) {
+        if (h->keys[i] == key) {
+            h->values[i] = value;
+            return 1;
+        }
+    }
+    h->keys[i] = key;
+    h->values[i] = value;
+    h->used++;
+    return 1;
+}
+
+static uint64_t pair_key(JFISH_UNICODE a, JFISH_UNICODE b)
+{
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+}
+
+struct weight_table* weight_table_create(void)
+{
+    size_t i;
+    struct weight_table *table = calloc(1, sizeof(struct weight_table));
+
+    if (!table) {
+        return NULL;
+    }
+    for (i = 0; i < WEIGHT_TABLE_LATIN; i++) {
+        table->insert_latin[i] = 1.0;
+        table->delete_latin[i] = 1.0;
+    }
+    table->min_insert = 1.0;
+    table->min_delete = 1.0;
+    return table;
+}
+
+void weight_table_free(struct weight_table *table)
+{
+    if (!table) {
+        return;
+    }
+    free(table->insert_wide.keys);
+    free(table->insert_wide.values);
+    free(table->delete_wide.keys);
+    free(table->delete_wide.values);
+    free(table->substitute.keys);
+    free(table->substitute.values);
+    free(table);
+}
+
+int weight_table_set_insert(struct weight_table *table, JFISH_UNICODE c, double weight)
+{
+    table->min_insert = MIN(table->min_insert, weight);
+    table->negative |= weight < 0;
+    if ((uint32_t)c < WEIGHT_TABLE_LATIN) {
+        table->insert_latin[c] = weight;
+        return 1;
+    }
+    return weight_hash_set(&table->insert_wide, (uint32_t)c, weight);
+}
+
+int weight_table_set_delete(struct weight_table *table, JFISH_UNICODE c, double weight)
+{
+    table->min_delete = MIN(table->min_delete, weight);
+    table->negative |= weight < 0;
+    if ((uint32_t)c < WEIGHT_TABLE_LATIN) {
+        table->delete_latin[c] = weight;
+        return 1;
+    }
+    return weight_hash_set(&table->delete_wide, (uint32_t)c, weight);
+}
+
+int weight_table_set_substitute(struct weight_table *table, JFISH_UNICODE a, JFISH_UNICODE b, double weight)
+{
+    table->negative |= weight < 0;
+    return weight_hash_set(&table->substitute, pair_key(a, b), weight);
+}
+
+static double insert_weight(const struct weight_table *table, JFISH_UNICODE c)
+{
+    const double *w;
+
+    if ((uint32_t)c < WEIGHT_TABLE_LATIN) {
+        return table->insert_latin[c];
+    }
+    w = weight_hash_get(&table->insert_wide, (uint32_t)c);
+    return w ? *w : 1.0;
+}
+
+static double delete_weight(const struct weight_table *table, JFISH_UNICODE c)
+{
+    const double *w;
+
+    if ((uint32_t)c < WEIGHT_TABLE_LATIN) {
+        return table->delete_latin[c];
+    }
+    w = weight_hash_get(&table->delete_wide, (uint32_t)c);
+    return w ? *w : 1.0;
+}
+
+static double substitute_weight(const struct weight_table *table, JFISH_UNICODE a, JFISH_UNICODE b)
+{
+    const double *w = weight_hash_get(&table->substitute, pair_key(a, b));
+    return w ? *w : 1.0;
+}
+
+/* Returns the code point of a single character str, or -1 for anything
+   else (which can never match a dict lookup made by the distance). */
+static long single_char(PyObject *obj)
+{
+    if (!PyUnicode_Check(obj) || PyUnicode_GET_LENGTH(obj) != 1) {
+        return -1;
+    }
+    return (long)PyUnicode_READ_CHAR(obj, 0);
+}
+
+static int add_unary_weights(struct weight_table *table, PyObject *weights,
+        int (*set)(struct weight_table*, JFISH_UNICODE, double))
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long c;
+    double weight;
+    int ok = 1;
+
+    /* PyDict_Next is not safe against concurrent writers without it */
+    Py_BEGIN_CRITICAL_SECTION(weights);
+    while (ok && PyDict_Next(weights, &pos, &key, &value)) {
+        c = single_char(key);
+        if (c < 0) {
+            continue;
+        }
+        weight = PyFloat_AsDouble(value);
+        if (weight == -1.0 && PyErr_Occurred()) {
+            ok = 0;
+        } else if (!set(table, (JFISH_UNICODE)c, weight)) {
+            PyErr_NoMemory();
+            ok = 0;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return ok;
+}
+
+static int add_substitute_weights(struct weight_table *table, PyObject *weights)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long a, b;
+    double weight;
+    int ok = 1;
+
+    Py_BEGIN_CRITICAL_SECTION(weights);
+    while (ok && PyDict_Next(weights, &pos, &key, &value)) {
+        if (!PyTuple_Check(key) || PyTuple_GET_SIZE(key) != 2) {
+            continue;
+        }
+        a = single_char(PyTuple_GET_ITEM(key, 0));
+        b = single_char(PyTuple_GET_ITEM(key, 1));
+        if (a < 0 || b < 0) {
+            continue;
+        }
+        weight = PyFloat_AsDouble(value);
+        if (weight == -1.0 && PyErr_Occurred()) {
+            ok = 0;
+        } else if (!weight_table_set_substitute(table, (JFISH_UNICODE)a, (JFISH_UNICODE)b, weight)) {
+            PyErr_NoMemory();
+            ok = 0;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return ok;
+}
+
+struct weight_table* weight_table_from_dicts(PyObject *insert_weights, PyObject *delete_weights, PyObject *substitute_weights)
+{
+    struct weight_table *table = weight_table_create();
+
+    if (!table) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    if (!add_unary_weights(table, insert_weights, weight_table_set_insert) ||
+        !add_unary_weights(table, delete_weights, weight_table_set_delete) ||
+        !add_substitute_weights(table, substitute_weights)) {
+        weight_table_free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+double weighted_levenshtein_distance_table_max(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct weight_table *table, double max_cost)
 {
     size_t rows = s1_len + 1;
     size_t cols = s2_len + 1;
     size_t i, j;
+    size_t lo, hi, next_lo, next_hi;
 
     double result;
+    double bound;
     double delete_cost, insert_cost, substitute_cost;
-    PyObject *insert_weight, *delete_weight, *substitute_weight;
-    double *dist = malloc(rows * cols * sizeof(double));
-    if (!dist) {
-        return -1;
-    }
+    double row_delete_weight, diag, up;
+    double stack_buf[2 * WEIGHT_STACK_COLS];
+    double *buf = stack_buf;
+    double *row, *insert_weights;
+
+    /* negative weights break both the lower bound and the pruning, such a
+       table is only checked against max_cost once done */
+    bound = max_cost < 0 || table->negative ? HUGE_VAL : max_cost;
 
-    for (i = 0; i < rows; i++) {
-        dist[i * cols] = i;
+    /* every extra character of the longer string costs at least the
+       cheapest insert (or delete), or 1 along the border */
+    if (s1_len > s2_len && (s1_len - s2_len) * table->min_delete > bound) {
+        return HUGE_VAL;
+    }
+    if (s2_len > s1_len && (s2_len - s1_len) * table->min_insert > bound) {
+        return HUGE_VAL;
     }
 
+    if (cols > WEIGHT_STACK_COLS) {
+        buf = malloc(2 * cols * sizeof(double));
+        if (!buf) {
+            return -1;
+        }
+    }
+    row = buf;
+    insert_weights = buf + cols;
 
     for (j = 0; j < cols; j++) {
-        dist[j] = j;
+        row[j] = j;
     }
-
     for (j = 1; j < cols; j++) {
-        for (i = 1; i < rows; i++) {
+        insert_weights[j] = insert_weight(table, s2[j - 1]);
+    }
+
+    /* Cells above bound can never lead back under it, so only columns
+       lo ... hi of the previous row matter.  Cells outside that window keep
+       stale values, which are above bound too. */
+    lo = 1;
+    hi = cols - 1;
+
+    /* row[j] holds dist[i - 1][j] until it is overwritten with dist[i][j],
+       diag carries dist[i - 1][j - 1] along the row */
+    for (i = 1; i < rows; i++) {
+        row_delete_weight = delete_weight(table, s1[i - 1]);
+        diag = row[lo - 1];
+        if (lo == 1) {
+            row[0] = i;
+        }
+        next_lo = row[0] <= bound ? 1 : 0;
+        next_hi = 0;
+        for (j = lo; j < cols; j++) {
+            up = row[j];
             if (s1[i - 1] == s2[j - 1]) {
-                dist[(i * cols) + j] = dist[((i - 1) * cols) + (j - 1)];
+                row[j] = diag;
             } else {
-                delete_weight = PyDict_GetItem(delete_weights, Py_BuildValue("u#", &s1[i-1], 1));
-                insert_weight = PyDict_GetItem(insert_weights, Py_BuildValue("u#", &s2[j-1], 1));
-                substitute_weight = PyDict_GetItem(substitute_weights, Py_BuildValue("(u#u#)", &s1[i-1], 1, &s2[j-1], 1));
+                delete_cost = up + row_delete_weight;
+                insert_cost = row[j - 1] + insert_weights[j];
+                substitute_cost = diag + substitute_weight(table, s1[i - 1], s2[j - 1]);
 
-                delete_cost = dist[((i - 1) * cols) + j] + (delete_weight!=NULL?PyFloat_AsDouble(delete_weight):1.0); 
-                insert_cost = dist[(i * cols) + (j - 1)] + (insert_weight!=NULL?PyFloat_AsDouble(insert_weight):1.0);
-                substitute_cost = dist[((i - 1) * cols) + (j - 1)] + (substitute_weight!=NULL?PyFloat_AsDouble(substitute_weight):1.0);
+                row[j] = MIN(delete_cost, MIN(insert_cost, substitute_cost));
+            }
+            diag = up;
 
-                dist[(i * cols) + j] = MIN(delete_cost, MIN(insert_cost, substitute_cost));
+            if (row[j] <= bound) {
+                if (!next_lo) {
+                    next_lo = j;
+                }
+                next_hi = j;
+            } else if (j > hi) {
+                /* past the old window, nothing is left to pull this row
+                   back under the bound */
+                break;
             }
         }
+
+        if (!next_lo) {
+            /* every cell of this row is above the bound */
+            result = HUGE_VAL;
+            goto done;
+        }
+        lo = next_lo;
+        hi = next_hi;
+    }
+
+    result = row[cols - 1];
+    if (max_cost >= 0 && result > max_cost) {
+        result = HUGE_VAL;
+    }
+
+ done:
+    if (buf != stack_buf) {
+        free(buf);
     }
 
+    return result;
+}
+
+double weighted_levenshtein_distance_table(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, const struct weight_table *table)
+{
+    return weighted_levenshtein_distance_table_max(s1, s1_len, s2, s2_len, table, -1);
+}
+
+double weighted_levenshtein_distance(const JFISH_UNICODE *s1, int s1_len, const JFISH_UNICODE *s2, int s2_len, PyObject *insert_weights, PyObject *delete_weights, PyObject *substitute_weights)
+{
+    double result;
+    struct weight_table *table = weight_table_from_dicts(insert_weights, delete_weights, substitute_weights);
 
+    if (!table) {
+        return -1;
+    }
 
-    result = dist[(cols * rows) - 1];
-//    printf("Final : %f\n", dist[(cols * rows) - 1]);
-    fflush(stdout);
-    free(dist);
+    result = weighted_levenshtein_distance_table(s1, s1_len, s2, s2_len, table);
+    weight_table_free(table);
 
     return result;
 }